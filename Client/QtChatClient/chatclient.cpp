@@ -1,15 +1,42 @@
 #include "chatclient.h"
-#include <QDataStream>
 #include <QDebug>
 #include <QJsonArray>
-#include <QJsonDocument>
 #include <QJsonObject>
 #include "chatmessage.h"
 
+namespace {
+
+// A history page from a server without streaming arrives in one frame, so
+// allow more than the server accepts from clients.
+const quint32 kMaxIncomingFrameSize = 64 * 1024 * 1024;
+
+// Acks for everything received or read within this window share one frame
+const int kAckInterval = 500;
+
+} // namespace
+
 ChatClient::ChatClient(QObject *parent)
     : QObject(parent)
     , m_socket(new QTcpSocket(this))
+    , m_codec(kMaxIncomingFrameSize)
+    , m_encoding(FrameCodec::Json)
+    , m_flushTimer(new QTimer(this))
+    , m_lastCorrelationId(0)
+    , m_deliveredId(0)
+    , m_readId(0)
+    , m_ackedDeliveredId(0)
+    , m_ackedReadId(0)
+    , m_ackTimer(new QTimer(this))
 {
+    // Everything sent during one event-loop pass goes out in one write
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setInterval(0);
+    connect(m_flushTimer, &QTimer::timeout, this, &ChatClient::flushOutput);
+
+    m_ackTimer->setSingleShot(true);
+    m_ackTimer->setInterval(kAckInterval);
+    connect(m_ackTimer, &QTimer::timeout, this, &ChatClient::sendAck);
+
     connect(m_socket, &QTcpSocket::connected, this, &ChatClient::onConnected);
     connect(m_socket, &QTcpSocket::disconnected, this, &ChatClient::onDisconnected);
     connect(m_socket, &QTcpSocket::readyRead, this, &ChatClient::onReadyRead);
@@ -36,6 +63,8 @@ void ChatClient::connectToServer(const QString &host, quint16 port)
 
 void ChatClient::disconnectFromServer()
 {
+    sendAck(); // Whatever is still waiting for the ack timer
+    flushOutput();
     if (m_socket->state() != QAbstractSocket::UnconnectedState) {
         m_socket->disconnectFromHost();
     }
@@ -56,24 +85,61 @@ QString ChatClient::username() const
     return m_username;
 }
 
-void ChatClient::sendMessage(const QString &to, const QString &text)
+QStringList ChatClient::onlineUsers() const
+{
+    QStringList users(m_onlineUsers.cbegin(), m_onlineUsers.cend());
+    users.sort();
+    return users;
+}
+
+ChatMessage ChatClient::sendMessage(const QString &to, const QString &text)
+{
+    ChatMessage msg(m_username, to, text, ChatMessage::Private, QDateTime::currentDateTime());
+    if (!isConnected()) {
+        // Queued so the caller has shown the message by the time it fails
+        QMetaObject::invokeMethod(
+            this,
+            [this, msg] {
+                const QString reason = "Not connected to server";
+                emit sendFailed(msg, reason);
+                emit errorOccurred(reason);
+            },
+            Qt::QueuedConnection);
+        return msg;
+    }
+
+    // The server answers with a "sent" ack carrying cid instead of echoing
+    // the whole message back
+    const quint64 correlationId = ++m_lastCorrelationId;
+    m_pendingSends.insert(correlationId, msg);
+
+    QJsonObject fields;
+    fields["cid"] = static_cast<qint64>(correlationId);
+    queueFrame(FrameCodec::encodeChat(msg, m_encoding, fields));
+    return msg;
+}
+
+void ChatClient::requestChatHistory(const QString &withUser, qint64 before, int limit)
 {
     if (!isConnected()) {
-        emit errorOccurred("Not connected to server");
         return;
     }
 
     QJsonObject obj;
-    obj["type"] = "chat";
+    obj["type"] = "request_history";
     obj["from"] = m_username;
-    obj["to"] = to;
-    obj["text"] = text;
-    obj["timestamp"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+    obj["with"] = withUser;
+    if (before >= 0) {
+        obj["before"] = before;
+    }
+    if (limit > 0) {
+        obj["limit"] = limit;
+    }
 
     sendJson(obj);
 }
 
-void ChatClient::requestChatHistory(const QString &withUser)
+void ChatClient::requestNewerHistory(const QString &withUser, qint64 after, int limit)
 {
     if (!isConnected()) {
         return;
@@ -83,35 +149,96 @@ void ChatClient::requestChatHistory(const QString &withUser)
     obj["type"] = "request_history";
     obj["from"] = m_username;
     obj["with"] = withUser;
+    obj["after"] = qMax<qint64>(0, after);
+    if (limit > 0) {
+        obj["limit"] = limit;
+    }
 
     sendJson(obj);
 }
 
+void ChatClient::markRead(quint64 messageId)
+{
+    if (messageId > m_readId) {
+        m_readId = messageId;
+        markDelivered(messageId);
+        if (!m_ackTimer->isActive()) {
+            m_ackTimer->start();
+        }
+    }
+}
+
+void ChatClient::markDelivered(quint64 messageId)
+{
+    if (messageId > m_deliveredId) {
+        m_deliveredId = messageId;
+        if (!m_ackTimer->isActive()) {
+            m_ackTimer->start();
+        }
+    }
+}
+
+void ChatClient::sendAck()
+{
+    if (!isConnected()
+        || (m_deliveredId == m_ackedDeliveredId && m_readId == m_ackedReadId)) {
+        return;
+    }
+
+    // Only the watermarks that moved are sent
+    QJsonObject obj;
+    obj["type"] = "ack";
+    if (m_deliveredId != m_ackedDeliveredId) {
+        obj["delivered"] = static_cast<qint64>(m_deliveredId);
+    }
+    if (m_readId != m_ackedReadId) {
+        obj["read"] = static_cast<qint64>(m_readId);
+    }
+    sendJson(obj);
+
+    m_ackedDeliveredId = m_deliveredId;
+    m_ackedReadId = m_readId;
+}
+
 void ChatClient::sendJson(const QJsonObject &obj)
 {
-    QJsonDocument doc(obj);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
+    queueFrame(FrameCodec::encode(obj, m_encoding));
+}
 
-    // Length-prefixed protocol
-    QByteArray packet;
-    QDataStream stream(&packet, QIODevice::WriteOnly);
-    stream.setVersion(QDataStream::Qt_6_0);
-    stream << static_cast<quint32>(data.size());
-    packet.append(data);
+void ChatClient::queueFrame(const QByteArray &frame)
+{
+    m_outBuffer.append(frame);
+    if (!m_flushTimer->isActive()) {
+        m_flushTimer->start();
+    }
+}
+
+void ChatClient::flushOutput()
+{
+    if (m_outBuffer.isEmpty()) {
+        return;
+    }
 
-    m_socket->write(packet);
-    m_socket->flush();
+    if (isConnected()) {
+        m_socket->write(m_outBuffer);
+        m_socket->flush();
+    }
+    m_outBuffer.clear();
 }
 
 void ChatClient::onConnected()
 {
     emit logMessage("Connected to server");
-    m_readBuffer.clear();
+    m_codec.clear();
+    m_encoding = FrameCodec::Json;
 
-    // Send registration
+    // Send registration, offering binary frames
     QJsonObject obj;
     obj["type"] = "register";
     obj["username"] = m_username;
+    obj["encodings"] = QJsonArray{FrameCodec::encodingName(FrameCodec::Cbor),
+                                  FrameCodec::encodingName(FrameCodec::Json)};
+    obj["features"] = QJsonArray{"presence_delta", "history_stream", "send_ack"};
     sendJson(obj);
 
     emit connected();
@@ -120,79 +247,197 @@ void ChatClient::onConnected()
 void ChatClient::onDisconnected()
 {
     emit logMessage("Disconnected from server");
-    m_readBuffer.clear();
+    m_codec.clear();
+    m_outBuffer.clear();
+    m_onlineUsers.clear();
+
+    // Whatever wasn't acked may or may not have arrived; if it did, the next
+    // history sync brings it back
+    const QList<ChatMessage> unconfirmed = m_pendingSends.values();
+    m_pendingSends.clear();
+    for (const ChatMessage &pending : unconfirmed) {
+        emit sendFailed(pending, "Disconnected before the server confirmed the message");
+    }
+
+    // The server keeps the highest watermarks it was sent, so a new session
+    // can start over
+    m_ackTimer->stop();
+    m_deliveredId = 0;
+    m_readId = 0;
+    m_ackedDeliveredId = 0;
+    m_ackedReadId = 0;
     emit disconnected();
 }
 
 void ChatClient::onReadyRead()
 {
-    m_readBuffer.append(m_socket->readAll());
-
-    while (m_readBuffer.size() >= static_cast<int>(sizeof(quint32))) {
-        QDataStream stream(&m_readBuffer, QIODevice::ReadOnly);
-        stream.setVersion(QDataStream::Qt_6_0);
+    m_codec.append(m_socket->readAll());
 
-        quint32 msgSize;
-        stream >> msgSize;
-
-        if (m_readBuffer.size() < static_cast<int>(sizeof(quint32) + msgSize)) {
-            break;
+    QByteArrayView payload;
+    QList<ChatMessage> messages;
+    while (m_codec.nextFrame(&payload)) {
+        bool ok;
+        messages.clear();
+        QJsonObject obj = FrameCodec::decodeObject(payload, &ok, &messages);
+        if (ok) {
+            processIncomingJson(obj, messages);
         }
+    }
 
-        m_readBuffer.remove(0, sizeof(quint32));
-        QByteArray jsonData = m_readBuffer.left(msgSize);
-        m_readBuffer.remove(0, msgSize);
-
-        QJsonDocument doc = QJsonDocument::fromJson(jsonData);
-        if (doc.isObject()) {
-            processIncomingJson(doc.object());
-        }
+    if (m_codec.frameTooLarge()) {
+        emit errorOccurred("Server sent an oversized frame");
+        m_socket->abort();
     }
 }
 
-void ChatClient::processIncomingJson(const QJsonObject &obj)
+// messages are the ones the frame carries, as decoded by FrameCodec
+void ChatClient::processIncomingJson(const QJsonObject &obj, const QList<ChatMessage> &messages)
 {
     QString type = obj["type"].toString();
 
     if (type == "chat") {
-        ChatMessage msg = ChatMessage::fromJson(obj);
-        emit messageReceived(msg);
+        if (messages.isEmpty()) {
+            return;
+        }
+        const ChatMessage msg = messages.constFirst();
+        markDelivered(msg.id());
+        if (msg.from() != m_username || !finishPendingEcho(msg)) {
+            emit messageReceived(msg);
+        }
 
         // Log for debugging
         if (msg.type() == ChatMessage::Broadcast || msg.type() == ChatMessage::ServerAlert) {
             emit logMessage(QString("Received broadcast/alert from: %1").arg(msg.from()));
         }
+    } else if (type == "sent") {
+        handleSent(obj);
     } else if (type == "user_list") {
         QJsonArray arr = obj["users"].toArray();
         QStringList users;
         for (const auto &val : arr) {
             users.append(val.toString());
         }
+        m_onlineUsers = QSet<QString>(users.cbegin(), users.cend());
         emit userListUpdated(users);
+    } else if (type == "presence_join") {
+        handlePresenceDelta(obj, true);
+    } else if (type == "presence_leave") {
+        handlePresenceDelta(obj, false);
+    } else if (type == "history_chunk") {
+        handleHistoryChunk(obj, messages);
+    } else if (type == "history_end") {
+        handleHistoryEnd(obj);
     } else if (type == "chat_history") {
-        handleChatHistoryResponse(obj);
+        // Whole page in one frame, from servers without streaming
+        handleHistoryChunk(obj, messages);
+        handleHistoryEnd(obj);
+    } else if (type == "protocol") {
+        m_encoding = FrameCodec::encodingFromName(obj["encoding"].toString(), m_encoding);
+        emit logMessage(
+            QString("Using %1 frames").arg(FrameCodec::encodingName(m_encoding).toUpper()));
     } else if (type == "kick") {
         QString reason = obj["reason"].toString("You have been kicked");
         emit kicked(reason);
         disconnectFromServer();
     } else if (type == "error") {
-        emit errorOccurred(obj["message"].toString());
+        const QString reason = obj["message"].toString();
+        // A rejected message won't be acked
+        auto it = m_pendingSends.find(quint64(obj["cid"].toInteger(0)));
+        if (it != m_pendingSends.end()) {
+            const ChatMessage rejected = it.value();
+            m_pendingSends.erase(it);
+            emit sendFailed(rejected, reason);
+        }
+        emit errorOccurred(reason);
     }
 }
 
-void ChatClient::handleChatHistoryResponse(const QJsonObject &obj)
+void ChatClient::handlePresenceDelta(const QJsonObject &obj, bool joined)
 {
-    QString withUser = obj["with"].toString();
-    QJsonArray arr = obj["messages"].toArray();
+    // Only report users whose state actually changed
+    QStringList changed;
+    for (const auto &val : obj["users"].toArray()) {
+        QString user = val.toString();
+        if (joined && !m_onlineUsers.contains(user)) {
+            m_onlineUsers.insert(user);
+            changed.append(user);
+        } else if (!joined && m_onlineUsers.remove(user)) {
+            changed.append(user);
+        }
+    }
 
-    QList<ChatMessage> messages;
-    for (const auto &val : arr) {
-        if (val.isObject()) {
-            messages.append(ChatMessage::fromJson(val.toObject()));
+    if (changed.isEmpty()) {
+        return;
+    }
+
+    if (joined) {
+        emit usersJoined(changed);
+    } else {
+        emit usersLeft(changed);
+    }
+}
+
+void ChatClient::handleSent(const QJsonObject &obj)
+{
+    auto it = m_pendingSends.find(quint64(obj["cid"].toInteger(0)));
+    if (it == m_pendingSends.end()) {
+        return;
+    }
+    const ChatMessage pending = it.value();
+    m_pendingSends.erase(it);
+
+    ChatMessage sent = pending;
+    sent.setId(quint64(obj["id"].toInteger(0)));
+    const QDateTime timestamp = QDateTime::fromString(obj["timestamp"].toString(), Qt::ISODate);
+    if (timestamp.isValid()) {
+        sent.setTimestamp(timestamp);
+    }
+    markDelivered(sent.id());
+    emit messageSent(pending, sent);
+}
+
+// Servers from before "sent" acks echo the whole message back instead; the
+// echo finishes the oldest pending message it matches
+bool ChatClient::finishPendingEcho(const ChatMessage &echo)
+{
+    for (auto it = m_pendingSends.begin(); it != m_pendingSends.end(); ++it) {
+        if (it->to() == echo.to() && it->text() == echo.text()) {
+            const ChatMessage pending = it.value();
+            m_pendingSends.erase(it);
+            emit messageSent(pending, echo);
+            return true;
         }
     }
+    return false;
+}
+
+void ChatClient::handleHistoryChunk(const QJsonObject &obj, const QList<ChatMessage> &messages)
+{
+    if (messages.isEmpty()) {
+        return;
+    }
+
+    for (const auto &msg : messages) {
+        markDelivered(msg.id());
+    }
+    emit chatHistoryChunkReceived(obj["with"].toString(), messages, obj["start"].toInteger(0));
+}
+
+void ChatClient::handleHistoryEnd(const QJsonObject &obj)
+{
+    HistoryPage page = NewestPage;
+    if (obj.contains("after")) {
+        page = NewerPage;
+    } else if (obj.contains("before")) {
+        page = OlderPage;
+    }
 
-    emit chatHistoryReceived(withUser, messages);
+    const qint64 start = obj["start"].toInteger(0);
+    emit chatHistoryFinished(obj["with"].toString(),
+                             start,
+                             obj["end"].toInteger(start),
+                             obj["has_more"].toBool(false),
+                             page);
 }
 
 void ChatClient::onSocketErrorOccurred(QAbstractSocket::SocketError socketError)
@@ -2,11 +2,15 @@
 #define CHATCLIENT_H
 
 #include <QByteArray>
+#include <QMap>
 #include <QObject>
 #include <QPointer>
+#include <QSet>
 #include <QStringList>
 #include <QTcpSocket>
+#include <QTimer>
 #include "chatmessage.h"
+#include "framecodec.h"
 
 class ChatClient : public QObject
 {
@@ -24,17 +28,61 @@ public:
     void setUsername(const QString &username);
     QString username() const;
 
-    // Messaging
-    void sendMessage(const QString &to, const QString &text);
-    void requestChatHistory(const QString &withUser);
+    QStringList onlineUsers() const;
+
+    // Messaging. Returns the message as it should be shown right away; it
+    // is pending until messageSent() brings the server's id and timestamp,
+    // or sendFailed() reports that it won't be delivered.
+    ChatMessage sendMessage(const QString &to, const QString &text);
+
+    // Which request a history page answers
+    enum HistoryPage {
+        NewestPage, // requestChatHistory() without a cursor
+        OlderPage,  // requestChatHistory() with a cursor
+        NewerPage   // requestNewerHistory()
+    };
+
+    // Asks for the page of up to limit messages just before the cursor
+    // (the newest page when before < 0); limit <= 0 uses the server default
+    void requestChatHistory(const QString &withUser, qint64 before = -1, int limit = 0);
+    // Asks for up to limit messages from the cursor on, oldest first: what a
+    // client holding everything before after has missed
+    void requestNewerHistory(const QString &withUser, qint64 after, int limit = 0);
+
+    // Acknowledgements. Messages received are reported delivered on their
+    // own; the UI reports the newest message id it has shown. Both go out
+    // together in one small frame, at most twice a second.
+    void markRead(quint64 messageId);
 
 signals:
     void connected();
     void disconnected();
     void errorOccurred(const QString &error);
     void messageReceived(const ChatMessage &message);
-    void chatHistoryReceived(const QString &withUser, const QList<ChatMessage> &messages);
-    void userListUpdated(const QStringList &users);
+    // A message from sendMessage() reached the server; sent is pending with
+    // the server's id and timestamp
+    void messageSent(const ChatMessage &pending, const ChatMessage &sent);
+    // A message from sendMessage() was rejected, could not be sent, or was
+    // still unconfirmed when the connection closed. Always emitted after
+    // sendMessage() returned.
+    void sendFailed(const ChatMessage &pending, const QString &reason);
+    // History arrives as chunks of messages at positions [start, start + size).
+    // A backward page sends its newest chunk first.
+    void chatHistoryChunkReceived(const QString &withUser,
+                                  const QList<ChatMessage> &messages,
+                                  qint64 start);
+    // The page [start, end) is complete. start is the cursor to pass as
+    // "before" for the page preceding it, end the one to pass as "after" for
+    // the page following it. hasMore tells whether there is such a page in
+    // the direction that was asked for.
+    void chatHistoryFinished(const QString &withUser,
+                             qint64 start,
+                             qint64 end,
+                             bool hasMore,
+                             ChatClient::HistoryPage page);
+    void userListUpdated(const QStringList &users); // Full snapshot
+    void usersJoined(const QStringList &users);     // Incremental presence deltas
+    void usersLeft(const QStringList &users);
     void logMessage(const QString &msg);
     void kicked(const QString &reason);
 
@@ -48,12 +96,33 @@ private:
     Q_DISABLE_COPY(ChatClient)
 
     void sendJson(const QJsonObject &obj);
-    void processIncomingJson(const QJsonObject &obj);
-    void handleChatHistoryResponse(const QJsonObject &obj);
+    void queueFrame(const QByteArray &frame);
+    void flushOutput();
+    void processIncomingJson(const QJsonObject &obj, const QList<ChatMessage> &messages);
+    void handleHistoryChunk(const QJsonObject &obj, const QList<ChatMessage> &messages);
+    void handleHistoryEnd(const QJsonObject &obj);
+    void handlePresenceDelta(const QJsonObject &obj, bool joined);
+    void handleSent(const QJsonObject &obj);
+    bool finishPendingEcho(const ChatMessage &echo);
+    void markDelivered(quint64 messageId);
+    void sendAck();
 
     QPointer<QTcpSocket> m_socket;
     QString m_username;
-    QByteArray m_readBuffer;
+    QSet<QString> m_onlineUsers;
+    FrameCodec m_codec;
+    FrameCodec::Encoding m_encoding; // What we send; the server picks it at registration
+    QByteArray m_outBuffer;          // Frames queued during this event-loop pass
+    QTimer *m_flushTimer;
+
+    QMap<quint64, ChatMessage> m_pendingSends; // By correlation id, oldest first
+    quint64 m_lastCorrelationId;
+
+    quint64 m_deliveredId; // Newest message id received
+    quint64 m_readId;      // Newest message id shown
+    quint64 m_ackedDeliveredId;
+    quint64 m_ackedReadId;
+    QTimer *m_ackTimer;
 };
 
 #endif // CHATCLIENT_H
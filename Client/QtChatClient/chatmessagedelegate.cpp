@@ -0,0 +1,136 @@
+#include "chatmessagedelegate.h"
+#include <QListView>
+#include <QPainter>
+#include <QTextLayout>
+#include <QtMath>
+#include "chatmessage.h"
+#include "chatmessagemodel.h"
+
+namespace {
+
+const int kPadding = 6;       // Around each message
+const int kHeaderSpacing = 2; // Between the header line and the text
+
+} // namespace
+
+ChatMessageDelegate::ChatMessageDelegate(QListView *view)
+    : QStyledItemDelegate(view)
+    , m_view(view)
+{}
+
+void ChatMessageDelegate::setLocalUser(const QString &username)
+{
+    m_localUser = username;
+}
+
+void ChatMessageDelegate::paint(QPainter *painter,
+                                const QStyleOptionViewItem &option,
+                                const QModelIndex &index) const
+{
+    const auto *model = qobject_cast<const ChatMessageModel *>(index.model());
+    if (!model) {
+        QStyledItemDelegate::paint(painter, option, index);
+        return;
+    }
+
+    const ChatMessage &msg = model->message(index.row());
+    const Header head = header(msg);
+    const QRect rect = option.rect.adjusted(kPadding, kPadding, -kPadding, -kPadding);
+
+    painter->save();
+
+    // Header: "[hh:mm:ss] sender:"
+    const QFont bold = headerFont(option.font);
+    const QFontMetrics timeMetrics(option.font);
+    const QFontMetrics boldMetrics(bold);
+    const QString time = QString("[%1] ").arg(head.time);
+    painter->setFont(option.font);
+    painter->setPen(Qt::gray);
+    painter->drawText(rect.topLeft() + QPoint(0, boldMetrics.ascent()), time);
+    painter->setFont(bold);
+    painter->setPen(head.color);
+    painter->drawText(rect.topLeft()
+                          + QPoint(timeMetrics.horizontalAdvance(time), boldMetrics.ascent()),
+                      head.sender);
+
+    // Text, laid out again for painting; only visible rows get here
+    QTextLayout layout(msg.text(), option.font);
+    layoutText(layout, rect.width());
+    painter->setPen(msg.type() == ChatMessage::ServerAlert
+                        ? QColor(Qt::red)
+                        : option.palette.color(QPalette::Text));
+    layout.draw(painter, QPointF(rect.left(), rect.top() + boldMetrics.height() + kHeaderSpacing));
+
+    painter->restore();
+}
+
+QSize ChatMessageDelegate::sizeHint(const QStyleOptionViewItem &option,
+                                    const QModelIndex &index) const
+{
+    const auto *model = qobject_cast<const ChatMessageModel *>(index.model());
+    if (!model) {
+        return QStyledItemDelegate::sizeHint(option, index);
+    }
+
+    const int width = m_view->viewport()->width();
+    int height = model->cachedHeight(index.row(), width);
+    if (height < 0) {
+        height = measure(model->message(index.row()), option.font, width - 2 * kPadding);
+        model->cacheHeight(index.row(), width, height);
+    }
+    return QSize(width, height);
+}
+
+ChatMessageDelegate::Header ChatMessageDelegate::header(const ChatMessage &message) const
+{
+    Header head;
+    head.time = message.timestamp().toString("hh:mm:ss");
+    switch (message.type()) {
+    case ChatMessage::Broadcast:
+        head.sender = QString("[SERVER BROADCAST] %1:").arg(message.from());
+        head.color = QColor("#2196F3");
+        break;
+    case ChatMessage::ServerAlert:
+        head.sender = QString("[SERVER ALERT] %1:").arg(message.from());
+        head.color = Qt::red;
+        break;
+    case ChatMessage::Private:
+        head.sender = message.from() + ':';
+        head.color = QColor(message.from() == m_localUser ? "#4CAF50" : "#2196F3");
+        break;
+    }
+    return head;
+}
+
+int ChatMessageDelegate::measure(const ChatMessage &message, const QFont &font, int width) const
+{
+    QTextLayout layout(message.text(), font);
+    const qreal textHeight = layoutText(layout, qMax(1, width));
+    return 2 * kPadding + QFontMetrics(headerFont(font)).height() + kHeaderSpacing
+           + qCeil(textHeight);
+}
+
+// Wraps at word boundaries, or anywhere for words longer than a line
+qreal ChatMessageDelegate::layoutText(QTextLayout &layout, qreal width)
+{
+    QTextOption textOption;
+    textOption.setWrapMode(QTextOption::WrapAtWordBoundaryOrAnywhere);
+    layout.setTextOption(textOption);
+
+    qreal height = 0;
+    layout.beginLayout();
+    for (QTextLine line = layout.createLine(); line.isValid(); line = layout.createLine()) {
+        line.setLineWidth(width);
+        line.setPosition(QPointF(0, height));
+        height += line.height();
+    }
+    layout.endLayout();
+    return height;
+}
+
+QFont ChatMessageDelegate::headerFont(const QFont &font)
+{
+    QFont bold = font;
+    bold.setBold(true);
+    return bold;
+}
@@ -0,0 +1,47 @@
+#ifndef CHATMESSAGEDELEGATE_H
+#define CHATMESSAGEDELEGATE_H
+
+#include <QColor>
+#include <QStyledItemDelegate>
+
+class QListView;
+class QTextLayout;
+class ChatMessage;
+
+// Draws a ChatMessageModel row: a header line with the time and sender,
+// then the wrapped text. Only rows in the viewport are painted; a row's
+// height is measured once per view width and cached in the model.
+class ChatMessageDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+public:
+    explicit ChatMessageDelegate(QListView *view);
+
+    // Messages from this user are coloured as our own
+    void setLocalUser(const QString &username);
+
+    void paint(QPainter *painter,
+               const QStyleOptionViewItem &option,
+               const QModelIndex &index) const override;
+    QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+
+private:
+    Q_DISABLE_COPY(ChatMessageDelegate)
+
+    struct Header
+    {
+        QString time;
+        QString sender; // Includes the broadcast/alert prefix
+        QColor color;
+    };
+
+    Header header(const ChatMessage &message) const;
+    int measure(const ChatMessage &message, const QFont &font, int width) const;
+    static qreal layoutText(QTextLayout &layout, qreal width);
+    static QFont headerFont(const QFont &font);
+
+    QListView *m_view;
+    QString m_localUser;
+};
+
+#endif // CHATMESSAGEDELEGATE_H
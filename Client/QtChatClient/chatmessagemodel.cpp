@@ -0,0 +1,179 @@
+#include "chatmessagemodel.h"
+
+ChatMessageModel::ChatMessageModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , m_broadcastCount(0)
+    , m_newestId(0)
+{}
+
+int ChatMessageModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_messages.size());
+}
+
+QVariant ChatMessageModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_messages.size()) {
+        return QVariant();
+    }
+
+    const ChatMessage &msg = m_messages.at(index.row());
+    switch (role) {
+    case Qt::DisplayRole:
+        return msg.text();
+    case MessageRole:
+        return QVariant::fromValue(msg);
+    case FromRole:
+        return msg.from();
+    case TimestampRole:
+        return msg.timestamp();
+    case TypeRole:
+        return msg.type();
+    default:
+        break;
+    }
+    return QVariant();
+}
+
+const ChatMessage &ChatMessageModel::message(int row) const
+{
+    return m_messages.at(row);
+}
+
+QList<ChatMessage> ChatMessageModel::messages() const
+{
+    if (m_broadcastCount == 0) {
+        return m_messages; // Shared, not copied
+    }
+
+    QList<ChatMessage> conversation;
+    conversation.reserve(m_messages.size() - m_broadcastCount);
+    for (const ChatMessage &msg : m_messages) {
+        if (isConversationMessage(msg)) {
+            conversation.append(msg);
+        }
+    }
+    return conversation;
+}
+
+quint64 ChatMessageModel::newestId() const
+{
+    return m_newestId;
+}
+
+void ChatMessageModel::setMessages(const QList<ChatMessage> &messages)
+{
+    beginResetModel();
+    m_messages = messages;
+    m_layouts = QList<RowLayout>(messages.size());
+    m_broadcastCount = 0;
+    m_newestId = 0;
+    noteAdded(messages);
+    endResetModel();
+}
+
+void ChatMessageModel::appendMessage(const ChatMessage &message)
+{
+    appendMessages({message});
+}
+
+void ChatMessageModel::appendMessages(const QList<ChatMessage> &messages)
+{
+    if (messages.isEmpty()) {
+        return;
+    }
+
+    const int first = int(m_messages.size());
+    beginInsertRows(QModelIndex(), first, first + int(messages.size()) - 1);
+    m_messages.append(messages);
+    m_layouts.resize(m_messages.size());
+    noteAdded(messages);
+    endInsertRows();
+}
+
+void ChatMessageModel::prependMessages(const QList<ChatMessage> &messages)
+{
+    if (messages.isEmpty()) {
+        return;
+    }
+
+    beginInsertRows(QModelIndex(), 0, int(messages.size()) - 1);
+    m_messages = messages + m_messages;
+    m_layouts = QList<RowLayout>(messages.size()) + m_layouts;
+    noteAdded(messages);
+    endInsertRows();
+}
+
+bool ChatMessageModel::replaceMessage(const ChatMessage &before, const ChatMessage &after)
+{
+    // Pending messages are near the end
+    for (int row = int(m_messages.size()) - 1; row >= 0; --row) {
+        if (m_messages.at(row) == before) {
+            m_messages[row] = after;
+            m_newestId = qMax(m_newestId, after.id());
+            const QModelIndex changed = index(row);
+            emit dataChanged(changed, changed);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ChatMessageModel::removeMessage(const ChatMessage &message)
+{
+    for (int row = int(m_messages.size()) - 1; row >= 0; --row) {
+        if (m_messages.at(row) == message) {
+            beginRemoveRows(QModelIndex(), row, row);
+            if (!isConversationMessage(m_messages.at(row))) {
+                --m_broadcastCount;
+            }
+            m_messages.removeAt(row);
+            m_layouts.removeAt(row);
+            endRemoveRows();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ChatMessageModel::clear()
+{
+    if (m_messages.isEmpty()) {
+        return;
+    }
+
+    beginResetModel();
+    m_messages.clear();
+    m_layouts.clear();
+    m_broadcastCount = 0;
+    m_newestId = 0;
+    endResetModel();
+}
+
+int ChatMessageModel::cachedHeight(int row, int width) const
+{
+    const RowLayout &layout = m_layouts.at(row);
+    return layout.width == width ? layout.height : -1;
+}
+
+void ChatMessageModel::cacheHeight(int row, int width, int height) const
+{
+    RowLayout &layout = m_layouts[row];
+    layout.width = width;
+    layout.height = height;
+}
+
+bool ChatMessageModel::isConversationMessage(const ChatMessage &message)
+{
+    return message.type() == ChatMessage::Private;
+}
+
+void ChatMessageModel::noteAdded(const QList<ChatMessage> &messages)
+{
+    for (const ChatMessage &msg : messages) {
+        if (!isConversationMessage(msg)) {
+            ++m_broadcastCount;
+        }
+        m_newestId = qMax(m_newestId, msg.id());
+    }
+}
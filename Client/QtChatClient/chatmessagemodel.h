@@ -0,0 +1,70 @@
+#ifndef CHATMESSAGEMODEL_H
+#define CHATMESSAGEMODEL_H
+
+#include <QAbstractListModel>
+#include <QList>
+#include "chatmessage.h"
+
+// The messages of one conversation, oldest first, for a QListView with a
+// ChatMessageDelegate. Server broadcasts that arrive while the conversation
+// is shown are listed too, but are not part of messages().
+//
+// The model also keeps the delegate's per-row layout: the height of each
+// row at the width it was last laid out for. Rows keep their cached height
+// when messages are added around them, so a long conversation is measured
+// once rather than every time it is shown.
+class ChatMessageModel : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    enum Roles {
+        MessageRole = Qt::UserRole + 1, // The ChatMessage itself
+        FromRole,
+        TimestampRole,
+        TypeRole // ChatMessage::MessageType
+    };
+
+    explicit ChatMessageModel(QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+    const ChatMessage &message(int row) const;
+    QList<ChatMessage> messages() const; // The conversation, without broadcasts
+    quint64 newestId() const;            // Highest server message id, 0 if none
+
+    void setMessages(const QList<ChatMessage> &messages);
+    void appendMessage(const ChatMessage &message);
+    void appendMessages(const QList<ChatMessage> &messages);
+    void prependMessages(const QList<ChatMessage> &messages); // Older history
+    // Replaces the newest row holding before, e.g. a sent message once the
+    // server confirmed it; returns false if there is none
+    bool replaceMessage(const ChatMessage &before, const ChatMessage &after);
+    // Removes the newest row holding message, e.g. a sent message the server
+    // rejected; returns false if there is none
+    bool removeMessage(const ChatMessage &message);
+    void clear();
+
+    // Height of row at width, or -1 if it hasn't been measured at that width
+    int cachedHeight(int row, int width) const;
+    void cacheHeight(int row, int width, int height) const;
+
+private:
+    Q_DISABLE_COPY(ChatMessageModel)
+
+    struct RowLayout
+    {
+        int width = -1;
+        int height = 0;
+    };
+
+    static bool isConversationMessage(const ChatMessage &message);
+    void noteAdded(const QList<ChatMessage> &messages);
+
+    QList<ChatMessage> m_messages;
+    mutable QList<RowLayout> m_layouts; // Parallel to m_messages
+    int m_broadcastCount;
+    quint64 m_newestId;
+};
+
+#endif // CHATMESSAGEMODEL_H
@@ -1,13 +1,15 @@
 #include "clientwindow.h"
 #include <QCloseEvent>
-#include <QDir>
 #include <QGroupBox>
 #include <QHBoxLayout>
 #include <QLabel>
 #include <QLineEdit>
+#include <QListView>
 #include <QListWidget>
 #include <QMessageBox>
 #include <QPushButton>
+#include <QScrollBar>
+#include <QSignalBlocker>
 #include <QSplitter>
 #include <QStandardPaths>
 #include <QTextEdit>
@@ -15,10 +17,21 @@
 #include <QVBoxLayout>
 #include "chatclient.h"
 #include "chatmessage.h"
+#include "chatmessagedelegate.h"
+#include "chatmessagemodel.h"
+#include "localhistorystore.h"
+
+namespace {
+
+const int kHistoryPageSize = 50;
+
+} // namespace
 
 ClientWindow::ClientWindow(QWidget *parent)
     : QMainWindow(parent)
     , m_client(new ChatClient(this))
+    , m_localHistory(new LocalHistoryStore(
+          QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)))
     , m_settings("QtChatApp", "ChatClient")
 {
     setupUi();
@@ -27,14 +40,26 @@ ClientWindow::ClientWindow(QWidget *parent)
     connect(m_client.data(), &ChatClient::connected, this, &ClientWindow::onConnected);
     connect(m_client.data(), &ChatClient::disconnected, this, &ClientWindow::onDisconnected);
     connect(m_client.data(), &ChatClient::messageReceived, this, &ClientWindow::onMessageReceived);
+    connect(m_client.data(), &ChatClient::messageSent, this, &ClientWindow::onMessageSent);
+    connect(m_client.data(), &ChatClient::sendFailed, this, &ClientWindow::onSendFailed);
     connect(m_client.data(),
-            &ChatClient::chatHistoryReceived,
+            &ChatClient::chatHistoryChunkReceived,
             this,
-            &ClientWindow::onChatHistoryReceived);
+            &ClientWindow::onChatHistoryChunkReceived);
+    connect(m_client.data(),
+            &ChatClient::chatHistoryFinished,
+            this,
+            &ClientWindow::onChatHistoryFinished);
     connect(m_client.data(), &ChatClient::userListUpdated, this, &ClientWindow::onUserListUpdated);
+    connect(m_client.data(), &ChatClient::usersJoined, this, &ClientWindow::onUsersJoined);
+    connect(m_client.data(), &ChatClient::usersLeft, this, &ClientWindow::onUsersLeft);
     connect(m_client.data(), &ChatClient::logMessage, this, &ClientWindow::onLogMessage);
     connect(m_client.data(), &ChatClient::errorOccurred, this, &ClientWindow::onErrorOccurred);
     connect(m_client.data(), &ChatClient::kicked, this, &ClientWindow::onKicked);
+    connect(m_chatView->verticalScrollBar(),
+            &QScrollBar::valueChanged,
+            this,
+            &ClientWindow::onChatScrolled);
 
     updateConnectionState(false);
 }
@@ -110,6 +135,7 @@ void ClientWindow::setupUi()
                               "QListWidget::item { padding: 6px; }"
                               "QListWidget::item:hover { background: #C4C4C4; }"
                               "QListWidget::item:selected { background: #2196F3; color: white; }");
+    m_userList->setSortingEnabled(true);
     userLayout->addWidget(m_userList);
 
     splitter->addWidget(userWidget);
@@ -126,10 +152,20 @@ void ClientWindow::setupUi()
                                    "/*background: #e3f2fd;*/ border-radius: 4px;");
     chatLayout->addWidget(m_chatWithLabel);
 
-    m_chatView = new QTextEdit(this);
-    m_chatView->setReadOnly(true);
-    m_chatView->setStyleSheet("QTextEdit { border: 1px solid #ccc; border-radius: 4px; "
+    // Rows are painted by the delegate only while visible; their heights are
+    // measured once per width and cached in the conversation's model
+    m_chatView = new QListView(this);
+    m_chatView->setStyleSheet("QListView { border: 1px solid #ccc; border-radius: 4px; "
                               "padding: 8px;/* background: white;*/ }");
+    m_chatView->setSelectionMode(QAbstractItemView::NoSelection);
+    m_chatView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_chatView->setVerticalScrollMode(QAbstractItemView::ScrollPerPixel);
+    m_chatView->setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+    m_chatView->setResizeMode(QListView::Adjust);
+    m_chatView->setWordWrap(true);
+    m_chatDelegate = new ChatMessageDelegate(m_chatView);
+    m_chatView->setItemDelegate(m_chatDelegate);
+    m_chatView->setModel(chatModel(QString()));
     chatLayout->addWidget(m_chatView);
 
     // Message input area
@@ -221,6 +257,14 @@ void ClientWindow::closeEvent(QCloseEvent *event)
     event->accept();
 }
 
+void ClientWindow::changeEvent(QEvent *event)
+{
+    QMainWindow::changeEvent(event);
+    if (event->type() == QEvent::ActivationChange) {
+        markChatRead();
+    }
+}
+
 void ClientWindow::onConnectButtonClicked()
 {
     QString username = m_usernameEdit->text().trimmed();
@@ -266,17 +310,11 @@ void ClientWindow::onSendButtonClicked()
         return;
     }
 
-    m_client->sendMessage(m_currentChatUser, text);
+    // Shown right away; stored locally once the server confirms it, taken
+    // back out if it fails
+    const ChatMessage msg = m_client->sendMessage(m_currentChatUser, text);
     m_messageEdit->clear();
-
-    // Add to local history
-    ChatMessage msg(m_client->username(),
-                    m_currentChatUser,
-                    text,
-                    ChatMessage::Private,
-                    QDateTime::currentDateTime());
-    m_chatHistories[m_currentChatUser].append(msg);
-    saveLocalChatHistory(m_currentChatUser);
+    chatModel(m_currentChatUser)->appendMessage(msg);
 }
 
 void ClientWindow::onMessageEditReturnPressed()
@@ -302,6 +340,7 @@ void ClientWindow::onToggleLogClicked()
 
 void ClientWindow::onConnected()
 {
+    m_chatDelegate->setLocalUser(m_client->username());
     updateConnectionState(true);
     appendLog("Connected to server successfully");
 }
@@ -310,9 +349,15 @@ void ClientWindow::onDisconnected()
 {
     updateConnectionState(false);
     m_userList->clear();
+    m_userItems.clear();
+    m_historyHasMore.clear();
+    m_historyLoading.clear();
+    m_historyReplacing.clear();
+    m_localHistoryLoaded.clear(); // Another user may log in next
     m_currentChatUser.clear();
     m_chatWithLabel->setText("Select a user to chat");
-    m_chatView->clear();
+    chatModel(QString())->clear();
+    showChat(QString());
     appendLog("Disconnected from server");
 }
 
@@ -320,21 +365,11 @@ void ClientWindow::onMessageReceived(const ChatMessage &message)
 {
     // Handle broadcast/server messages - show in current chat view
     if (message.type() == ChatMessage::Broadcast || message.type() == ChatMessage::ServerAlert) {
-        QString style = (message.type() == ChatMessage::ServerAlert)
-                            ? "color: red; font-weight: bold;"
-                            : "color: #2196F3; font-weight: bold;";
-
-        QString time = message.timestamp().toString("hh:mm:ss");
-        QString prefix = (message.type() == ChatMessage::ServerAlert) ? "[SERVER ALERT]"
-                                                                      : "[SERVER BROADCAST]";
-
-        m_chatView->append(
-            QString("<div style='%1'><span style='color: gray;'>[%2]</span> %3 %4: %5</div>")
-                .arg(style)
-                .arg(time)
-                .arg(prefix)
-                .arg(message.from().toHtmlEscaped())
-                .arg(message.text().toHtmlEscaped()));
+        const bool follow = isChatScrolledToBottom();
+        chatModel(m_currentChatUser)->appendMessage(message);
+        if (follow) {
+            m_chatView->scrollToBottom();
+        }
 
         appendLog(QString("Broadcast from %1: %2").arg(message.from()).arg(message.text()));
         return;
@@ -343,46 +378,206 @@ void ClientWindow::onMessageReceived(const ChatMessage &message)
     // Handle private messages
     QString otherUser = (message.from() == m_client->username()) ? message.to() : message.from();
 
-    if (!m_chatHistories.contains(otherUser)) {
-        m_chatHistories[otherUser] = QList<ChatMessage>();
+    // Already shown if a history sync delivered it first
+    if (!saveLocalMessage(otherUser, message)) {
+        return;
+    }
+
+    const bool shown = m_currentChatUser == otherUser;
+    const bool follow = shown && isChatScrolledToBottom();
+    chatModel(otherUser)->appendMessage(message);
+    if (follow) {
+        m_chatView->scrollToBottom();
+    }
+    if (shown) {
+        markChatRead();
+    }
+}
+
+void ClientWindow::onMessageSent(const ChatMessage &pending, const ChatMessage &sent)
+{
+    const QString withUser = sent.to();
+    ChatMessageModel *model = chatModel(withUser);
+    const bool added = saveLocalMessage(withUser, sent);
+
+    // The optimistic row takes the server's id and time. If a history sync
+    // replaced it in the meantime, the message shows up again only if that
+    // sync didn't already bring it.
+    if (!model->replaceMessage(pending, sent) && added) {
+        model->appendMessage(sent);
+    }
+    if (m_currentChatUser == withUser) {
+        markChatRead();
+    }
+}
+
+void ClientWindow::onSendFailed(const ChatMessage &pending, const QString &reason)
+{
+    // Never stored, so it only has to leave the view. The text goes back into
+    // the editor unless something else was typed since.
+    chatModel(pending.to())->removeMessage(pending);
+    if (m_currentChatUser == pending.to() && m_messageEdit->text().isEmpty()) {
+        m_messageEdit->setText(pending.text());
     }
+    appendLog(QString("Message to %1 not sent: %2").arg(pending.to(), reason));
+}
 
-    m_chatHistories[otherUser].append(message);
+void ClientWindow::onChatHistoryChunkReceived(const QString &withUser,
+                                              const QList<ChatMessage> &messages,
+                                              qint64 start)
+{
+    ChatMessageModel *model = chatModel(withUser);
+    const bool replace = m_historyReplacing.remove(withUser);
+    const bool shown = m_currentChatUser == withUser;
+
+    // The view mirrors the local history, so only what that didn't hold yet
+    // is new to the view as well
+    const QList<ChatMessage> added = saveLocalChatHistory(withUser, messages);
+
+    // The first chunk of a first sync is merged with the local history in
+    // time order; later chunks of a backward page are older and go in front
+    if (replace) {
+        m_historyStart[withUser] = start;
+        if (!added.isEmpty()) {
+            const QString convId = ChatMessage::conversationId(m_client->username(), withUser);
+            model->setMessages(m_localHistory->load(convId));
+        }
+        if (shown) {
+            m_chatView->scrollToBottom();
+        }
+    } else if (start < m_historyStart.value(withUser, start)) {
+        m_historyStart[withUser] = start;
+        if (added.isEmpty()) {
+            return;
+        }
 
-    if (m_currentChatUser == otherUser) {
-        appendMessageToView(message);
+        // Keep the same message at the top of the viewport as older ones
+        // are inserted above it
+        const QModelIndex top = shown ? m_chatView->indexAt(QPoint(0, 0)) : QModelIndex();
+        const int topOffset = top.isValid() ? m_chatView->visualRect(top).top() : 0;
+        model->prependMessages(added);
+        if (top.isValid()) {
+            QScrollBar *bar = m_chatView->verticalScrollBar();
+            QSignalBlocker blocker(bar); // Not a request for more history
+            m_chatView->scrollTo(model->index(top.row() + int(added.size())),
+                                 QAbstractItemView::PositionAtTop);
+            bar->setValue(bar->value() - topOffset);
+        }
+    } else if (!added.isEmpty()) {
+        const bool follow = shown && isChatScrolledToBottom();
+        model->appendMessages(added);
+        if (follow) {
+            m_chatView->scrollToBottom();
+        }
     }
 
-    saveLocalChatHistory(otherUser);
+    if (shown) {
+        markChatRead();
+    }
 }
 
-void ClientWindow::onChatHistoryReceived(const QString &withUser, const QList<ChatMessage> &messages)
+void ClientWindow::onChatHistoryFinished(const QString &withUser,
+                                         qint64 start,
+                                         qint64 end,
+                                         bool hasMore,
+                                         ChatClient::HistoryPage page)
 {
-    m_chatHistories[withUser] = messages;
+    m_historyReplacing.remove(withUser); // An empty page has no first chunk
+
+    const QString convId = ChatMessage::conversationId(m_client->username(), withUser);
+    LocalHistoryStore::SyncRange synced = m_localHistory->syncRange(convId);
+
+    if (page == ChatClient::NewerPage) {
+        if (!synced.isValid() || start < synced.end) {
+            // The server holds fewer messages than were synced before, so its
+            // history was reset and the old cursors mean nothing any more
+            m_localHistory->resetSyncRange(convId);
+            requestNewestHistory(withUser);
+            return;
+        }
 
-    if (m_currentChatUser == withUser) {
-        m_chatView->clear();
-        for (const auto &msg : messages) {
-            appendMessageToView(msg);
+        synced.end = end;
+        m_localHistory->setSyncRange(convId, synced);
+        if (hasMore) {
+            m_client->requestNewerHistory(withUser, end, kHistoryPageSize);
+            return;
+        }
+    } else {
+        if (page == ChatClient::NewestPage) {
+            synced.start = start;
+            synced.end = end;
+        } else if (synced.isValid() && end >= synced.start) {
+            synced.start = qMin(synced.start, start); // Contiguous with what was synced
+        }
+        m_localHistory->setSyncRange(convId, synced);
+
+        if (page == ChatClient::OlderPage) {
+            m_historyLoading.remove(withUser);
+        }
+        m_historyStart[withUser] = start;
+        if (hasMore) {
+            m_historyHasMore.insert(withUser);
+        } else {
+            m_historyHasMore.remove(withUser);
         }
     }
 
-    saveLocalChatHistory(withUser);
-    appendLog(QString("Loaded %1 messages with %2").arg(messages.size()).arg(withUser));
+    // Nothing to scroll yet, so the user could never ask for more
+    if (m_currentChatUser == withUser && m_chatView->verticalScrollBar()->maximum() == 0) {
+        loadOlderHistory();
+    }
+
+    appendLog(QString("Loaded %1 messages with %2").arg(end - start).arg(withUser));
+}
+
+void ClientWindow::onChatScrolled(int value)
+{
+    if (value == m_chatView->verticalScrollBar()->minimum()) {
+        loadOlderHistory();
+    }
 }
 
 void ClientWindow::onUserListUpdated(const QStringList &users)
 {
-    m_onlineUsers = users;
     m_userList->clear();
+    m_userItems.clear();
+    onUsersJoined(users);
+
+    appendLog(QString("Online users: %1").arg(users.join(", ")));
+}
 
+void ClientWindow::onUsersJoined(const QStringList &users)
+{
+    QStringList added;
     for (const QString &user : users) {
-        if (user != m_client->username()) {
-            m_userList->addItem(user);
+        if (user == m_client->username() || m_userItems.contains(user)) {
+            continue;
         }
+        QListWidgetItem *item = new QListWidgetItem(user);
+        m_userList->addItem(item);
+        m_userItems.insert(user, item);
+        added.append(user);
     }
 
-    appendLog(QString("Online users: %1").arg(users.join(", ")));
+    if (!added.isEmpty()) {
+        appendLog(QString("Joined: %1").arg(added.join(", ")));
+    }
+}
+
+void ClientWindow::onUsersLeft(const QStringList &users)
+{
+    QStringList removed;
+    for (const QString &user : users) {
+        // Deleting the item also removes it from the list widget
+        if (QListWidgetItem *item = m_userItems.take(user)) {
+            delete item;
+            removed.append(user);
+        }
+    }
+
+    if (!removed.isEmpty()) {
+        appendLog(QString("Left: %1").arg(removed.join(", ")));
+    }
 }
 
 void ClientWindow::onLogMessage(const QString &msg)
@@ -423,20 +618,54 @@ void ClientWindow::updateConnectionState(bool connected)
     }
 }
 
-void ClientWindow::appendMessageToView(const ChatMessage &message)
+ChatMessageModel *ClientWindow::chatModel(const QString &withUser)
+{
+    ChatMessageModel *&model = m_chatModels[withUser];
+    if (!model) {
+        model = new ChatMessageModel(this);
+    }
+    return model;
+}
+
+void ClientWindow::showChat(const QString &withUser)
+{
+    // The view creates a selection model per model and leaves the old one
+    QItemSelectionModel *oldSelection = m_chatView->selectionModel();
+    {
+        // Swapping scrolls to the top, which must not count as asking for more
+        QSignalBlocker blocker(m_chatView->verticalScrollBar());
+        m_chatView->setModel(chatModel(withUser));
+    }
+    delete oldSelection;
+    m_chatView->scrollToBottom();
+    markChatRead();
+}
+
+// Everything in the conversation on screen counts as read while the window
+// is active
+void ClientWindow::markChatRead()
 {
-    QString time = message.timestamp().toString("hh:mm:ss");
-    QString from = message.from();
-    QString text = message.text().toHtmlEscaped();
+    if (isActiveWindow() && !m_currentChatUser.isEmpty()) {
+        m_client->markRead(chatModel(m_currentChatUser)->newestId());
+    }
+}
+
+bool ClientWindow::isChatScrolledToBottom() const
+{
+    const QScrollBar *bar = m_chatView->verticalScrollBar();
+    return bar->value() == bar->maximum();
+}
 
-    QString color = (from == m_client->username()) ? "#4CAF50" : "#2196F3";
+void ClientWindow::loadOlderHistory()
+{
+    const QString &withUser = m_currentChatUser;
+    if (withUser.isEmpty() || !m_historyHasMore.contains(withUser)
+        || m_historyLoading.contains(withUser) || !m_client->isConnected()) {
+        return;
+    }
 
-    m_chatView->append(QString("<div><span style='color: gray;'>[%1]</span> "
-                               "<span style='color: %2; font-weight: bold;'>%3:</span> %4</div>")
-                           .arg(time)
-                           .arg(color)
-                           .arg(from.toHtmlEscaped())
-                           .arg(text));
+    m_historyLoading.insert(withUser);
+    m_client->requestChatHistory(withUser, m_historyStart.value(withUser), kHistoryPageSize);
 }
 
 void ClientWindow::appendLog(const QString &msg)
@@ -445,6 +674,14 @@ void ClientWindow::appendLog(const QString &msg)
     m_logEdit->append(QString("[%1] %2").arg(time).arg(msg));
 }
 
+void ClientWindow::requestNewestHistory(const QString &withUser)
+{
+    m_historyHasMore.remove(withUser);
+    m_historyLoading.remove(withUser);
+    m_historyReplacing.insert(withUser);
+    m_client->requestChatHistory(withUser, -1, kHistoryPageSize);
+}
+
 void ClientWindow::switchToUser(const QString &username)
 {
     if (username == m_currentChatUser) {
@@ -453,48 +690,72 @@ void ClientWindow::switchToUser(const QString &username)
 
     m_currentChatUser = username;
     m_chatWithLabel->setText(QString("Chatting with: %1").arg(username));
-    m_chatView->clear();
 
     // Load local history first
     loadLocalChatHistory(username);
 
     // Display cached messages
-    if (m_chatHistories.contains(username)) {
-        for (const auto &msg : m_chatHistories[username]) {
-            appendMessageToView(msg);
+    showChat(username);
+
+    // Fetch only what the server got since the last sync; a conversation
+    // never synced starts from the newest page. Older pages follow on scroll.
+    const QString convId = ChatMessage::conversationId(m_client->username(), username);
+    const LocalHistoryStore::SyncRange synced = m_localHistory->syncRange(convId);
+    if (synced.isValid()) {
+        m_historyLoading.remove(username);
+        m_historyReplacing.remove(username);
+        m_historyStart[username] = synced.start;
+        if (synced.start > 0) {
+            m_historyHasMore.insert(username);
+        } else {
+            m_historyHasMore.remove(username);
         }
+        m_client->requestNewerHistory(username, synced.end, kHistoryPageSize);
+    } else {
+        requestNewestHistory(username);
     }
-
-    // Request server history
-    m_client->requestChatHistory(username);
     m_sendButton->setEnabled(true);
 }
 
 void ClientWindow::loadLocalChatHistory(const QString &withUser)
 {
-    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-    QDir().mkpath(dataPath);
-
-    QString convId = ChatMessage::conversationId(m_client->username(), withUser);
-    QString filePath = QString("%1/%2.json").arg(dataPath).arg(convId);
-
-    QList<ChatMessage> messages = ChatMessage::loadMessages(filePath);
-    if (!messages.isEmpty()) {
-        m_chatHistories[withUser] = messages;
+    // Once loaded, the model gets everything stored after as it is stored
+    if (m_localHistoryLoaded.contains(withUser)) {
+        return;
     }
+    m_localHistoryLoaded.insert(withUser);
+
+    const QString convId = ChatMessage::conversationId(m_client->username(), withUser);
+    chatModel(withUser)->setMessages(m_localHistory->load(convId));
 }
 
-void ClientWindow::saveLocalChatHistory(const QString &withUser)
+QList<ChatMessage> ClientWindow::saveLocalChatHistory(const QString &withUser,
+                                                      const QList<ChatMessage> &messages)
 {
-    if (!m_chatHistories.contains(withUser)) {
-        return;
+    if (withUser.isEmpty() || messages.isEmpty()) {
+        return QList<ChatMessage>();
     }
 
-    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-    QDir().mkpath(dataPath);
+    // Only what the file doesn't hold yet is appended to it
+    const QString convId = ChatMessage::conversationId(m_client->username(), withUser);
+    QList<ChatMessage> added;
+    if (m_localHistory->merge(convId, messages, &added) < 0) {
+        appendLog(QString("Failed to save local history with %1").arg(withUser));
+        return messages; // Still to be shown
+    }
+    return added;
+}
 
-    QString convId = ChatMessage::conversationId(m_client->username(), withUser);
-    QString filePath = QString("%1/%2.json").arg(dataPath).arg(convId);
+bool ClientWindow::saveLocalMessage(const QString &withUser, const ChatMessage &message)
+{
+    if (withUser.isEmpty()) {
+        return false;
+    }
 
-    ChatMessage::saveMessages(m_chatHistories[withUser], filePath);
+    const QString convId = ChatMessage::conversationId(m_client->username(), withUser);
+    const int stored = m_localHistory->append(convId, message);
+    if (stored < 0) {
+        appendLog(QString("Failed to save local history with %1").arg(withUser));
+    }
+    return stored != 0; // Still to be shown if it couldn't be saved
 }
@@ -1,11 +1,13 @@
 #ifndef CLIENTWINDOW_H
 #define CLIENTWINDOW_H
 
+#include <QHash>
 #include <QList>
 #include <QMainWindow>
-#include <QMap>
 #include <QScopedPointer>
+#include <QSet>
 #include <QSettings>
+#include "chatclient.h"
 #include "chatmessage.h"
 
 // Forward declarations
@@ -15,8 +17,11 @@ class QTextEdit;
 class QListWidget;
 class QListWidgetItem;
 class QLabel;
+class QListView;
 class QSplitter;
-class ChatClient;
+class ChatMessageDelegate;
+class ChatMessageModel;
+class LocalHistoryStore;
 
 class ClientWindow : public QMainWindow
 {
@@ -27,6 +32,7 @@ public:
 
 protected:
     void closeEvent(QCloseEvent *event) override;
+    void changeEvent(QEvent *event) override;
 
 private slots:
     // UI actions
@@ -41,8 +47,20 @@ private slots:
     void onConnected();
     void onDisconnected();
     void onMessageReceived(const ChatMessage &message);
-    void onChatHistoryReceived(const QString &withUser, const QList<ChatMessage> &messages);
+    void onMessageSent(const ChatMessage &pending, const ChatMessage &sent);
+    void onSendFailed(const ChatMessage &pending, const QString &reason);
+    void onChatHistoryChunkReceived(const QString &withUser,
+                                    const QList<ChatMessage> &messages,
+                                    qint64 start);
+    void onChatHistoryFinished(const QString &withUser,
+                               qint64 start,
+                               qint64 end,
+                               bool hasMore,
+                               ChatClient::HistoryPage page);
+    void onChatScrolled(int value);
     void onUserListUpdated(const QStringList &users);
+    void onUsersJoined(const QStringList &users);
+    void onUsersLeft(const QStringList &users);
     void onLogMessage(const QString &msg);
     void onErrorOccurred(const QString &error);
     void onKicked(const QString &reason);
@@ -52,13 +70,23 @@ private:
     void loadSettings();
     void saveSettings();
     void updateConnectionState(bool connected);
-    void appendMessageToView(const ChatMessage &message);
+    ChatMessageModel *chatModel(const QString &withUser);
+    void showChat(const QString &withUser);
+    bool isChatScrolledToBottom() const;
+    void markChatRead();
+    void loadOlderHistory();
+    void requestNewestHistory(const QString &withUser);
     void appendLog(const QString &msg);
     void switchToUser(const QString &username);
     void loadLocalChatHistory(const QString &withUser);
-    void saveLocalChatHistory(const QString &withUser);
+    // Returns the messages that weren't stored yet
+    QList<ChatMessage> saveLocalChatHistory(const QString &withUser,
+                                            const QList<ChatMessage> &messages);
+    // A message that just arrived; returns false if it was stored already
+    bool saveLocalMessage(const QString &withUser, const ChatMessage &message);
 
     QScopedPointer<ChatClient> m_client;
+    QScopedPointer<LocalHistoryStore> m_localHistory;
 
     // UI Widgets
     QLineEdit *m_serverHostEdit;
@@ -68,7 +96,8 @@ private:
     QPushButton *m_disconnectButton;
 
     QListWidget *m_userList;
-    QTextEdit *m_chatView;
+    QListView *m_chatView;
+    ChatMessageDelegate *m_chatDelegate;
     QLineEdit *m_messageEdit;
     QPushButton *m_sendButton;
     QLabel *m_chatWithLabel;
@@ -80,8 +109,17 @@ private:
 
     // State management
     QString m_currentChatUser;                         // Currently chatting with
-    QMap<QString, QList<ChatMessage>> m_chatHistories; // Per-user history cache
-    QStringList m_onlineUsers;
+    // Messages per conversation; the empty name holds what is shown while no
+    // conversation is selected
+    QHash<QString, ChatMessageModel *> m_chatModels;
+    QHash<QString, QListWidgetItem *> m_userItems; // Online users shown in m_userList
+
+    // Server history paging: cursor of the oldest loaded message per user
+    QHash<QString, qint64> m_historyStart;
+    QSet<QString> m_historyHasMore;
+    QSet<QString> m_historyLoading;   // Older page requested, not yet received
+    QSet<QString> m_historyReplacing; // Newest page requested, its first chunk not yet in
+    QSet<QString> m_localHistoryLoaded; // Models holding the local history since login
 
     // Settings persistence
     QSettings m_settings;
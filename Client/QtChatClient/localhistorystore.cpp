@@ -0,0 +1,200 @@
+#include "localhistorystore.h"
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <algorithm>
+#include "messagelog.h"
+
+LocalHistoryStore::LocalHistoryStore(const QString &directory)
+    : m_directory(directory)
+{}
+
+QList<ChatMessage> LocalHistoryStore::load(const QString &conversationId)
+{
+    QList<ChatMessage> messages;
+    if (m_indexes.contains(conversationId)) {
+        messages = MessageLog::load(filePath(conversationId));
+    } else {
+        index(conversationId, &messages); // Reads the log once for both
+    }
+
+    // Older pages merged from the server are stored after newer messages
+    std::stable_sort(messages.begin(),
+                     messages.end(),
+                     [](const ChatMessage &a, const ChatMessage &b) {
+                         return a.timestamp() < b.timestamp();
+                     });
+    return messages;
+}
+
+int LocalHistoryStore::append(const QString &conversationId, const ChatMessage &message)
+{
+    KeyCounts *keys = index(conversationId, nullptr);
+    if (!keys) {
+        return -1;
+    }
+    if (message.id() != 0 && keys->contains(keyOf(message))) {
+        return 0;
+    }
+    return store(conversationId, keys, {message});
+}
+
+int LocalHistoryStore::merge(const QString &conversationId,
+                             const QList<ChatMessage> &messages,
+                             QList<ChatMessage> *added)
+{
+    KeyCounts *keys = index(conversationId, nullptr);
+    if (!keys) {
+        return -1;
+    }
+
+    // A page holding the same key n times adds whatever the log holds
+    // fewer than n of
+    KeyCounts inPage;
+    QList<ChatMessage> missing;
+    for (const ChatMessage &msg : messages) {
+        const MessageKey key = keyOf(msg);
+        if (++inPage[key] > keys->value(key)) {
+            missing.append(msg);
+        }
+    }
+
+    if (missing.isEmpty()) {
+        return 0;
+    }
+    const int stored = store(conversationId, keys, missing);
+    if (stored > 0 && added) {
+        *added = missing;
+    }
+    return stored;
+}
+
+LocalHistoryStore::SyncRange LocalHistoryStore::syncRange(const QString &conversationId) const
+{
+    SyncRange range;
+    QFile file(syncPath(conversationId));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return range;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream >> range.start >> range.end;
+    return stream.status() == QDataStream::Ok ? range : SyncRange();
+}
+
+bool LocalHistoryStore::setSyncRange(const QString &conversationId, const SyncRange &range)
+{
+    QFile file(syncPath(conversationId));
+    if (!range.isValid() || !file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+
+    // A torn write reads back as invalid, which only costs a full sync
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << range.start << range.end;
+    return stream.status() == QDataStream::Ok;
+}
+
+void LocalHistoryStore::resetSyncRange(const QString &conversationId)
+{
+    QFile::remove(syncPath(conversationId));
+}
+
+QString LocalHistoryStore::directory() const
+{
+    return m_directory;
+}
+
+QString LocalHistoryStore::filePath(const QString &conversationId) const
+{
+    return QString("%1/%2.chatlog").arg(m_directory).arg(conversationId);
+}
+
+QString LocalHistoryStore::syncPath(const QString &conversationId) const
+{
+    return QString("%1/%2.sync").arg(m_directory).arg(conversationId);
+}
+
+bool LocalHistoryStore::MessageKey::operator==(const MessageKey &other) const
+{
+    return id == other.id && msecs == other.msecs && type == other.type
+           && from == other.from && to == other.to && text == other.text;
+}
+
+size_t qHash(const LocalHistoryStore::MessageKey &key, size_t seed)
+{
+    return qHashMulti(seed, key.id, key.msecs, key.from, key.to, key.text, key.type);
+}
+
+LocalHistoryStore::MessageKey LocalHistoryStore::keyOf(const ChatMessage &message)
+{
+    if (message.id() != 0) {
+        return MessageKey{message.id(), QString(), QString(), QString(), 0, 0};
+    }
+    return MessageKey{0,
+                      message.from(),
+                      message.to(),
+                      message.text(),
+                      message.timestamp().toMSecsSinceEpoch(),
+                      int(message.type())};
+}
+
+// Appends messages to the log and counts their keys
+int LocalHistoryStore::store(const QString &conversationId,
+                             KeyCounts *keys,
+                             const QList<ChatMessage> &messages)
+{
+    if (!MessageLog::append(filePath(conversationId), messages)) {
+        // The log may hold part of them; re-read on next use
+        m_indexes.remove(conversationId);
+        return -1;
+    }
+    for (const ChatMessage &msg : messages) {
+        ++(*keys)[keyOf(msg)];
+    }
+    return int(messages.size());
+}
+
+// Returns the key counts of a conversation, reading its log the first time.
+// The log's messages are stored in messages when it is read.
+LocalHistoryStore::KeyCounts *LocalHistoryStore::index(const QString &conversationId,
+                                                       QList<ChatMessage> *messages)
+{
+    auto it = m_indexes.find(conversationId);
+    if (it != m_indexes.end()) {
+        return &it.value();
+    }
+
+    if (!QDir().mkpath(m_directory)) {
+        qWarning() << "Failed to create history directory:" << m_directory;
+        return nullptr;
+    }
+
+    // Earlier versions rewrote a whole JSON file per conversation
+    const QString path = filePath(conversationId);
+    const QString jsonPath = QString("%1/%2.json").arg(m_directory).arg(conversationId);
+    if (!QFile::exists(path) && QFile::exists(jsonPath)
+        && MessageLog::migrateJson(jsonPath, path)) {
+        QFile::remove(jsonPath);
+    }
+
+    // Drop any record torn by a crash before appending after it
+    if (MessageLog::recover(path) < 0) {
+        qWarning() << "Local history log is unreadable:" << path;
+        return nullptr;
+    }
+
+    const QList<ChatMessage> stored = MessageLog::load(path);
+    KeyCounts keys;
+    keys.reserve(stored.size());
+    for (const ChatMessage &msg : stored) {
+        ++keys[keyOf(msg)];
+    }
+    if (messages) {
+        *messages = stored;
+    }
+    return &m_indexes.insert(conversationId, keys).value();
+}
@@ -0,0 +1,86 @@
+#ifndef LOCALHISTORYSTORE_H
+#define LOCALHISTORYSTORE_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include "chatmessage.h"
+
+// The client's copy of its conversations: one append-only MessageLog
+// (<conversationId>.chatlog plus its offset index) per conversation in a
+// directory. Storing a received message is a single append; merging a page
+// of server history appends only the messages the log doesn't hold yet.
+//
+// Which messages a log holds is tracked by per-conversation key counts
+// built the first time the conversation is touched. Merged pages may be
+// older than what is already stored, so load() returns the log sorted by
+// time.
+//
+// Next to each log, <conversationId>.sync records the server history cursors
+// [start, end) whose messages are all in the log, so that reopening the
+// conversation only has to fetch what the server got from end on.
+class LocalHistoryStore
+{
+public:
+    struct SyncRange
+    {
+        qint64 start = -1;
+        qint64 end = -1;
+
+        bool isValid() const { return start >= 0 && end >= start; }
+    };
+
+    explicit LocalHistoryStore(const QString &directory);
+
+    QList<ChatMessage> load(const QString &conversationId);
+    // Stores a message as it arrives live. One with an id is skipped if it
+    // is stored already; one without is always stored, as the same line sent
+    // twice within a second is two messages. Returns 1 if it was stored, 0
+    // if it already was, -1 on failure.
+    int append(const QString &conversationId, const ChatMessage &message);
+    // Appends the messages not stored yet and lists them in added if given.
+    // Messages without ids count as stored only as many times as the log
+    // holds them. Returns how many were appended, or -1 on failure.
+    int merge(const QString &conversationId,
+              const QList<ChatMessage> &messages,
+              QList<ChatMessage> *added = nullptr);
+
+    // An invalid range when the conversation was never synced
+    SyncRange syncRange(const QString &conversationId) const;
+    bool setSyncRange(const QString &conversationId, const SyncRange &range);
+    void resetSyncRange(const QString &conversationId);
+
+    QString directory() const;
+    QString filePath(const QString &conversationId) const;
+    QString syncPath(const QString &conversationId) const;
+
+private:
+    Q_DISABLE_COPY(LocalHistoryStore)
+
+    // Identifies a message by the id the server gave it. Messages from
+    // before ids only have their contents and timestamp, which two distinct
+    // messages can share, so those keys are counted.
+    struct MessageKey
+    {
+        quint64 id;
+        QString from;
+        QString to;
+        QString text;
+        qint64 msecs;
+        int type;
+
+        bool operator==(const MessageKey &other) const;
+    };
+    friend size_t qHash(const MessageKey &key, size_t seed);
+
+    using KeyCounts = QHash<MessageKey, int>;
+
+    static MessageKey keyOf(const ChatMessage &message);
+    KeyCounts *index(const QString &conversationId, QList<ChatMessage> *messages);
+    int store(const QString &conversationId, KeyCounts *keys, const QList<ChatMessage> &messages);
+
+    QString m_directory;
+    QHash<QString, KeyCounts> m_indexes; // How often each key is stored, per conversation
+};
+
+#endif // LOCALHISTORYSTORE_H
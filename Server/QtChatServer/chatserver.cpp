@@ -1,39 +1,137 @@
 #include "chatserver.h"
+#include <algorithm>
 #include <QDebug>
 #include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QStandardPaths>
+#include <QThread>
+#include <QTimer>
 #include "chatmessage.h"
 #include "clientconnection.h"
+#include "connectionworkerpool.h"
+#include "historywriter.h"
+#include "messagelog.h"
+
+namespace {
+
+const int kPresenceBatchInterval = 50; // ms
+
+// History is served in pages; requests without a limit get the default
+const int kDefaultHistoryPageSize = 50;
+const int kMaxHistoryPageSize = 500;
+
+// Streamed history goes out in chunks of roughly this many bytes of JSON
+const qsizetype kHistoryChunkBytes = 16 * 1024;
+
+// Rough size of one message in a history frame, for chunking
+qsizetype estimatedJsonSize(const ChatMessage &msg)
+{
+    return 96 + msg.from().size() + msg.to().size() + msg.text().size();
+}
+
+} // namespace
 
 ChatServer::ChatServer(QObject *parent)
     : QTcpServer(parent)
+    , m_workerPool(new ConnectionWorkerPool(this))
+    , m_ioThreadCount(0)
+    , m_flushLatency(0)
+    , m_presenceTimer(new QTimer(this))
+    , m_historyBackend(HistoryStore::LogFiles)
+    , m_historyWriter(new HistoryWriter(this))
+    , m_lastHistoryReadId(0)
+    , m_maxClients(0)
+    , m_maxMessageLength(0)
     , m_port(0)
     , m_running(false)
-{}
+    , m_log(new ServerLog(this))
+{
+    m_log->start();
+    connect(this, &ChatServer::logMessage, m_log, &ServerLog::info, Qt::DirectConnection);
+
+    // Joins and leaves within this window go out as one delta per kind
+    m_presenceTimer->setSingleShot(true);
+    m_presenceTimer->setInterval(kPresenceBatchInterval);
+    connect(m_presenceTimer, &QTimer::timeout, this, &ChatServer::flushPresenceChanges);
+
+    m_historyWriter->setStats(&m_stats);
+
+    // The writer emits from its own thread
+    connect(m_historyWriter,
+            &HistoryWriter::pageRead,
+            this,
+            &ChatServer::handleHistoryPageRead,
+            Qt::QueuedConnection);
+    connect(m_historyWriter,
+            &HistoryWriter::writeFailed,
+            this,
+            &ChatServer::handleHistoryWriteFailed,
+            Qt::QueuedConnection);
+    connect(m_historyWriter,
+            &HistoryWriter::logMessage,
+            m_log,
+            &ServerLog::warning,
+            Qt::DirectConnection);
+}
 
 ChatServer::~ChatServer()
 {
     stopServer();
+
+    // With the workers gone nothing else touches the connections that were
+    // still waiting for their disconnect to be processed.
+    m_workerPool->stop();
+    qDeleteAll(m_pendingConnections);
+    m_pendingConnections.clear();
 }
 
 bool ChatServer::startServer(quint16 port)
 {
     if (m_running) {
-        emit logMessage("Server already running");
+        m_log->warning("Server already running");
+        return false;
+    }
+
+    // Ids restarting at 1 would collide with those already in history and
+    // on clients, which drop a message whose id they already hold
+    QDir().mkpath(dataDirectory());
+    if (!m_messageIds.open(dataDirectory() + "/message_sequence")) {
+        m_log->error("Failed to start server: the message id sequence is unreadable");
         return false;
     }
 
     if (!listen(QHostAddress::Any, port)) {
-        emit logMessage(QString("Failed to start server: %1").arg(errorString()));
+        m_messageIds.close();
+        m_log->error(QString("Failed to start server: %1").arg(errorString()));
         return false;
     }
 
+    m_workerPool->start(m_ioThreadCount);
+
     m_port = port;
     m_running = true;
+
+    HistoryStore::Backend backend = m_historyBackend;
+    if (!HistoryStore::isAvailable(backend)) {
+        m_log->warning(QString("History backend '%1' is not available, using log files")
+                           .arg(HistoryStore::backendName(backend)));
+        backend = HistoryStore::LogFiles;
+    }
+    if (backend == HistoryStore::LogFiles) {
+        migrateLegacyHistory();
+    }
+    m_historyWriter->setStore(HistoryStore::create(backend, dataDirectory()));
+    m_historyWriter->start();
+
+    m_watermarks.load(watermarksPath());
+
     emit started(m_port);
-    emit logMessage(QString("Server started on port %1").arg(m_port));
+    emit logMessage(QString("Server started on port %1 with %2 I/O thread(s)")
+                        .arg(m_port)
+                        .arg(m_workerPool->threadCount()));
     return true;
 }
 
@@ -43,17 +141,48 @@ void ChatServer::stopServer()
         return;
     }
 
-    // Disconnect all clients
+    // Disconnect all clients; each one is deleted when its disconnect arrives.
+    // A connection whose start() hasn't run yet closes as soon as it does.
+    QWriteLocker locker(&m_clientsLock);
     for (auto *conn : m_clients) {
+        m_pendingConnections.insert(conn);
+    }
+    for (auto *conn : m_pendingConnections) {
         conn->disconnectClient("Server shutting down");
     }
     m_clients.clear();
-    m_pendingConnections.clear();
+    locker.unlock();
+    m_pausedSenders.clear();
+    m_pendingPresence.clear();
+    m_presenceTimer->stop();
+
+    // Everything routed so far reaches the disk before the server reports stopped
+    m_historyWriter->stop();
+    m_pendingHistoryReads.clear();
+    m_watermarks.save(watermarksPath());
+    m_messageIds.close();
 
     close();
     m_running = false;
     emit stopped();
-    emit logMessage("Server stopped");
+
+    ServerStats::Snapshot s = m_stats.snapshot();
+    emit logMessage(QString("Server stopped (%1 frames in %2 writes, avg batch %3, max %4; "
+                            "%5 dropped, %6 slow consumers disconnected)")
+                        .arg(s.framesWritten)
+                        .arg(s.writeBatches)
+                        .arg(s.averageBatchFrames(), 0, 'f', 2)
+                        .arg(s.maxBatchFrames)
+                        .arg(s.droppedFrames)
+                        .arg(s.slowConsumerDisconnects));
+
+    HistoryCache::Stats c = m_historyCache.stats();
+    emit logMessage(QString("History cache: %1 hits, %2 misses, %3 evictions")
+                        .arg(c.hits)
+                        .arg(c.misses)
+                        .arg(c.evictions));
+    m_historyCache.clear();
+    m_historyWriteSequence.clear();
 }
 
 bool ChatServer::isRunning() const
@@ -66,13 +195,158 @@ quint16 ChatServer::serverPort() const
     return m_port;
 }
 
+void ChatServer::setDataDirectory(const QString &path)
+{
+    m_dataDirectory = path;
+    m_historyCache.clear();
+}
+
+QString ChatServer::dataDirectory() const
+{
+    if (!m_dataDirectory.isEmpty()) {
+        return m_dataDirectory;
+    }
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+}
+
+void ChatServer::setMaxClients(int maxClients)
+{
+    m_maxClients = qMax(0, maxClients);
+}
+
+int ChatServer::maxClients() const
+{
+    return m_maxClients;
+}
+
+void ChatServer::setMaxMessageLength(int maxLength)
+{
+    m_maxMessageLength = qMax(0, maxLength);
+}
+
+int ChatServer::maxMessageLength() const
+{
+    return m_maxMessageLength;
+}
+
+void ChatServer::setIoThreadCount(int count)
+{
+    // Takes effect the next time the worker pool is started
+    m_ioThreadCount = qMax(0, count);
+}
+
+int ChatServer::ioThreadCount() const
+{
+    return m_ioThreadCount;
+}
+
+void ChatServer::setFlushLatency(int latencyMs)
+{
+    // Applies to connections accepted from now on
+    m_flushLatency = qMax(0, latencyMs);
+}
+
+int ChatServer::flushLatency() const
+{
+    return m_flushLatency;
+}
+
+void ChatServer::setFlowControl(const ClientConnection::FlowControl &flowControl)
+{
+    // Applies to connections accepted from now on
+    m_flowControl = flowControl;
+}
+
+ClientConnection::FlowControl ChatServer::flowControl() const
+{
+    return m_flowControl;
+}
+
+void ChatServer::setHistoryCacheSize(qint64 bytes)
+{
+    m_historyCache.setMemoryBudget(bytes);
+}
+
+qint64 ChatServer::historyCacheSize() const
+{
+    return m_historyCache.memoryBudget();
+}
+
+ServerStats::Snapshot ChatServer::stats() const
+{
+    return m_stats.snapshot();
+}
+
+const ServerStats &ChatServer::liveStats() const
+{
+    return m_stats;
+}
+
+qsizetype ChatServer::historyQueueDepth() const
+{
+    return m_historyWriter->queueDepth();
+}
+
+void ChatServer::setHistoryBackend(HistoryStore::Backend backend)
+{
+    // Takes effect the next time the server is started
+    m_historyBackend = backend;
+}
+
+HistoryStore::Backend ChatServer::historyBackend() const
+{
+    return m_historyBackend;
+}
+
+void ChatServer::setHistoryDurability(HistoryWriter::Durability durability)
+{
+    m_historyWriter->setDurability(durability);
+}
+
+HistoryWriter::Durability ChatServer::historyDurability() const
+{
+    return m_historyWriter->durability();
+}
+
+void ChatServer::setHistoryCommitInterval(int intervalMs)
+{
+    m_historyWriter->setCommitInterval(intervalMs);
+}
+
+int ChatServer::historyCommitInterval() const
+{
+    return m_historyWriter->commitInterval();
+}
+
+HistoryCache::Stats ChatServer::historyCacheStats() const
+{
+    return m_historyCache.stats();
+}
+
+ServerLog *ChatServer::serverLog() const
+{
+    return m_log;
+}
+
+quint64 ChatServer::lastMessageId() const
+{
+    return m_messageIds.last();
+}
+
+DeliveryWatermarks::Marks ChatServer::deliveryWatermarks(const QString &username) const
+{
+    return m_watermarks.marks(username);
+}
+
 QStringList ChatServer::clientList() const
 {
+    QReadLocker locker(&m_clientsLock);
     return m_clients.keys();
 }
 
 QMap<QString, QString> ChatServer::clientListWithInfo() const
 {
+    QReadLocker locker(&m_clientsLock);
     QMap<QString, QString> result;
     for (auto it = m_clients.constBegin(); it != m_clients.constEnd(); ++it) {
         QString username = it.key();
@@ -87,17 +361,17 @@ QMap<QString, QString> ChatServer::clientListWithInfo() const
 
 ClientConnection *ChatServer::getClientConnection(const QString &username) const
 {
+    QReadLocker locker(&m_clientsLock);
     return m_clients.value(username, nullptr);
 }
 
 void ChatServer::kickClient(const QString &username, const QString &reason)
 {
-    if (!m_clients.contains(username)) {
+    ClientConnection *conn = getClientConnection(username);
+    if (!conn) {
         return;
     }
 
-    ClientConnection *conn = m_clients[username];
-
     // Send kick notification
     QJsonObject kickMsg;
     kickMsg["type"] = "kick";
@@ -107,13 +381,18 @@ void ChatServer::kickClient(const QString &username, const QString &reason)
     // Disconnect
     conn->disconnectClient(reason);
 
-    emit logMessage(QString("Kicked user: %1 - Reason: %2").arg(username).arg(reason));
+    m_log->log(ServerLog::Info,
+               "client_kicked",
+               username,
+               "Kicked user: %1 - Reason: %2",
+               username,
+               reason);
 }
 
 void ChatServer::sendMessageToUser(const QString &username, const QJsonObject &msg)
 {
-    if (m_clients.contains(username)) {
-        m_clients[username]->sendJson(msg);
+    if (ClientConnection *conn = getClientConnection(username)) {
+        conn->sendJson(msg);
     }
 }
 
@@ -125,11 +404,7 @@ void ChatServer::broadcastMessage(const QString &text)
     // saveMessageToHistory(msg);
 
     // Send to all clients
-    QJsonObject obj = msg.toJson();
-    obj["type"] = "chat"; // Message type in protocol
-    // Note: msg.toJson() already includes the MessageType enum value
-
-    broadcastJson(obj);
+    broadcastFrame(PreparedFrame(msg));
 
     emit logMessage(QString("Broadcast: %1").arg(text));
     emit messageReceived("SERVER", "", text);
@@ -137,15 +412,34 @@ void ChatServer::broadcastMessage(const QString &text)
 
 void ChatServer::broadcastJson(const QJsonObject &msg)
 {
+    broadcastFrame(PreparedFrame(msg));
+}
+
+void ChatServer::broadcastFrame(const PreparedFrame &frame)
+{
+    // Encoded once per wire encoding; every connection using that encoding
+    // writes the same shared buffer
+    QReadLocker locker(&m_clientsLock);
     for (auto *conn : m_clients) {
-        conn->sendJson(msg);
+        conn->sendFrame(frame);
     }
 }
 
 void ChatServer::incomingConnection(qintptr socketDescriptor)
 {
-    ClientConnection *conn = new ClientConnection(socketDescriptor, this);
-    m_pendingConnections[socketDescriptor] = conn;
+    // Connections have no parent so they can live in a worker thread; the
+    // server deletes them once they disconnect.
+    ClientConnection *conn = new ClientConnection(socketDescriptor);
+    m_stats.connectionsAccepted.fetchAndAddRelaxed(1);
+    m_stats.connectionsOpen.fetchAndAddRelaxed(1);
+    conn->setFlushLatency(m_flushLatency);
+    conn->setStats(&m_stats);
+    conn->setLog(m_log);
+    conn->setFlowControl(m_flowControl);
+    if (QThread *worker = m_workerPool->acquireThread()) {
+        conn->moveToThread(worker);
+    }
+    m_pendingConnections.insert(conn);
 
     connect(conn, &ClientConnection::registered, this, &ChatServer::handleClientRegistered);
     connect(conn, &ClientConnection::messageReceived, this, &ChatServer::handleClientMessage);
@@ -154,130 +448,476 @@ void ChatServer::incomingConnection(qintptr socketDescriptor)
             &ClientConnection::chatHistoryRequested,
             this,
             &ChatServer::handleChatHistoryRequest);
-    connect(conn, &ClientConnection::logMessage, this, &ChatServer::logMessage);
+    connect(conn,
+            &ClientConnection::congestionChanged,
+            this,
+            &ChatServer::handleCongestionChanged);
+    connect(conn, &ClientConnection::acknowledged, this, &ChatServer::handleClientAck);
 
-    emit logMessage(QString("New connection from %1:%2 (descriptor: %3)")
-                        .arg(conn->peerAddress())
-                        .arg(conn->peerPort())
-                        .arg(socketDescriptor));
+    // Take over the socket in the connection's own thread
+    QMetaObject::invokeMethod(conn, &ClientConnection::start, Qt::QueuedConnection);
 }
 
 void ChatServer::handleClientRegistered(const QString &username, ClientConnection *connection)
 {
+    if (!m_running || !m_pendingConnections.contains(connection)) {
+        return; // Already disconnected or the server was stopped meanwhile
+    }
+
     // Check if username already exists
+    QWriteLocker locker(&m_clientsLock);
     if (m_clients.contains(username)) {
+        locker.unlock();
         QJsonObject errorMsg;
         errorMsg["type"] = "error";
         errorMsg["message"] = "Username already taken";
+        m_stats.registrationsRejected.fetchAndAddRelaxed(1);
         connection->sendJson(errorMsg);
         connection->disconnectClient("Username taken");
+        m_log->log(ServerLog::Info,
+                   "registration_rejected",
+                   username,
+                   "Rejected %1: username already taken",
+                   username);
+        return;
+    }
+
+    if (m_maxClients > 0 && m_clients.size() >= m_maxClients) {
+        locker.unlock();
+        QJsonObject errorMsg;
+        errorMsg["type"] = "error";
+        errorMsg["message"] = "Server is full";
+        m_stats.registrationsRejected.fetchAndAddRelaxed(1);
+        connection->sendJson(errorMsg);
+        connection->disconnectClient("Server full");
+        m_log->log(ServerLog::Warning,
+                   "registration_rejected",
+                   username,
+                   "Rejected %1: client limit of %2 reached",
+                   username,
+                   m_maxClients);
         return;
     }
 
     // Remove from pending and add to active clients
-    m_pendingConnections.remove(connection->socketDescriptor());
+    m_pendingConnections.remove(connection);
     m_clients[username] = connection;
+    locker.unlock();
+    m_stats.registrations.fetchAndAddRelaxed(1);
 
     emit clientConnected(username);
-    emit logMessage(QString("Client registered: %1 from %2:%3")
-                        .arg(username)
-                        .arg(connection->peerAddress())
-                        .arg(connection->peerPort()));
-
-    // Send user list update to all clients
-    notifyUserListUpdate();
+    m_log->log(ServerLog::Info,
+               "client_registered",
+               username,
+               "Client registered: %1 from %2:%3",
+               username,
+               connection->peerAddress(),
+               connection->peerPort());
+
+    // The new client gets the full list once; everyone else a batched delta
+    connection->sendJson(userListSnapshot());
+    queuePresenceChange(username, true);
 }
 
-void ChatServer::handleClientMessage(const QString &from, const QString &to, const QString &text)
+void ChatServer::handleClientMessage(const QString &from,
+                                     const QString &to,
+                                     const QString &text,
+                                     qint64 correlationId,
+                                     qint64 receivedAt)
 {
+    if (m_maxMessageLength > 0 && text.size() > m_maxMessageLength) {
+        QJsonObject errorMsg;
+        errorMsg["type"] = "error";
+        errorMsg["message"] = QString("Message exceeds %1 characters").arg(m_maxMessageLength);
+        if (correlationId != 0) {
+            errorMsg["cid"] = correlationId; // Lets the client drop the pending message
+        }
+        sendMessageToUser(from, errorMsg);
+        m_log->log(ServerLog::Warning,
+                   "message_too_long",
+                   from,
+                   "Dropped oversized message from %1 (%2 chars)",
+                   from,
+                   text.size());
+        return;
+    }
+
     ChatMessage msg(from, to, text, ChatMessage::Private);
+    msg.setId(m_messageIds.next());
 
     // Save to history
     saveMessageToHistory(msg);
 
-    // Get sender's connection info for logging
-    QString senderInfo = from;
-    QString recipientInfo = to;
+    ClientConnection *senderConn = getClientConnection(from);
+    ClientConnection *recipientConn = getClientConnection(to);
 
-    if (m_clients.contains(from)) {
-        ClientConnection *senderConn = m_clients[from];
-        senderInfo = QString("%1 (%2:%3)")
-                         .arg(from)
-                         .arg(senderConn->peerAddress())
-                         .arg(senderConn->peerPort());
+    // Push back on the sender instead of queueing without bound for a
+    // recipient that is not reading
+    if (recipientConn && senderConn && recipientConn->isCongested()
+        && m_flowControl.policy == ClientConnection::PauseSenders
+        && !m_pausedSenders.contains(recipientConn, senderConn)) {
+        m_pausedSenders.insert(recipientConn, senderConn);
+        senderConn->setReadPaused(true);
     }
 
-    if (m_clients.contains(to)) {
-        ClientConnection *recipientConn = m_clients[to];
-        recipientInfo = QString("%1 (%2:%3)")
-                            .arg(to)
-                            .arg(recipientConn->peerAddress())
-                            .arg(recipientConn->peerPort());
-    }
+    // Encoded once, for the recipient and for senders that need the echo
+    const PreparedFrame frame = ClientConnection::prepareChatFrame(msg);
 
-    // Forward to recipient
-    if (m_clients.contains(to)) {
-        m_clients[to]->sendChatMessage(msg);
+    // Forward to recipient; a note to self only goes through the sender path
+    if (recipientConn && recipientConn != senderConn) {
+        recipientConn->sendFrame(frame);
     }
 
-    // Echo back to sender (for confirmation)
-    if (m_clients.contains(from)) {
-        m_clients[from]->sendChatMessage(msg);
+    // The sender already shows its message, so it only needs the id and time
+    // the server gave it. Clients from before "sent" acks get the full echo.
+    if (senderConn) {
+        if (senderConn->supportsSendAcks()) {
+            QJsonObject ack;
+            ack["type"] = "sent";
+            ack["cid"] = correlationId;
+            ack["id"] = static_cast<qint64>(msg.id());
+            ack["timestamp"] = msg.timestamp().toString(Qt::ISODate);
+            senderConn->sendJson(ack);
+        } else {
+            senderConn->sendFrame(frame);
+        }
     }
+    m_stats.routingLatency.observe(ServerStats::nsecsNow() - receivedAt);
 
     emit messageReceived(from, to, text);
-    emit logMessage(QString("Routed: %1 → %2").arg(senderInfo).arg(recipientInfo));
+
+    // Per-message records are debug only; the values are copied as they are
+    // and only turned into text on the log thread
+    if (recipientConn) {
+        m_log->log(ServerLog::Debug,
+                   "message_routed",
+                   from,
+                   "Routed: %1 → %2 (%3 chars)",
+                   from,
+                   to,
+                   text.size());
+    } else {
+        m_log->log(ServerLog::Debug,
+                   "message_stored",
+                   from,
+                   "Stored: %1 → %2, recipient offline (%3 chars)",
+                   from,
+                   to,
+                   text.size());
+    }
 }
 
 void ChatServer::handleClientDisconnected(const QString &username)
 {
-    if (username.isEmpty()) {
+    ClientConnection *conn = qobject_cast<ClientConnection *>(sender());
+    if (!conn) {
+        return;
+    }
+
+    // Only unroute the user if this connection is the one registered under
+    // that name (a rejected duplicate carries the same username).
+    QWriteLocker locker(&m_clientsLock);
+    const bool wasRegistered = !username.isEmpty() && m_clients.value(username) == conn;
+    if (wasRegistered) {
+        m_clients.remove(username);
+    }
+    locker.unlock();
+
+    m_pendingConnections.remove(conn);
+    m_stats.connectionsOpen.fetchAndSubRelaxed(1);
+    resumeSendersPausedBy(conn);
+    for (auto it = m_pausedSenders.begin(); it != m_pausedSenders.end();) {
+        it = (it.value() == conn) ? m_pausedSenders.erase(it) : std::next(it);
+    }
+    m_workerPool->releaseThread(conn->thread());
+    conn->deleteLater();
+
+    if (!wasRegistered) {
         // Pending connection disconnected
         return;
     }
 
-    m_clients.remove(username);
     emit clientDisconnected(username);
-    emit logMessage(QString("Client disconnected: %1").arg(username));
+    m_log->log(ServerLog::Info,
+               "client_disconnected",
+               username,
+               "Client disconnected: %1",
+               username);
 
     // Notify all remaining clients
-    notifyUserListUpdate();
+    queuePresenceChange(username, false);
+}
+
+void ChatServer::handleChatHistoryRequest(
+    const QString &requester, const QString &withUser, qint64 before, qint64 after, int limit)
+{
+    if (limit <= 0) {
+        limit = kDefaultHistoryPageSize;
+    }
+    limit = qMin(limit, kMaxHistoryPageSize);
+
+    // Active conversations are answered from the cache without any file access
+    const QString convId = ChatMessage::conversationId(requester, withUser);
+    const qint64 total = m_historyCache.count(convId);
+    if (total >= 0) {
+        qint64 first;
+        qint64 last;
+        HistoryWriter::pageBounds(total, before, after, limit, &first, &last);
+
+        QList<ChatMessage> page;
+        if (m_historyCache.read(convId, first, last, &page)) {
+            sendHistoryPage(requester, withUser, before, after, first, total, page);
+            return;
+        }
+    }
+
+    // Everything else is read behind the queued writes on the writer thread
+    PendingHistoryRead request;
+    request.requester = requester;
+    request.withUser = withUser;
+    request.before = before;
+    request.after = after;
+    request.writeSequence = m_historyWriteSequence.value(convId);
+
+    const quint64 requestId = ++m_lastHistoryReadId;
+    m_pendingHistoryReads.insert(requestId, request);
+    m_historyWriter->readPage(requestId,
+                              convId,
+                              before,
+                              after,
+                              limit);
+}
+
+void ChatServer::handleHistoryPageRead(quint64 requestId,
+                                       qint64 first,
+                                       qint64 total,
+                                       const QList<ChatMessage> &messages)
+{
+    auto it = m_pendingHistoryReads.find(requestId);
+    if (it == m_pendingHistoryReads.end()) {
+        return; // Requested before the server was stopped
+    }
+    const PendingHistoryRead request = it.value();
+    m_pendingHistoryReads.erase(it);
+
+    // Only a newest page with no writes queued since the read can seed the cache
+    const QString convId = ChatMessage::conversationId(request.requester, request.withUser);
+    if (first + messages.size() == total
+        && m_historyWriteSequence.value(convId) == request.writeSequence) {
+        m_historyCache.insert(convId, messages, total);
+    }
+
+    sendHistoryPage(request.requester,
+                    request.withUser,
+                    request.before,
+                    request.after,
+                    first,
+                    total,
+                    messages);
+}
+
+void ChatServer::handleHistoryWriteFailed(const QString &conversationId)
+{
+    m_historyCache.remove(conversationId); // The cached count no longer matches the log
 }
 
-void ChatServer::handleChatHistoryRequest(const QString &requester, const QString &withUser)
+void ChatServer::sendHistoryPage(const QString &requester,
+                                 const QString &withUser,
+                                 qint64 before,
+                                 qint64 after,
+                                 qint64 first,
+                                 qint64 total,
+                                 const QList<ChatMessage> &page)
 {
-    QList<ChatMessage> history = getChatHistory(requester, withUser);
+    ClientConnection *conn = getClientConnection(requester);
+    if (!conn) {
+        return;
+    }
+
+    const qint64 end = first + page.size();
+    const bool hasMore = after >= 0 ? end < total : first > 0;
+
+    if (!conn->supportsHistoryStreaming()) {
+        // Older clients take the whole page as one frame
+        QJsonObject response;
+        response["type"] = "chat_history";
+        response["with"] = withUser;
+        response["start"] = first;
+        response["end"] = end;
+        response["has_more"] = hasMore;
+        if (before >= 0) {
+            response["before"] = before;
+        }
+        if (after >= 0) {
+            response["after"] = after;
+        }
+        conn->sendMessages(response, page);
+    } else {
+        // Bounded chunks, each its own frame, so other traffic interleaves and
+        // the client can render as they arrive. Backward pages go newest chunk
+        // first: the client prepends each one and the latest messages show up
+        // right away. Forward pages go oldest first.
+        QList<QPair<qsizetype, qsizetype>> chunks; // [from, to) indexes into page
+        qsizetype chunkStart = 0;
+        qsizetype chunkBytes = 0;
+        for (qsizetype i = 0; i < page.size(); ++i) {
+            const qsizetype size = estimatedJsonSize(page.at(i));
+            if (i > chunkStart && chunkBytes + size > kHistoryChunkBytes) {
+                chunks.append({chunkStart, i});
+                chunkStart = i;
+                chunkBytes = 0;
+            }
+            chunkBytes += size;
+        }
+        if (chunkStart < page.size()) {
+            chunks.append({chunkStart, page.size()});
+        }
+        if (after < 0) {
+            std::reverse(chunks.begin(), chunks.end());
+        }
 
-    QJsonArray arr;
-    for (const auto &msg : history) {
-        arr.append(msg.toJson());
+        for (const auto &chunk : chunks) {
+            QJsonObject frame;
+            frame["type"] = "history_chunk";
+            frame["with"] = withUser;
+            frame["start"] = first + chunk.first;
+            conn->sendMessages(frame, page.mid(chunk.first, chunk.second - chunk.first));
+        }
+
+        QJsonObject endMarker;
+        endMarker["type"] = "history_end";
+        endMarker["with"] = withUser;
+        endMarker["start"] = first;
+        endMarker["end"] = end;
+        endMarker["has_more"] = hasMore;
+        if (before >= 0) {
+            endMarker["before"] = before;
+        }
+        if (after >= 0) {
+            endMarker["after"] = after;
+        }
+        conn->sendJson(endMarker);
     }
 
-    QJsonObject response;
-    response["type"] = "chat_history";
-    response["with"] = withUser;
-    response["messages"] = arr;
+    m_log->log(ServerLog::Debug,
+               "history_sent",
+               requester,
+               "Sent %1 of %2 history messages to %3 (conversation with %4)",
+               page.size(),
+               total,
+               requester,
+               withUser);
+}
 
-    sendMessageToUser(requester, response);
+void ChatServer::handleCongestionChanged(bool congested)
+{
+    ClientConnection *conn = qobject_cast<ClientConnection *>(sender());
+    if (!conn || congested) {
+        return;
+    }
 
-    emit logMessage(QString("Sent %1 history messages to %2 (conversation with %3)")
-                        .arg(history.size())
-                        .arg(requester)
-                        .arg(withUser));
+    resumeSendersPausedBy(conn);
+
+    // User lists may have been dropped while it was behind; bring it up to date
+    if (m_flowControl.policy == ClientConnection::DropEphemeral && conn->isRegistered()) {
+        conn->sendJson(userListSnapshot());
+    }
 }
 
-void ChatServer::notifyUserListUpdate()
+void ChatServer::handleClientAck(const QString &username, quint64 delivered, quint64 read)
 {
-    QJsonArray arr;
-    for (const QString &user : m_clients.keys()) {
-        arr.append(user);
+    // Nothing beyond the last id handed out exists, and a message that was
+    // read was delivered too
+    const quint64 last = m_messageIds.last();
+    read = qMin(read, last);
+    delivered = qMin(qMax(delivered, read), last);
+    if (m_watermarks.advance(username, delivered, read)) {
+        m_log->log(ServerLog::Debug,
+                   "ack_received",
+                   username,
+                   "%1 acknowledged delivery up to %2, read up to %3",
+                   username,
+                   delivered,
+                   read);
     }
+}
+
+void ChatServer::resumeSendersPausedBy(ClientConnection *consumer)
+{
+    const QList<ClientConnection *> senders = m_pausedSenders.values(consumer);
+    m_pausedSenders.remove(consumer);
+
+    // A sender stays paused while any other consumer it writes to is still behind
+    for (ClientConnection *senderConn : senders) {
+        bool stillBlocked = false;
+        for (auto it = m_pausedSenders.constBegin(); it != m_pausedSenders.constEnd(); ++it) {
+            if (it.value() == senderConn) {
+                stillBlocked = true;
+                break;
+            }
+        }
+        if (!stillBlocked) {
+            senderConn->setReadPaused(false);
+        }
+    }
+}
 
+QJsonObject ChatServer::userListSnapshot() const
+{
     QJsonObject msg;
     msg["type"] = "user_list";
-    msg["users"] = arr;
+    msg["users"] = QJsonArray::fromStringList(clientList());
+    return msg;
+}
 
-    broadcastJson(msg);
+void ChatServer::queuePresenceChange(const QString &username, bool online)
+{
+    // Only the last change per user in a batch matters
+    m_pendingPresence[username] = online;
+    if (!m_presenceTimer->isActive()) {
+        m_presenceTimer->start();
+    }
+}
+
+void ChatServer::flushPresenceChanges()
+{
+    if (m_pendingPresence.isEmpty()) {
+        return;
+    }
+
+    QJsonArray joined;
+    QJsonArray left;
+    for (auto it = m_pendingPresence.constBegin(); it != m_pendingPresence.constEnd(); ++it) {
+        (it.value() ? joined : left).append(it.key());
+    }
+    m_pendingPresence.clear();
+
+    QJsonObject joinMsg;
+    joinMsg["type"] = "presence_join";
+    joinMsg["users"] = joined;
+    QJsonObject leaveMsg;
+    leaveMsg["type"] = "presence_leave";
+    leaveMsg["users"] = left;
+
+    // Deltas must all arrive to add up, so they are reliable; the full list
+    // for clients without delta support supersedes itself and is not.
+    const PreparedFrame joinFrame(joinMsg);
+    const PreparedFrame leaveFrame(leaveMsg);
+    const PreparedFrame snapshotFrame(userListSnapshot(), PreparedFrame::Ephemeral);
+
+    QReadLocker locker(&m_clientsLock);
+    for (auto *conn : m_clients) {
+        if (!conn->supportsPresenceDeltas()) {
+            conn->sendFrame(snapshotFrame);
+            continue;
+        }
+        if (!joined.isEmpty()) {
+            conn->sendFrame(joinFrame);
+        }
+        if (!left.isEmpty()) {
+            conn->sendFrame(leaveFrame);
+        }
+    }
 }
 
 void ChatServer::saveMessageToHistory(const ChatMessage &message)
@@ -287,28 +927,48 @@ void ChatServer::saveMessageToHistory(const ChatMessage &message)
         return;
     }
 
-    QString filePath = getHistoryFilePath(message.from(), message.to());
-
-    // Load existing messages
-    QList<ChatMessage> messages = ChatMessage::loadMessages(filePath);
-    messages.append(message);
-
-    // Save updated list
-    ChatMessage::saveMessages(messages, filePath);
+    // The cache is updated right away; the file write happens on the writer
+    // thread, so disk latency never holds up routing
+    const QString convId = ChatMessage::conversationId(message.from(), message.to());
+    ++m_historyWriteSequence[convId];
+    m_historyCache.append(convId, message);
+    m_historyWriter->append(convId, message);
 }
 
-QString ChatServer::getHistoryFilePath(const QString &user1, const QString &user2)
+QString ChatServer::getHistoryDirectory() const
 {
-    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-    dataPath += "/server_history";
+    QString dataPath = dataDirectory() + "/server_history";
     QDir().mkpath(dataPath);
+    return dataPath;
+}
 
-    QString convId = ChatMessage::conversationId(user1, user2);
-    return QString("%1/%2.json").arg(dataPath).arg(convId);
+QString ChatServer::watermarksPath() const
+{
+    return dataDirectory() + "/delivery_watermarks.json";
 }
 
-QList<ChatMessage> ChatServer::getChatHistory(const QString &user1, const QString &user2)
+void ChatServer::migrateLegacyHistory()
 {
-    QString filePath = getHistoryFilePath(user1, user2);
-    return ChatMessage::loadMessages(filePath);
+    QDir dir(getHistoryDirectory());
+    const QStringList jsonFiles = dir.entryList({"*.json"}, QDir::Files);
+
+    for (const QString &fileName : jsonFiles) {
+        QString jsonPath = dir.filePath(fileName);
+        QString logPath = dir.filePath(QFileInfo(fileName).completeBaseName() + ".chatlog");
+
+        if (QFile::exists(logPath)) {
+            m_log->warning(
+                QString("Skipping history migration, log already exists: %1").arg(logPath));
+            continue;
+        }
+
+        if (!MessageLog::migrateJson(jsonPath, logPath)) {
+            m_log->warning(QString("Failed to migrate history file: %1").arg(jsonPath));
+            continue;
+        }
+
+        // Keep the original around but out of the way so it is only migrated once
+        QFile::rename(jsonPath, jsonPath + ".migrated");
+        emit logMessage(QString("Migrated history file: %1").arg(fileName));
+    }
 }
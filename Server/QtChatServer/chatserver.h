@@ -1,14 +1,27 @@
 #ifndef CHATSERVER_H
 #define CHATSERVER_H
 
+#include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMultiHash>
 #include <QPointer>
+#include <QReadWriteLock>
+#include <QSet>
 #include <QStringList>
 #include <QTcpServer>
 #include "chatmessage.h"
+#include "clientconnection.h"
+#include "deliverywatermarks.h"
+#include "historycache.h"
+#include "historywriter.h"
+#include "messagesequence.h"
+#include "preparedframe.h"
+#include "serverlog.h"
+#include "serverstats.h"
 
-class ClientConnection;
+class ConnectionWorkerPool;
+class QTimer;
 
 class ChatServer : public QTcpServer
 {
@@ -23,7 +36,44 @@ public:
     bool isRunning() const;
     quint16 serverPort() const;
 
-    // Client management
+    // Configuration
+    void setDataDirectory(const QString &path); // Empty means the platform app data location
+    QString dataDirectory() const;
+    void setMaxClients(int maxClients); // 0 means unlimited
+    int maxClients() const;
+    void setMaxMessageLength(int maxLength); // 0 means unlimited
+    int maxMessageLength() const;
+    void setIoThreadCount(int count); // Connection I/O threads, 0 means one per core
+    int ioThreadCount() const;
+    void setFlushLatency(int latencyMs); // Output batching window, 0 means one event-loop pass
+    int flushLatency() const;
+    void setFlowControl(const ClientConnection::FlowControl &flowControl);
+    ClientConnection::FlowControl flowControl() const;
+    void setHistoryCacheSize(qint64 bytes); // Memory for cached conversation tails, 0 disables
+    qint64 historyCacheSize() const;
+    void setHistoryBackend(HistoryStore::Backend backend);
+    HistoryStore::Backend historyBackend() const;
+    void setHistoryDurability(HistoryWriter::Durability durability);
+    HistoryWriter::Durability historyDurability() const;
+    void setHistoryCommitInterval(int intervalMs); // Group commit window for history writes
+    int historyCommitInterval() const;
+
+    // Statistics
+    ServerStats::Snapshot stats() const;
+    const ServerStats &liveStats() const; // The counters themselves, safe to read anywhere
+    qsizetype historyQueueDepth() const;
+    HistoryCache::Stats historyCacheStats() const;
+
+    // Leveled log of server events, written out on its own thread. logMessage
+    // and the connections feed it; sinks and the level are set on it directly.
+    ServerLog *serverLog() const;
+
+    // Every routed message gets the next id of a sequence that survives
+    // restarts; clients acknowledge what they received and read by id
+    quint64 lastMessageId() const;
+    DeliveryWatermarks::Marks deliveryWatermarks(const QString &username) const;
+
+    // Client management; the routing table may be queried from any thread
     QStringList clientList() const;
     QMap<QString, QString> clientListWithInfo() const; // username -> "IP:Port"
     ClientConnection *getClientConnection(const QString &username) const;
@@ -33,9 +83,7 @@ public:
     void sendMessageToUser(const QString &username, const QJsonObject &msg);
     void broadcastMessage(const QString &text);
     void broadcastJson(const QJsonObject &msg);
-
-    // History management
-    QList<ChatMessage> getChatHistory(const QString &user1, const QString &user2);
+    void broadcastFrame(const PreparedFrame &frame);
 
 signals:
     void started(quint16 port);
@@ -49,23 +97,87 @@ protected:
     void incomingConnection(qintptr socketDescriptor) override;
 
 private slots:
-    void handleClientMessage(const QString &from, const QString &to, const QString &text);
+    void handleClientMessage(const QString &from,
+                             const QString &to,
+                             const QString &text,
+                             qint64 correlationId,
+                             qint64 receivedAt);
     void handleClientDisconnected(const QString &username);
     void handleClientRegistered(const QString &username, ClientConnection *connection);
-    void handleChatHistoryRequest(const QString &requester, const QString &withUser);
+    void handleChatHistoryRequest(
+        const QString &requester, const QString &withUser, qint64 before, qint64 after, int limit);
+    void handleHistoryPageRead(quint64 requestId,
+                               qint64 first,
+                               qint64 total,
+                               const QList<ChatMessage> &messages);
+    void handleHistoryWriteFailed(const QString &conversationId);
+    void handleCongestionChanged(bool congested);
+    void handleClientAck(const QString &username, quint64 delivered, quint64 read);
+    void flushPresenceChanges();
 
 private:
     Q_DISABLE_COPY(ChatServer)
 
-    void notifyUserListUpdate();
+    QJsonObject userListSnapshot() const;
+    void queuePresenceChange(const QString &username, bool online);
+    void resumeSendersPausedBy(ClientConnection *consumer);
     void saveMessageToHistory(const ChatMessage &message);
-    QString getHistoryFilePath(const QString &user1, const QString &user2);
+    QString getHistoryDirectory() const;
+    QString watermarksPath() const;
+    void sendHistoryPage(const QString &requester,
+                         const QString &withUser,
+                         qint64 before,
+                         qint64 after,
+                         qint64 first,
+                         qint64 total,
+                         const QList<ChatMessage> &page);
+    void migrateLegacyHistory();
 
+    // Connections are created, routed and deleted on the server's thread but
+    // live in worker threads, so the routing table is guarded for readers
+    // elsewhere.
+    mutable QReadWriteLock m_clientsLock;
     QMap<QString, ClientConnection *> m_clients;
-    QMap<qintptr, ClientConnection *> m_pendingConnections;
+    QSet<ClientConnection *> m_pendingConnections;
+    ConnectionWorkerPool *m_workerPool;
+    int m_ioThreadCount;
+    int m_flushLatency;
+    ClientConnection::FlowControl m_flowControl;
+    QMultiHash<ClientConnection *, ClientConnection *> m_pausedSenders; // consumer -> senders
+    ServerStats m_stats;
+
+    QMap<QString, bool> m_pendingPresence; // username -> online, batched into deltas
+    QTimer *m_presenceTimer;
+
+    // History requests waiting for the writer thread to read a page
+    struct PendingHistoryRead
+    {
+        QString requester;
+        QString withUser;
+        qint64 before;
+        qint64 after;
+        quint64 writeSequence; // m_historyWriteSequence at request time
+    };
+
+    HistoryCache m_historyCache;
+    HistoryStore::Backend m_historyBackend;
+    HistoryWriter *m_historyWriter;
+    QHash<QString, quint64> m_historyWriteSequence; // conversationId -> writes queued
+    QHash<quint64, PendingHistoryRead> m_pendingHistoryReads;
+    quint64 m_lastHistoryReadId;
+
+    MessageSequence m_messageIds;
+    DeliveryWatermarks m_watermarks;
+
+    QString m_dataDirectory;
+    int m_maxClients;
+    int m_maxMessageLength;
 
     quint16 m_port;
     bool m_running;
+
+    // Created last so it outlives the other children that log into it
+    ServerLog *m_log;
 };
 
 #endif // CHATSERVER_H
@@ -1,27 +1,162 @@
 #include "clientconnection.h"
-#include <QDataStream>
+#include <QDateTime>
 #include <QDebug>
-#include <QJsonDocument>
+#include <QJsonArray>
 #include <QJsonObject>
+#include <QThread>
+#include <QTimer>
 #include "chatmessage.h"
+#include "serverlog.h"
+#include "serverstats.h"
+
+namespace {
+
+// Flush right away once this much output is queued, whatever the latency cap
+const qsizetype kMaxPendingBytes = 256 * 1024;
+
+// Socket read buffer while reading is paused for backpressure
+const qint64 kPausedReadBufferSize = 64 * 1024;
+
+} // namespace
 
 ClientConnection::ClientConnection(qintptr socketDescriptor, QObject *parent)
     : QObject(parent)
-    , m_socket(new QTcpSocket(this))
     , m_socketDescriptor(socketDescriptor)
+    , m_peerPort(0)
+    , m_encoding(FrameCodec::Json)
+    , m_presenceDeltas(0)
+    , m_historyStreaming(0)
+    , m_sendAcks(0)
+    , m_pendingBytes(0)
+    , m_flushTimer(nullptr)
+    , m_flushLatency(0)
+    , m_stats(nullptr)
+    , m_log(nullptr)
+    , m_readAt(0)
+    , m_connectedAt(QDateTime::currentMSecsSinceEpoch())
+    , m_bytesReceived(0)
+    , m_bytesSent(0)
+    , m_queueDepth(0)
+    , m_congested(0)
+    , m_readPaused(false)
     , m_registered(false)
+    , m_closing(false)
+{}
+
+void ClientConnection::setFlushLatency(int latencyMs)
+{
+    m_flushLatency = qMax(0, latencyMs);
+}
+
+void ClientConnection::setStats(ServerStats *stats)
+{
+    m_stats = stats;
+}
+
+void ClientConnection::setLog(ServerLog *log)
+{
+    m_log = log;
+}
+
+void ClientConnection::setFlowControl(const FlowControl &flowControl)
+{
+    m_flowControl = flowControl;
+}
+
+qint64 ClientConnection::queueDepth() const
+{
+    return m_queueDepth.loadRelaxed();
+}
+
+bool ClientConnection::isCongested() const
 {
-    if (!m_socket->setSocketDescriptor(socketDescriptor)) {
-        emit logMessage(QString("Failed to set socket descriptor: %1").arg(m_socket->errorString()));
-        deleteLater();
+    return m_congested.loadAcquire() != 0;
+}
+
+void ClientConnection::setReadPaused(bool paused)
+{
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(
+            this, [this, paused]() { setReadPaused(paused); }, Qt::QueuedConnection);
+        return;
+    }
+
+    if (!m_socket || m_readPaused == paused) {
+        return;
+    }
+
+    m_readPaused = paused;
+    if (paused) {
+        // Once this small buffer fills the socket stops reading and the
+        // kernel's receive window closes on the sender.
+        m_socket->setReadBufferSize(kPausedReadBufferSize);
+        if (m_stats) {
+            m_stats->pausedSenders.fetchAndAddRelaxed(1);
+        }
+    } else {
+        m_socket->setReadBufferSize(0);
+        if (m_stats) {
+            m_stats->pausedSenders.fetchAndSubRelaxed(1);
+        }
+        onReadyRead(); // Process whatever arrived while paused
+    }
+}
+
+void ClientConnection::start()
+{
+    // The socket is created here rather than in the constructor so that its
+    // notifiers belong to the worker thread the connection was moved to.
+    m_socket = new QTcpSocket(this);
+    if (!m_socket->setSocketDescriptor(m_socketDescriptor)) {
+        if (m_log) {
+            m_log->log(ServerLog::Error,
+                       "socket_setup_failed",
+                       QString(),
+                       "Failed to set socket descriptor: %1",
+                       m_socket->errorString());
+        }
+        emit disconnected(m_username);
         return;
     }
 
+    if (m_closing) {
+        // e.g. the server stopped while this was still queued
+        m_socket->abort();
+        emit disconnected(m_username);
+        return;
+    }
+
+    QHostAddress addr = m_socket->peerAddress();
+
+    // Convert IPv4-mapped IPv6 to IPv4 for cleaner display
+    if (addr.protocol() == QAbstractSocket::IPv6Protocol) {
+        QHostAddress ipv4Addr(addr.toIPv4Address());
+        if (!ipv4Addr.isNull()) {
+            addr = ipv4Addr; // Gives clean "127.0.0.1"
+        }
+    }
+    m_peerAddress = addr.toString();
+    m_peerPort = m_socket->peerPort();
+
+    m_flushTimer = new QTimer(this);
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setInterval(m_flushLatency);
+    connect(m_flushTimer, &QTimer::timeout, this, &ClientConnection::flushPendingFrames);
+
     connect(m_socket, &QTcpSocket::readyRead, this, &ClientConnection::onReadyRead);
     connect(m_socket, &QTcpSocket::disconnected, this, &ClientConnection::onDisconnected);
     connect(m_socket, &QTcpSocket::errorOccurred, this, &ClientConnection::onSocketError);
-
-    emit logMessage(QString("ClientConnection created for descriptor %1").arg(socketDescriptor));
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &ClientConnection::updateQueueDepth);
+
+    if (m_log) {
+        m_log->log(ServerLog::Info,
+                   "connection_opened",
+                   QString(),
+                   "New connection from %1:%2 (descriptor: %3)",
+                   m_peerAddress,
+                   m_peerPort,
+                   qint64(m_socketDescriptor));
+    }
 }
 
 ClientConnection::~ClientConnection()
@@ -46,123 +181,322 @@ bool ClientConnection::isRegistered() const
     return m_registered;
 }
 
-QString ClientConnection::peerAddress() const
+FrameCodec::Encoding ClientConnection::encoding() const
 {
-    if (m_socket) {
-        QHostAddress addr = m_socket->peerAddress();
+    return static_cast<FrameCodec::Encoding>(m_encoding.loadAcquire());
+}
 
-        // Convert IPv4-mapped IPv6 to IPv4 for cleaner display
-        if (addr.protocol() == QAbstractSocket::IPv6Protocol) {
-            QHostAddress ipv4Addr(addr.toIPv4Address());
-            if (!ipv4Addr.isNull()) {
-                return ipv4Addr.toString(); // Returns clean "127.0.0.1"
-            }
-        }
+bool ClientConnection::supportsPresenceDeltas() const
+{
+    return m_presenceDeltas.loadAcquire() != 0;
+}
 
-        return addr.toString();
-    }
-    return QString();
+bool ClientConnection::supportsHistoryStreaming() const
+{
+    return m_historyStreaming.loadAcquire() != 0;
+}
+
+bool ClientConnection::supportsSendAcks() const
+{
+    return m_sendAcks.loadAcquire() != 0;
+}
+
+QString ClientConnection::peerAddress() const
+{
+    return m_peerAddress;
 }
 
 quint16 ClientConnection::peerPort() const
 {
-    if (m_socket) {
-        return m_socket->peerPort();
-    }
-    return 0;
+    return m_peerPort;
+}
+
+qint64 ClientConnection::connectedAt() const
+{
+    return m_connectedAt;
+}
+
+quint64 ClientConnection::bytesReceived() const
+{
+    return m_bytesReceived.loadRelaxed();
+}
+
+quint64 ClientConnection::bytesSent() const
+{
+    return m_bytesSent.loadRelaxed();
 }
 
 QString ClientConnection::connectionInfo() const
 {
-    if (m_socket) {
-        return QString("%1 (%2:%3)")
-            .arg(m_username.isEmpty() ? "Unregistered" : m_username)
-            .arg(m_socket->peerAddress().toString())
-            .arg(m_socket->peerPort());
-    }
-    return m_username.isEmpty() ? "Unregistered" : m_username;
+    return QString("%1 (%2:%3)")
+        .arg(m_username.isEmpty() ? "Unregistered" : m_username)
+        .arg(m_peerAddress)
+        .arg(m_peerPort);
 }
 
 void ClientConnection::sendJson(const QJsonObject &msg)
 {
+    const QByteArray frame = FrameCodec::encode(msg, encoding());
+    recordFrameOut(msg, frame.size());
+    writeFrame(frame);
+}
+
+void ClientConnection::sendChatMessage(const ChatMessage &message)
+{
+    sendFrame(prepareChatFrame(message));
+}
+
+void ClientConnection::sendMessages(const QJsonObject &fields, const QList<ChatMessage> &messages)
+{
+    const QByteArray frame = FrameCodec::encodeMessages(fields, messages, encoding());
+    recordFrameOut(fields, frame.size());
+    writeFrame(frame);
+}
+
+PreparedFrame ClientConnection::prepareChatFrame(const ChatMessage &message)
+{
+    return PreparedFrame(message);
+}
+
+void ClientConnection::sendFrame(const PreparedFrame &frame)
+{
+    const QByteArray bytes = frame.frame(encoding());
+    recordFrameOut(frame.object(), bytes.size());
+    writeFrame(bytes, frame.delivery());
+}
+
+void ClientConnection::recordFrameOut(const QJsonObject &obj, qsizetype frameSize)
+{
+    if (m_stats) {
+        m_stats->recordFrameOut(ServerStats::frameType(obj["type"].toString()), frameSize);
+    }
+}
+
+void ClientConnection::writeFrame(const QByteArray &frame, PreparedFrame::Delivery delivery)
+{
+    // Capturing the frame only bumps its reference count, so handing it to
+    // the connection's thread does not copy the payload.
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(
+            this,
+            [this, frame, delivery]() { writeFrame(frame, delivery); },
+            Qt::QueuedConnection);
+        return;
+    }
+
     if (!m_socket || m_socket->state() != QAbstractSocket::ConnectedState) {
         return;
     }
 
-    QJsonDocument doc(msg);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
+    if (delivery == PreparedFrame::Ephemeral && isCongested()
+        && m_flowControl.policy == DropEphemeral) {
+        if (m_stats) {
+            m_stats->droppedFrames.fetchAndAddRelaxed(1);
+        }
+        return;
+    }
 
-    // Length-prefixed protocol
-    QByteArray packet;
-    QDataStream stream(&packet, QIODevice::WriteOnly);
-    stream.setVersion(QDataStream::Qt_6_0);
-    stream << static_cast<quint32>(data.size());
-    packet.append(data);
+    m_pendingFrames.append(frame);
+    m_pendingBytes += frame.size();
+    updateQueueDepth();
+    if (m_socket->state() != QAbstractSocket::ConnectedState) {
+        return; // Disconnected as a slow consumer
+    }
 
-    m_socket->write(packet);
-    m_socket->flush();
+    // Don't let a single burst grow without bound before it is written
+    if (m_pendingBytes >= kMaxPendingBytes) {
+        flushPendingFrames();
+    } else if (!m_flushTimer->isActive()) {
+        m_flushTimer->start();
+    }
 }
 
-void ClientConnection::sendChatMessage(const ChatMessage &message)
+void ClientConnection::flushPendingFrames()
 {
-    QJsonObject obj = message.toJson();
-    obj["type"] = "chat";
-    sendJson(obj);
+    m_flushTimer->stop();
+    if (m_pendingFrames.isEmpty()) {
+        return;
+    }
+
+    const quint64 frameCount = m_pendingFrames.size();
+    const quint64 byteCount = m_pendingBytes;
+
+    if (m_socket && m_socket->state() == QAbstractSocket::ConnectedState) {
+        if (m_pendingFrames.size() == 1) {
+            m_socket->write(m_pendingFrames.constFirst());
+        } else {
+            QByteArray batch;
+            batch.reserve(m_pendingBytes);
+            for (const QByteArray &frame : std::as_const(m_pendingFrames)) {
+                batch.append(frame);
+            }
+            m_socket->write(batch);
+        }
+        m_socket->flush();
+        m_bytesSent.fetchAndAddRelaxed(byteCount);
+
+        if (m_stats) {
+            m_stats->recordBatch(frameCount, byteCount);
+        }
+    }
+
+    m_pendingFrames.clear();
+    m_pendingBytes = 0;
+    updateQueueDepth();
+}
+
+void ClientConnection::updateQueueDepth()
+{
+    const qint64 depth = m_pendingBytes
+                         + (m_socket && m_socket->state() == QAbstractSocket::ConnectedState
+                                ? m_socket->bytesToWrite()
+                                : 0);
+    const qint64 previous = m_queueDepth.fetchAndStoreRelaxed(depth);
+    if (m_stats && depth != previous) {
+        m_stats->queuedBytes.fetchAndAddRelaxed(depth - previous);
+    }
+
+    if (!m_socket || m_socket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+
+    const bool congested = isCongested();
+    if (depth > m_flowControl.hardLimit
+        || (!congested && depth >= m_flowControl.highWatermark
+            && m_flowControl.policy == DisconnectConsumer)) {
+        if (m_log) {
+            m_log->log(ServerLog::Warning,
+                       "slow_consumer_disconnected",
+                       m_username,
+                       "Disconnecting slow consumer %1 (%2 bytes queued)",
+                       connectionInfo(),
+                       depth);
+        }
+        if (m_stats) {
+            m_stats->slowConsumerDisconnects.fetchAndAddRelaxed(1);
+        }
+        // The queue is what we're getting rid of, so don't wait for it to drain
+        m_socket->abort();
+        return;
+    }
+
+    if (!congested && depth >= m_flowControl.highWatermark) {
+        m_congested.storeRelease(1);
+        if (m_log) {
+            m_log->log(ServerLog::Warning,
+                       "slow_consumer",
+                       m_username,
+                       "%1 is not keeping up (%2 bytes queued)",
+                       connectionInfo(),
+                       depth);
+        }
+        emit congestionChanged(true);
+    } else if (congested && depth <= m_flowControl.lowWatermark) {
+        m_congested.storeRelease(0);
+        emit congestionChanged(false);
+    }
 }
 
 void ClientConnection::disconnectClient(const QString &reason)
 {
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(
+            this, [this, reason]() { disconnectClient(reason); }, Qt::QueuedConnection);
+        return;
+    }
+
     Q_UNUSED(reason)
-    if (m_socket && m_socket->state() == QAbstractSocket::ConnectedState) {
+    if (!m_socket) {
+        m_closing = true; // Not started yet; start() closes it instead
+        return;
+    }
+    if (m_socket->state() == QAbstractSocket::ConnectedState) {
+        flushPendingFrames(); // e.g. the kick notice queued just before this
         m_socket->disconnectFromHost();
     }
 }
 
 void ClientConnection::onReadyRead()
 {
-    m_readBuffer.append(m_socket->readAll());
-
-    while (m_readBuffer.size() >= static_cast<int>(sizeof(quint32))) {
-        QDataStream stream(&m_readBuffer, QIODevice::ReadOnly);
-        stream.setVersion(QDataStream::Qt_6_0);
-
-        quint32 msgSize;
-        stream >> msgSize;
+    if (m_readPaused) {
+        return; // Left in the socket until the consumers we write to drain
+    }
 
-        if (m_readBuffer.size() < static_cast<int>(sizeof(quint32) + msgSize)) {
-            break;
+    const QByteArray data = m_socket->readAll();
+    m_bytesReceived.fetchAndAddRelaxed(data.size());
+    m_codec.append(data);
+    m_readAt = ServerStats::nsecsNow();
+
+    QByteArrayView payload;
+    while (m_codec.nextFrame(&payload)) {
+        const qsizetype frameSize = sizeof(quint32) + payload.size();
+        bool ok;
+        QJsonObject obj = FrameCodec::decodeObject(payload, &ok);
+        if (ok) {
+            processJson(obj, frameSize);
+        } else if (m_stats) {
+            m_stats->recordFrameIn(ServerStats::OtherFrame, frameSize);
         }
+    }
 
-        m_readBuffer.remove(0, sizeof(quint32));
-        QByteArray jsonData = m_readBuffer.left(msgSize);
-        m_readBuffer.remove(0, msgSize);
-
-        QJsonDocument doc = QJsonDocument::fromJson(jsonData);
-        if (doc.isObject()) {
-            processJson(doc.object());
+    if (m_codec.frameTooLarge()) {
+        if (m_log) {
+            m_log->log(ServerLog::Warning,
+                       "oversized_frame",
+                       m_username,
+                       "Oversized frame from %1, disconnecting",
+                       connectionInfo());
         }
+        m_codec.clear();
+        m_socket->abort(); // Emits disconnected(), which unroutes the client
     }
 }
 
 void ClientConnection::onDisconnected()
 {
-    emit logMessage(
-        QString("Client disconnected: %1").arg(m_username.isEmpty() ? "unknown" : m_username));
+    m_pendingFrames.clear();
+    m_pendingBytes = 0;
+    updateQueueDepth();
+    if (m_readPaused && m_stats) {
+        m_stats->pausedSenders.fetchAndSubRelaxed(1);
+    }
+    m_readPaused = false;
+    if (m_congested.fetchAndStoreRelease(0)) {
+        emit congestionChanged(false);
+    }
+
+    if (m_log) {
+        m_log->log(ServerLog::Debug,
+                   "connection_closed",
+                   m_username,
+                   "Connection from %1:%2 closed",
+                   m_peerAddress,
+                   m_peerPort);
+    }
+    // ChatServer owns the connection and deletes it once it has been unrouted
     emit disconnected(m_username);
-    deleteLater();
 }
 
 void ClientConnection::onSocketError(QAbstractSocket::SocketError socketError)
 {
     Q_UNUSED(socketError)
-    emit logMessage(QString("Socket error for %1: %2")
-                        .arg(m_username.isEmpty() ? "unknown" : m_username)
-                        .arg(m_socket->errorString()));
+    if (m_log) {
+        m_log->log(ServerLog::Debug,
+                   "socket_error",
+                   m_username,
+                   "Socket error for %1:%2: %3",
+                   m_peerAddress,
+                   m_peerPort,
+                   m_socket->errorString());
+    }
 }
 
-void ClientConnection::processJson(const QJsonObject &obj)
+void ClientConnection::processJson(const QJsonObject &obj, qsizetype frameSize)
 {
     QString type = obj["type"].toString();
+    if (m_stats) {
+        m_stats->recordFrameIn(ServerStats::frameType(type), frameSize);
+    }
 
     if (type == "register") {
         handleRegistration(obj);
@@ -170,13 +504,20 @@ void ClientConnection::processJson(const QJsonObject &obj)
         handleChatMessage(obj);
     } else if (type == "request_history") {
         handleChatHistoryRequest(obj);
+    } else if (type == "ack") {
+        handleAck(obj);
     }
 }
 
 void ClientConnection::handleRegistration(const QJsonObject &obj)
 {
     if (m_registered) {
-        emit logMessage("Client already registered");
+        if (m_log) {
+            m_log->log(ServerLog::Warning,
+                       "duplicate_registration",
+                       m_username,
+                       "Client already registered");
+        }
         return;
     }
 
@@ -190,6 +531,22 @@ void ClientConnection::handleRegistration(const QJsonObject &obj)
         return;
     }
 
+    // Clients that list "cbor" get binary frames from here on; old clients
+    // send no list and keep talking JSON.
+    const QJsonArray encodings = obj["encodings"].toArray();
+    if (encodings.contains(FrameCodec::encodingName(FrameCodec::Cbor))) {
+        QJsonObject reply;
+        reply["type"] = "protocol";
+        reply["encoding"] = FrameCodec::encodingName(FrameCodec::Cbor);
+        sendJson(reply); // Still JSON, the client switches when it sees this
+        m_encoding.storeRelease(FrameCodec::Cbor);
+    }
+
+    const QJsonArray features = obj["features"].toArray();
+    m_presenceDeltas.storeRelease(features.contains(QString("presence_delta")) ? 1 : 0);
+    m_historyStreaming.storeRelease(features.contains(QString("history_stream")) ? 1 : 0);
+    m_sendAcks.storeRelease(features.contains(QString("send_ack")) ? 1 : 0);
+
     m_username = username;
     m_registered = true;
     emit registered(m_username, this);
@@ -198,7 +555,13 @@ void ClientConnection::handleRegistration(const QJsonObject &obj)
 void ClientConnection::handleChatMessage(const QJsonObject &obj)
 {
     if (!m_registered) {
-        emit logMessage("Received message from unregistered client");
+        if (m_log) {
+            m_log->log(ServerLog::Warning,
+                       "unregistered_message",
+                       QString(),
+                       "Received message from unregistered client %1",
+                       connectionInfo());
+        }
         return;
     }
 
@@ -207,12 +570,18 @@ void ClientConnection::handleChatMessage(const QJsonObject &obj)
     QString text = obj["text"].toString();
 
     if (from != m_username) {
-        emit logMessage(
-            QString("Username mismatch: claimed %1, registered as %2").arg(from).arg(m_username));
+        if (m_log) {
+            m_log->log(ServerLog::Warning,
+                       "username_mismatch",
+                       m_username,
+                       "Username mismatch: claimed %1, registered as %2",
+                       from,
+                       m_username);
+        }
         return;
     }
 
-    emit messageReceived(from, to, text);
+    emit messageReceived(from, to, text, obj["cid"].toInteger(0), m_readAt);
 }
 
 void ClientConnection::handleChatHistoryRequest(const QJsonObject &obj)
@@ -222,5 +591,21 @@ void ClientConnection::handleChatHistoryRequest(const QJsonObject &obj)
     }
 
     QString withUser = obj["with"].toString();
-    emit chatHistoryRequested(m_username, withUser);
+    const qint64 before = obj["before"].toInteger(-1);
+    const qint64 after = obj["after"].toInteger(-1);
+    const int limit = obj["limit"].toInt(0);
+    emit chatHistoryRequested(m_username, withUser, before, after, limit);
+}
+
+void ClientConnection::handleAck(const QJsonObject &obj)
+{
+    if (!m_registered) {
+        return;
+    }
+
+    const qint64 delivered = qMax<qint64>(0, obj["delivered"].toInteger(0));
+    const qint64 read = qMax<qint64>(0, obj["read"].toInteger(0));
+    if (delivered > 0 || read > 0) {
+        emit acknowledged(m_username, quint64(delivered), quint64(read));
+    }
 }
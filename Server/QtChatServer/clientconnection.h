@@ -1,42 +1,109 @@
 #ifndef CLIENTCONNECTION_H
 #define CLIENTCONNECTION_H
 
+#include <QAtomicInt>
 #include <QByteArray>
 #include <QJsonObject>
 #include <QObject>
 #include <QPointer>
 #include <QTcpSocket>
 #include "chatmessage.h"
+#include "framecodec.h"
+#include "preparedframe.h"
+
+class QTimer;
+class ServerLog;
+struct ServerStats;
 
 class ClientConnection : public QObject
 {
     Q_OBJECT
 public:
+    // What to do once a client stops reading and its output queue passes
+    // the high watermark
+    enum SlowConsumerPolicy {
+        DropEphemeral,     // Drop frames that a later one supersedes (user lists)
+        PauseSenders,      // Stop reading from clients sending to it until it drains
+        DisconnectConsumer // Drop the slow client
+    };
+
+    struct FlowControl
+    {
+        qint64 highWatermark = 1024 * 1024;
+        qint64 lowWatermark = 256 * 1024;
+        qint64 hardLimit = 8 * 1024 * 1024; // Always disconnect beyond this
+        SlowConsumerPolicy policy = DropEphemeral;
+    };
+
     explicit ClientConnection(qintptr socketDescriptor, QObject *parent = nullptr);
     ~ClientConnection() override;
 
+    // Output batching: frames queued within one event-loop pass (or within
+    // latencyMs, if set) go out in a single socket write. Set before start().
+    void setFlushLatency(int latencyMs);
+    void setStats(ServerStats *stats);
+    void setLog(ServerLog *log);
+    void setFlowControl(const FlowControl &flowControl);
+
+    // Output queue state; safe to read from any thread
+    qint64 queueDepth() const; // Bytes queued here plus bytes in the socket
+    bool isCongested() const;  // Above the high watermark and not yet drained
+
+    // Stops draining the socket so TCP pushes back on the peer; any thread
+    void setReadPaused(bool paused);
+
     QString username() const;
     qintptr socketDescriptor() const;
     bool isRegistered() const;
+    FrameCodec::Encoding encoding() const; // Negotiated at registration
+    bool supportsPresenceDeltas() const;   // Understands presence_join/presence_leave
+    bool supportsHistoryStreaming() const; // Understands history_chunk/history_end
+    bool supportsSendAcks() const;         // Takes a "sent" ack instead of its own message
 
-    // Peer information
+    // Peer information is cached by start(), so these are safe to call from
+    // any thread once the connection has been started.
     QString peerAddress() const;
     quint16 peerPort() const;
     QString connectionInfo() const; // Returns "username (IP:Port)"
 
-    // Send operations
+    // Traffic counters; safe to read from any thread
+    qint64 connectedAt() const; // ms since the epoch, when the connection was accepted
+    quint64 bytesReceived() const;
+    quint64 bytesSent() const; // Handed to the socket
+
+    // Send operations; may be called from any thread
     void sendJson(const QJsonObject &msg);
     void sendChatMessage(const ChatMessage &message);
+    // fields with messages under "messages", e.g. a history page
+    void sendMessages(const QJsonObject &fields, const QList<ChatMessage> &messages);
+
+    // Sends a message encoded once for all recipients; resolve the frame on
+    // the thread that prepared it, then this writes the shared bytes.
+    static PreparedFrame prepareChatFrame(const ChatMessage &message);
+    void sendFrame(const PreparedFrame &frame);
 
 public slots:
+    // Takes over the socket descriptor; must run in the connection's own thread
+    void start();
     void disconnectClient(const QString &reason = QString());
 
 signals:
-    void messageReceived(const QString &from, const QString &to, const QString &text);
+    // receivedAt is ServerStats::nsecsNow() when the frame was read;
+    // correlationId is the client's tag for its "sent" ack, 0 if none
+    void messageReceived(const QString &from,
+                         const QString &to,
+                         const QString &text,
+                         qint64 correlationId,
+                         qint64 receivedAt);
     void disconnected(const QString &username);
     void registered(const QString &username, ClientConnection *connection);
-    void chatHistoryRequested(const QString &requester, const QString &withUser);
-    void logMessage(const QString &msg);
+    // before/after are history cursors, -1 when absent; limit <= 0 means default
+    void chatHistoryRequested(
+        const QString &requester, const QString &withUser, qint64 before, qint64 after, int limit);
+    void congestionChanged(bool congested);
+    // The client has everything up to delivered and has shown everything up
+    // to read; both are message ids, 0 when not reported
+    void acknowledged(const QString &username, quint64 delivered, quint64 read);
 
 private slots:
     void onReadyRead();
@@ -46,16 +113,46 @@ private slots:
 private:
     Q_DISABLE_COPY(ClientConnection)
 
-    void processJson(const QJsonObject &obj);
+    void processJson(const QJsonObject &obj, qsizetype frameSize);
     void handleRegistration(const QJsonObject &obj);
     void handleChatMessage(const QJsonObject &obj);
     void handleChatHistoryRequest(const QJsonObject &obj);
+    void handleAck(const QJsonObject &obj);
+    void writeFrame(const QByteArray &frame,
+                    PreparedFrame::Delivery delivery = PreparedFrame::Reliable);
+    void flushPendingFrames();
+    void updateQueueDepth();
+    void recordFrameOut(const QJsonObject &obj, qsizetype frameSize);
 
     QPointer<QTcpSocket> m_socket;
     QString m_username;
     qintptr m_socketDescriptor;
-    QByteArray m_readBuffer;
+    QString m_peerAddress;
+    quint16 m_peerPort;
+    FrameCodec m_codec;
+    QAtomicInt m_encoding; // FrameCodec::Encoding, read by the routing thread
+    QAtomicInt m_presenceDeltas;
+    QAtomicInt m_historyStreaming;
+    QAtomicInt m_sendAcks;
+
+    QList<QByteArray> m_pendingFrames;
+    qsizetype m_pendingBytes;
+    QTimer *m_flushTimer;
+    int m_flushLatency;
+    ServerStats *m_stats;
+    ServerLog *m_log;
+    qint64 m_readAt; // When the frames being processed were read
+    const qint64 m_connectedAt;
+    QAtomicInteger<quint64> m_bytesReceived;
+    QAtomicInteger<quint64> m_bytesSent;
+
+    FlowControl m_flowControl;
+    QAtomicInteger<qint64> m_queueDepth;
+    QAtomicInt m_congested;
+    bool m_readPaused;
+
     bool m_registered;
+    bool m_closing; // Disconnected before start() ran; it closes right away
 };
 
 #endif // CLIENTCONNECTION_H
@@ -0,0 +1,147 @@
+#include "clientlistmodel.h"
+#include <QDateTime>
+#include <QLocale>
+#include "chatserver.h"
+#include "clientconnection.h"
+
+ClientListModel::ClientListModel(ChatServer *server, QObject *parent)
+    : QAbstractTableModel(parent)
+    , m_server(server)
+{}
+
+int ClientListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_rows.size());
+}
+
+int ClientListModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+QVariant ClientListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_rows.size()) {
+        return QVariant();
+    }
+
+    const Row &row = m_rows.at(index.row());
+    if (role == UserNameRole) {
+        return row.username;
+    } else if (role == SearchRole) {
+        return QString("%1 %2").arg(row.username, row.address);
+    } else if (role != Qt::DisplayRole && role != SortRole) {
+        if (role == Qt::TextAlignmentRole && index.column() >= ReceivedColumn) {
+            return int(Qt::AlignRight | Qt::AlignVCenter);
+        }
+        return QVariant();
+    }
+
+    const bool display = role == Qt::DisplayRole;
+    switch (index.column()) {
+    case UserColumn:
+        return row.username;
+    case AddressColumn:
+        return row.address;
+    case ConnectedColumn:
+        if (display) {
+            return QDateTime::fromMSecsSinceEpoch(row.connectedAt).toString("yyyy-MM-dd hh:mm:ss");
+        }
+        return row.connectedAt;
+    case ReceivedColumn:
+    case SentColumn: {
+        const quint64 bytes = index.column() == ReceivedColumn ? row.connection->bytesReceived()
+                                                               : row.connection->bytesSent();
+        if (display) {
+            return QLocale().formattedDataSize(qint64(bytes));
+        }
+        return bytes;
+    }
+    default:
+        break;
+    }
+    return QVariant();
+}
+
+QVariant ClientListModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (orientation != Qt::Horizontal || role != Qt::DisplayRole) {
+        return QVariant();
+    }
+
+    switch (section) {
+    case UserColumn:
+        return "User";
+    case AddressColumn:
+        return "Address";
+    case ConnectedColumn:
+        return "Connected Since";
+    case ReceivedColumn:
+        return "Received";
+    case SentColumn:
+        return "Sent";
+    default:
+        break;
+    }
+    return QVariant();
+}
+
+void ClientListModel::addClient(const QString &username)
+{
+    ClientConnection *conn = m_server->getClientConnection(username);
+    if (!conn || m_rowByUser.contains(username)) {
+        return;
+    }
+
+    Row row;
+    row.username = username;
+    row.address = QString("%1:%2").arg(conn->peerAddress()).arg(conn->peerPort());
+    row.connectedAt = conn->connectedAt();
+    row.connection = conn;
+
+    const int position = int(m_rows.size());
+    beginInsertRows(QModelIndex(), position, position);
+    m_rows.append(row);
+    m_rowByUser.insert(username, position);
+    endInsertRows();
+}
+
+void ClientListModel::removeClient(const QString &username)
+{
+    const auto it = m_rowByUser.constFind(username);
+    if (it == m_rowByUser.constEnd()) {
+        return;
+    }
+
+    // Fill the gap with the last row so removal doesn't shift the rest
+    const int position = it.value();
+    const int last = int(m_rows.size()) - 1;
+    m_rowByUser.erase(it);
+    if (position != last) {
+        m_rows[position] = m_rows.at(last);
+        m_rowByUser[m_rows.at(position).username] = position;
+        emit dataChanged(index(position, 0), index(position, ColumnCount - 1));
+    }
+
+    beginRemoveRows(QModelIndex(), last, last);
+    m_rows.removeLast();
+    endRemoveRows();
+}
+
+void ClientListModel::clear()
+{
+    beginResetModel();
+    m_rows.clear();
+    m_rowByUser.clear();
+    endResetModel();
+}
+
+void ClientListModel::refreshTraffic()
+{
+    if (m_rows.isEmpty()) {
+        return;
+    }
+    emit dataChanged(index(0, ReceivedColumn),
+                     index(int(m_rows.size()) - 1, SentColumn),
+                     {Qt::DisplayRole, SortRole});
+}
@@ -0,0 +1,66 @@
+#ifndef CLIENTLISTMODEL_H
+#define CLIENTLISTMODEL_H
+
+#include <QAbstractTableModel>
+#include <QHash>
+#include <QList>
+
+class ChatServer;
+class ClientConnection;
+
+// Registered clients, kept in step with ChatServer's connection table one
+// row per connect or disconnect rather than rebuilt. Row order is arbitrary
+// (a removed row is replaced by the last one); views sort through a proxy
+// using SortRole.
+class ClientListModel : public QAbstractTableModel
+{
+    Q_OBJECT
+public:
+    enum Column {
+        UserColumn,
+        AddressColumn,
+        ConnectedColumn,
+        ReceivedColumn,
+        SentColumn,
+        ColumnCount
+    };
+    enum Roles {
+        SortRole = Qt::UserRole, // Raw value of the column
+        UserNameRole,            // The row's username, whatever the column
+        SearchRole               // "username address", for filtering
+    };
+
+    explicit ClientListModel(ChatServer *server, QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section,
+                        Qt::Orientation orientation,
+                        int role = Qt::DisplayRole) const override;
+
+    // Call from ChatServer's clientConnected/clientDisconnected, on its thread
+    void addClient(const QString &username);
+    void removeClient(const QString &username);
+    void clear(); // When the server stops; connections go without a disconnect signal
+
+    // The traffic columns are read live; this tells views to repaint them
+    void refreshTraffic();
+
+private:
+    Q_DISABLE_COPY(ClientListModel)
+
+    struct Row
+    {
+        QString username;
+        QString address; // "IP:Port", formatted once
+        qint64 connectedAt = 0;
+        ClientConnection *connection = nullptr; // Removed before it is deleted
+    };
+
+    ChatServer *m_server;
+    QList<Row> m_rows;
+    QHash<QString, int> m_rowByUser;
+};
+
+#endif // CLIENTLISTMODEL_H
@@ -0,0 +1,89 @@
+#include "connectionworkerpool.h"
+#include <QThread>
+
+ConnectionWorkerPool::ConnectionWorkerPool(QObject *parent)
+    : QObject(parent)
+{}
+
+ConnectionWorkerPool::~ConnectionWorkerPool()
+{
+    stop();
+}
+
+void ConnectionWorkerPool::start(int threadCount)
+{
+    if (isRunning()) {
+        return;
+    }
+
+    if (threadCount <= 0) {
+        threadCount = qMax(1, QThread::idealThreadCount());
+    }
+
+    for (int i = 0; i < threadCount; ++i) {
+        Worker *worker = new Worker;
+        worker->thread = new QThread();
+        worker->thread->setObjectName(QString("ChatIO-%1").arg(i));
+        worker->thread->start();
+        m_workers.append(worker);
+    }
+}
+
+void ConnectionWorkerPool::stop()
+{
+    for (Worker *worker : m_workers) {
+        worker->thread->quit();
+    }
+    for (Worker *worker : m_workers) {
+        worker->thread->wait();
+        delete worker->thread;
+        delete worker;
+    }
+    m_workers.clear();
+}
+
+bool ConnectionWorkerPool::isRunning() const
+{
+    return !m_workers.isEmpty();
+}
+
+int ConnectionWorkerPool::threadCount() const
+{
+    return m_workers.size();
+}
+
+QThread *ConnectionWorkerPool::acquireThread()
+{
+    Worker *best = nullptr;
+    for (Worker *worker : m_workers) {
+        if (!best || worker->load.loadRelaxed() < best->load.loadRelaxed()) {
+            best = worker;
+        }
+    }
+
+    if (!best) {
+        return nullptr;
+    }
+
+    best->load.ref();
+    return best->thread;
+}
+
+void ConnectionWorkerPool::releaseThread(QThread *thread)
+{
+    for (Worker *worker : m_workers) {
+        if (worker->thread == thread) {
+            worker->load.deref();
+            return;
+        }
+    }
+}
+
+QList<int> ConnectionWorkerPool::loads() const
+{
+    QList<int> result;
+    for (const Worker *worker : m_workers) {
+        result.append(worker->load.loadRelaxed());
+    }
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef CONNECTIONWORKERPOOL_H
+#define CONNECTIONWORKERPOOL_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QObject>
+
+class QThread;
+
+// A fixed set of QThread event loops that own client sockets. Each new
+// connection goes to the worker currently serving the fewest connections.
+class ConnectionWorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ConnectionWorkerPool(QObject *parent = nullptr);
+    ~ConnectionWorkerPool() override;
+
+    // threadCount <= 0 starts one worker per core
+    void start(int threadCount);
+    void stop();
+    bool isRunning() const;
+    int threadCount() const;
+
+    // Picks the least-loaded worker and counts a connection against it.
+    // Returns nullptr when the pool is not running.
+    QThread *acquireThread();
+    void releaseThread(QThread *thread);
+
+    QList<int> loads() const; // Connections per worker, for diagnostics
+
+private:
+    Q_DISABLE_COPY(ConnectionWorkerPool)
+
+    struct Worker
+    {
+        QThread *thread;
+        QAtomicInt load;
+    };
+
+    QList<Worker *> m_workers;
+};
+
+#endif // CONNECTIONWORKERPOOL_H
@@ -0,0 +1,20 @@
+#include <QCoreApplication>
+#include "serverdaemon.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    // Set application metadata
+    QCoreApplication::setApplicationName("QtChatServer");
+    QCoreApplication::setApplicationVersion("1.0");
+    QCoreApplication::setOrganizationName("QtChatApp");
+    QCoreApplication::setOrganizationDomain("qtchatapp.local");
+
+    ServerDaemon daemon;
+    if (!daemon.parseArguments(app.arguments()) || !daemon.start()) {
+        return 1;
+    }
+
+    return app.exec();
+}
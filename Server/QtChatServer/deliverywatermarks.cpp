@@ -0,0 +1,87 @@
+#include "deliverywatermarks.h"
+#include <QDebug>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+DeliveryWatermarks::DeliveryWatermarks()
+    : m_dirty(false)
+{}
+
+DeliveryWatermarks::Marks DeliveryWatermarks::marks(const QString &username) const
+{
+    return m_marks.value(username);
+}
+
+bool DeliveryWatermarks::advance(const QString &username, quint64 delivered, quint64 read)
+{
+    Marks &marks = m_marks[username];
+    const Marks before = marks;
+    marks.delivered = qMax(marks.delivered, delivered);
+    marks.read = qMax(marks.read, read);
+
+    const bool moved = marks.delivered != before.delivered || marks.read != before.read;
+    m_dirty = m_dirty || moved;
+    return moved;
+}
+
+void DeliveryWatermarks::clear()
+{
+    m_marks.clear();
+    m_dirty = false;
+}
+
+bool DeliveryWatermarks::load(const QString &filePath)
+{
+    clear();
+
+    QFile file(filePath);
+    if (!file.exists()) {
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open delivery watermarks:" << filePath;
+        return false;
+    }
+
+    const QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+    if (!doc.isObject()) {
+        qWarning() << "Invalid delivery watermarks:" << filePath;
+        return false;
+    }
+
+    const QJsonObject users = doc.object();
+    for (auto it = users.begin(); it != users.end(); ++it) {
+        const QJsonObject obj = it.value().toObject();
+        Marks marks;
+        marks.delivered = static_cast<quint64>(obj["delivered"].toInteger(0));
+        marks.read = static_cast<quint64>(obj["read"].toInteger(0));
+        m_marks.insert(it.key(), marks);
+    }
+    return true;
+}
+
+bool DeliveryWatermarks::save(const QString &filePath)
+{
+    if (!m_dirty) {
+        return true;
+    }
+
+    QJsonObject users;
+    for (auto it = m_marks.cbegin(); it != m_marks.cend(); ++it) {
+        QJsonObject obj;
+        obj["delivered"] = static_cast<qint64>(it.value().delivered);
+        obj["read"] = static_cast<qint64>(it.value().read);
+        users[it.key()] = obj;
+    }
+
+    QSaveFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(users).toJson()) < 0
+        || !file.commit()) {
+        qWarning() << "Failed to save delivery watermarks:" << filePath;
+        return false;
+    }
+    m_dirty = false;
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef DELIVERYWATERMARKS_H
+#define DELIVERYWATERMARKS_H
+
+#include <QHash>
+#include <QString>
+
+// How far each user's clients have acknowledged the message id sequence:
+// every message up to delivered has reached a client of theirs, and every
+// one up to read has been shown to them. Watermarks only ever move forward.
+class DeliveryWatermarks
+{
+public:
+    struct Marks
+    {
+        quint64 delivered = 0;
+        quint64 read = 0;
+    };
+
+    DeliveryWatermarks();
+
+    Marks marks(const QString &username) const;
+    // Moves the user's watermarks forward; returns whether either moved
+    bool advance(const QString &username, quint64 delivered, quint64 read);
+    void clear();
+
+    // Kept as JSON ({"user": {"delivered": n, "read": n}}) in the data
+    // directory between runs
+    bool load(const QString &filePath);
+    bool save(const QString &filePath);
+
+private:
+    Q_DISABLE_COPY(DeliveryWatermarks)
+
+    QHash<QString, Marks> m_marks;
+    bool m_dirty; // Changed since the last load() or save()
+};
+
+#endif // DELIVERYWATERMARKS_H
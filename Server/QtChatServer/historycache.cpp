@@ -0,0 +1,177 @@
+#include "historycache.h"
+
+HistoryCache::HistoryCache(qint64 memoryBudget, int tailLength)
+    : m_memoryBudget(qMax<qint64>(0, memoryBudget))
+    , m_tailLength(qMax(1, tailLength))
+{}
+
+void HistoryCache::setMemoryBudget(qint64 bytes)
+{
+    m_memoryBudget = qMax<qint64>(0, bytes);
+    evictToBudget();
+}
+
+qint64 HistoryCache::memoryBudget() const
+{
+    return m_memoryBudget;
+}
+
+void HistoryCache::setTailLength(int length)
+{
+    m_tailLength = qMax(1, length);
+    for (Entry &entry : m_entries) {
+        m_stats.bytes -= trim(entry);
+    }
+}
+
+int HistoryCache::tailLength() const
+{
+    return m_tailLength;
+}
+
+qint64 HistoryCache::count(const QString &conversationId) const
+{
+    auto it = m_entries.constFind(conversationId);
+    return it != m_entries.constEnd() ? it->end : -1;
+}
+
+bool HistoryCache::read(const QString &conversationId,
+                        qint64 first,
+                        qint64 last,
+                        QList<ChatMessage> *page)
+{
+    auto it = m_entries.find(conversationId);
+    if (it == m_entries.end()) {
+        ++m_stats.misses;
+        return false;
+    }
+
+    Entry &entry = *it;
+    const qint64 start = entry.end - entry.messages.size();
+    if (first < start || last > entry.end || first > last) {
+        ++m_stats.misses;
+        return false;
+    }
+
+    *page = entry.messages.mid(first - start, last - first);
+    touch(entry);
+    ++m_stats.hits;
+    return true;
+}
+
+void HistoryCache::insert(const QString &conversationId,
+                          const QList<ChatMessage> &messages,
+                          qint64 end)
+{
+    if (m_memoryBudget == 0) {
+        return;
+    }
+
+    auto it = m_entries.find(conversationId);
+    if (it != m_entries.end()) {
+        // Keep what is cached if it already covers at least as much of the tail
+        if (it->end == end && it->messages.size() >= messages.size()) {
+            touch(*it);
+            return;
+        }
+        remove(conversationId);
+    }
+
+    Entry entry;
+    entry.messages = messages;
+    entry.end = end;
+    for (const auto &msg : messages) {
+        entry.bytes += estimateSize(msg);
+    }
+
+    m_lru.push_front(conversationId);
+    entry.lruPos = m_lru.begin();
+    trim(entry);
+
+    m_stats.bytes += entry.bytes;
+    m_entries.insert(conversationId, entry);
+    evictToBudget();
+}
+
+void HistoryCache::append(const QString &conversationId, const ChatMessage &message)
+{
+    auto it = m_entries.find(conversationId);
+    if (it == m_entries.end()) {
+        return;
+    }
+
+    Entry &entry = *it;
+    const qint64 size = estimateSize(message);
+    entry.messages.append(message);
+    entry.end += 1;
+    entry.bytes += size;
+    m_stats.bytes += size;
+
+    m_stats.bytes -= trim(entry);
+    touch(entry);
+    evictToBudget();
+}
+
+void HistoryCache::remove(const QString &conversationId)
+{
+    auto it = m_entries.find(conversationId);
+    if (it == m_entries.end()) {
+        return;
+    }
+
+    m_stats.bytes -= it->bytes;
+    m_lru.erase(it->lruPos);
+    m_entries.erase(it);
+}
+
+void HistoryCache::clear()
+{
+    m_entries.clear();
+    m_lru.clear();
+    m_stats.bytes = 0;
+}
+
+HistoryCache::Stats HistoryCache::stats() const
+{
+    Stats s = m_stats;
+    s.entries = m_entries.size();
+    return s;
+}
+
+qint64 HistoryCache::estimateSize(const ChatMessage &message)
+{
+    // Object plus UTF-16 string payloads; allocator overhead is not counted
+    return qint64(sizeof(ChatMessage))
+           + (message.from().size() + message.to().size() + message.text().size())
+                 * qint64(sizeof(QChar));
+}
+
+void HistoryCache::touch(Entry &entry)
+{
+    m_lru.splice(m_lru.begin(), m_lru, entry.lruPos);
+}
+
+qint64 HistoryCache::trim(Entry &entry)
+{
+    const qsizetype excess = entry.messages.size() - m_tailLength;
+    if (excess <= 0) {
+        return 0;
+    }
+
+    qint64 freed = 0;
+    for (qsizetype i = 0; i < excess; ++i) {
+        freed += estimateSize(entry.messages.at(i));
+    }
+    entry.messages.remove(0, excess);
+    entry.bytes -= freed;
+    return freed;
+}
+
+void HistoryCache::evictToBudget()
+{
+    while (m_stats.bytes > m_memoryBudget && !m_lru.empty()) {
+        const QString victim = m_lru.back();
+        remove(victim);
+        ++m_stats.evictions;
+    }
+}
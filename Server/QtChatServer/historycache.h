@@ -0,0 +1,80 @@
+#ifndef HISTORYCACHE_H
+#define HISTORYCACHE_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <list>
+#include "chatmessage.h"
+
+// Bounded LRU cache of the most recent messages of each conversation, keyed
+// by ChatMessage::conversationId(). Positions are the record positions used
+// by MessageLog, so a cached tail of a conversation with end messages holds
+// positions [end - size, end). Entries are evicted least recently used first
+// once their estimated size exceeds the memory budget.
+//
+// Not thread-safe; ChatServer uses it from its own thread only.
+class HistoryCache
+{
+public:
+    static constexpr qint64 DefaultMemoryBudget = 16 * 1024 * 1024;
+    static constexpr int DefaultTailLength = 200;
+
+    struct Stats
+    {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        quint64 evictions = 0;
+        qsizetype entries = 0;
+        qint64 bytes = 0; // Estimated memory held by cached messages
+    };
+
+    explicit HistoryCache(qint64 memoryBudget = DefaultMemoryBudget,
+                          int tailLength = DefaultTailLength);
+
+    void setMemoryBudget(qint64 bytes); // 0 disables the cache
+    qint64 memoryBudget() const;
+    void setTailLength(int length);
+    int tailLength() const;
+
+    // Number of messages in the conversation, or -1 if it isn't cached
+    qint64 count(const QString &conversationId) const;
+
+    // Copies positions [first, last) into page if the cached tail covers
+    // them. Counts a hit or a miss.
+    bool read(const QString &conversationId, qint64 first, qint64 last, QList<ChatMessage> *page);
+
+    // Caches messages as the tail of a conversation that has end messages
+    void insert(const QString &conversationId, const QList<ChatMessage> &messages, qint64 end);
+
+    // Write-through for a message just appended to the conversation's log.
+    // Conversations that aren't cached are left alone.
+    void append(const QString &conversationId, const ChatMessage &message);
+
+    void remove(const QString &conversationId);
+    void clear();
+
+    Stats stats() const;
+
+private:
+    struct Entry
+    {
+        QList<ChatMessage> messages;
+        qint64 end = 0;
+        qint64 bytes = 0;
+        std::list<QString>::iterator lruPos;
+    };
+
+    static qint64 estimateSize(const ChatMessage &message);
+    void touch(Entry &entry);
+    qint64 trim(Entry &entry); // Drops messages beyond the tail length, returns bytes freed
+    void evictToBudget();
+
+    QHash<QString, Entry> m_entries;
+    std::list<QString> m_lru; // Most recently used first
+    qint64 m_memoryBudget;
+    int m_tailLength;
+    Stats m_stats;
+};
+
+#endif // HISTORYCACHE_H
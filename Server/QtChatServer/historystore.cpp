@@ -0,0 +1,37 @@
+#include "historystore.h"
+#include "loghistorystore.h"
+#ifdef QTCHAT_HAVE_SQLITE
+#include "sqlitehistorystore.h"
+#endif
+
+HistoryStore::~HistoryStore() {}
+
+HistoryStore *HistoryStore::create(Backend backend, const QString &dataDirectory)
+{
+    switch (backend) {
+    case LogFiles:
+        return new LogHistoryStore(dataDirectory + "/server_history");
+    case Sqlite:
+#ifdef QTCHAT_HAVE_SQLITE
+        return new SqliteHistoryStore(dataDirectory + "/history.sqlite");
+#else
+        return nullptr;
+#endif
+    }
+    return nullptr;
+}
+
+bool HistoryStore::isAvailable(Backend backend)
+{
+#ifdef QTCHAT_HAVE_SQLITE
+    Q_UNUSED(backend)
+    return true;
+#else
+    return backend == LogFiles;
+#endif
+}
+
+QString HistoryStore::backendName(Backend backend)
+{
+    return backend == Sqlite ? "sqlite" : "log";
+}
@@ -0,0 +1,45 @@
+#ifndef HISTORYSTORE_H
+#define HISTORYSTORE_H
+
+#include <QList>
+#include <QString>
+#include "chatmessage.h"
+
+// Persistent chat history, addressed by ChatMessage::conversationId().
+//
+// Messages of a conversation are numbered 0, 1, 2, ... in the order they
+// were appended; range() and count() use those positions, which are also
+// the cursors of the history protocol.
+//
+// A store is opened, used and closed on one thread (HistoryWriter's), so
+// implementations need no locking of their own.
+class HistoryStore
+{
+public:
+    enum Backend {
+        LogFiles, // One append-only MessageLog per conversation
+        Sqlite    // A single SQLite database in WAL mode
+    };
+
+    virtual ~HistoryStore();
+
+    virtual bool open() = 0;
+    virtual void close() = 0;
+
+    // With sync set the messages are on stable storage when this returns
+    virtual bool append(const QString &conversationId,
+                        const QList<ChatMessage> &messages,
+                        bool sync) = 0;
+
+    // Messages at positions [first, first + count)
+    virtual QList<ChatMessage> range(const QString &conversationId, qint64 first, qint64 count) = 0;
+    virtual qint64 count(const QString &conversationId) = 0;
+
+    // Creates a store for backend under dataDirectory, or nullptr if the
+    // backend was not compiled in
+    static HistoryStore *create(Backend backend, const QString &dataDirectory);
+    static bool isAvailable(Backend backend);
+    static QString backendName(Backend backend);
+};
+
+#endif // HISTORYSTORE_H
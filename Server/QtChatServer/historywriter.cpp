@@ -0,0 +1,268 @@
+#include "historywriter.h"
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QThread>
+#include "serverstats.h"
+
+namespace {
+
+// A batch this large is committed without waiting out the interval
+const qsizetype kMaxBatchSize = 4096;
+
+} // namespace
+
+HistoryWriter::HistoryWriter(QObject *parent)
+    : QObject(parent)
+    , m_stopping(false)
+    , m_thread(nullptr)
+    , m_durability(SyncBatch)
+    , m_commitInterval(DefaultCommitInterval)
+    , m_storeOpen(false)
+    , m_stats(nullptr)
+{}
+
+HistoryWriter::~HistoryWriter()
+{
+    stop();
+}
+
+void HistoryWriter::setStore(HistoryStore *store)
+{
+    Q_ASSERT(!m_thread);
+    m_store.reset(store);
+}
+
+HistoryStore *HistoryWriter::store() const
+{
+    return m_store.data();
+}
+
+void HistoryWriter::setStats(ServerStats *stats)
+{
+    Q_ASSERT(!m_thread);
+    m_stats = stats;
+}
+
+void HistoryWriter::start()
+{
+    if (m_thread) {
+        return;
+    }
+
+    m_thread = QThread::create([this] { run(); });
+    m_thread->setObjectName("ChatHistoryWriter");
+    m_thread->start();
+}
+
+void HistoryWriter::stop()
+{
+    if (!m_thread) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_notEmpty.wakeAll();
+        m_notFull.wakeAll();
+    }
+
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+
+    // The thread is gone, so its state can be reset from here
+    m_stopping = false;
+}
+
+bool HistoryWriter::isRunning() const
+{
+    return m_thread != nullptr;
+}
+
+void HistoryWriter::setDurability(Durability durability)
+{
+    m_durability.storeRelaxed(durability);
+}
+
+HistoryWriter::Durability HistoryWriter::durability() const
+{
+    return static_cast<Durability>(m_durability.loadRelaxed());
+}
+
+void HistoryWriter::setCommitInterval(int intervalMs)
+{
+    m_commitInterval.storeRelaxed(qMax(0, intervalMs));
+}
+
+int HistoryWriter::commitInterval() const
+{
+    return m_commitInterval.loadRelaxed();
+}
+
+qsizetype HistoryWriter::queueDepth() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_queue.size();
+}
+
+void HistoryWriter::append(const QString &conversationId, const ChatMessage &message)
+{
+    Job job;
+    job.conversationId = conversationId;
+    job.message = message;
+    enqueue(job);
+}
+
+void HistoryWriter::readPage(
+    quint64 requestId, const QString &conversationId, qint64 before, qint64 after, int limit)
+{
+    Job job;
+    job.conversationId = conversationId;
+    job.requestId = requestId;
+    job.before = before;
+    job.after = after;
+    job.limit = limit;
+    enqueue(job);
+}
+
+void HistoryWriter::pageBounds(
+    qint64 total, qint64 before, qint64 after, int limit, qint64 *first, qint64 *last)
+{
+    if (after >= 0) {
+        *first = qMin(after, total);
+        *last = qMin(*first + limit, total);
+    } else {
+        *last = before >= 0 ? qMin(before, total) : total;
+        *first = qMax<qint64>(0, *last - limit);
+    }
+}
+
+void HistoryWriter::enqueue(const Job &job)
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_queue.size() >= DefaultQueueCapacity && m_thread && !m_stopping) {
+        m_notFull.wait(&m_mutex);
+    }
+    m_queue.append(job);
+    m_notEmpty.wakeOne();
+}
+
+void HistoryWriter::run()
+{
+    m_storeOpen = m_store && m_store->open();
+    if (!m_storeOpen) {
+        emit logMessage("Failed to open the history store; history will not be saved");
+    }
+
+    for (;;) {
+        QList<Job> batch;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_stopping) {
+                m_notEmpty.wait(&m_mutex);
+            }
+            if (m_queue.isEmpty()) {
+                break; // Stopping and fully drained
+            }
+
+            // Group commit: let messages arriving shortly after join this batch
+            QDeadlineTimer deadline(m_commitInterval.loadRelaxed());
+            while (!m_stopping && m_queue.size() < kMaxBatchSize
+                   && m_notEmpty.wait(&m_mutex, deadline)) {
+            }
+
+            batch.swap(m_queue);
+            m_notFull.wakeAll();
+        }
+
+        processBatch(batch);
+    }
+
+    if (m_storeOpen) {
+        m_store->close();
+        m_storeOpen = false;
+    }
+}
+
+void HistoryWriter::processBatch(const QList<Job> &batch)
+{
+    QStringList conversations; // In order of first appearance
+    QHash<QString, QList<ChatMessage>> pending;
+
+    auto commitPending = [&] {
+        for (const QString &convId : conversations) {
+            commit(convId, pending.value(convId));
+        }
+        conversations.clear();
+        pending.clear();
+    };
+
+    for (const Job &job : batch) {
+        if (job.requestId != 0) {
+            commitPending(); // The read must see every append queued before it
+            read(job);
+            continue;
+        }
+
+        auto it = pending.find(job.conversationId);
+        if (it == pending.end()) {
+            conversations.append(job.conversationId);
+            it = pending.insert(job.conversationId, QList<ChatMessage>());
+        }
+        it->append(job.message);
+    }
+
+    commitPending();
+}
+
+void HistoryWriter::commit(const QString &conversationId, const QList<ChatMessage> &messages)
+{
+    bool ok = m_storeOpen;
+    if (ok && durability() == SyncEveryMessage) {
+        for (const auto &msg : messages) {
+            const qint64 started = ServerStats::nsecsNow();
+            if (!m_store->append(conversationId, {msg}, true)) {
+                ok = false;
+                break;
+            }
+            if (m_stats) {
+                m_stats->historyWriteLatency.observe(ServerStats::nsecsNow() - started);
+            }
+        }
+    } else if (ok) {
+        const qint64 started = ServerStats::nsecsNow();
+        ok = m_store->append(conversationId, messages, durability() == SyncBatch);
+        if (ok && m_stats) {
+            m_stats->historyWriteLatency.observe(ServerStats::nsecsNow() - started);
+        }
+    }
+
+    if (!ok) {
+        emit logMessage(QString("Failed to save %1 message(s) of %2")
+                            .arg(messages.size())
+                            .arg(conversationId));
+        emit writeFailed(conversationId);
+    }
+}
+
+void HistoryWriter::read(const Job &job)
+{
+    const qint64 started = ServerStats::nsecsNow();
+    const qint64 total = m_storeOpen ? m_store->count(job.conversationId) : 0;
+
+    qint64 first;
+    qint64 last;
+    pageBounds(total, job.before, job.after, job.limit, &first, &last);
+
+    QList<ChatMessage> messages;
+    if (last > first) {
+        messages = m_store->range(job.conversationId, first, last - first);
+    }
+    if (m_stats && m_storeOpen) {
+        m_stats->historyReadLatency.observe(ServerStats::nsecsNow() - started);
+    }
+    emit pageRead(job.requestId, first, total, messages);
+}
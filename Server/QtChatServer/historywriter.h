@@ -0,0 +1,111 @@
+#ifndef HISTORYWRITER_H
+#define HISTORYWRITER_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QScopedPointer>
+#include <QWaitCondition>
+#include "chatmessage.h"
+#include "historystore.h"
+
+class QThread;
+struct ServerStats;
+
+// Persists chat history on a dedicated thread so disk latency never stalls
+// message routing.
+//
+// Producers push jobs onto a bounded queue (any thread may push; a full
+// queue blocks the producer). The writer thread takes everything that
+// arrived within the commit interval as one batch and hands the HistoryStore
+// one append per conversation, synced once when durability asks for it
+// (group commit). Page reads travel through the same queue, so a read
+// always sees every message queued before it.
+//
+// The store is opened and used only on the writer thread.
+class HistoryWriter : public QObject
+{
+    Q_OBJECT
+public:
+    enum Durability {
+        NoSync,          // Leave flushing to the OS
+        SyncBatch,       // One fsync per file per group commit
+        SyncEveryMessage // Write and fsync every message on its own
+    };
+
+    static constexpr int DefaultCommitInterval = 2; // ms
+    static constexpr int DefaultQueueCapacity = 65536;
+
+    explicit HistoryWriter(QObject *parent = nullptr);
+    ~HistoryWriter() override;
+
+    // Takes ownership of store; only while stopped
+    void setStore(HistoryStore *store);
+    HistoryStore *store() const;
+    void setStats(ServerStats *stats); // Records store latencies; only while stopped
+
+    void start();
+    void stop(); // Commits everything already queued, then joins the thread
+    bool isRunning() const;
+
+    void setDurability(Durability durability);
+    Durability durability() const;
+    void setCommitInterval(int intervalMs);
+    int commitInterval() const;
+    qsizetype queueDepth() const;
+
+    // Producers
+    void append(const QString &conversationId, const ChatMessage &message);
+    void readPage(
+        quint64 requestId, const QString &conversationId, qint64 before, qint64 after, int limit);
+
+    // Resolves history cursors to positions [first, last) of a conversation
+    // of total messages: "after" pages forward, "before" backward, neither
+    // means the newest page
+    static void pageBounds(
+        qint64 total, qint64 before, qint64 after, int limit, qint64 *first, qint64 *last);
+
+signals:
+    // Emitted from the writer thread
+    void pageRead(quint64 requestId,
+                  qint64 first,
+                  qint64 total,
+                  const QList<ChatMessage> &messages);
+    void writeFailed(const QString &conversationId);
+    void logMessage(const QString &msg);
+
+private:
+    Q_DISABLE_COPY(HistoryWriter)
+
+    struct Job
+    {
+        QString conversationId;
+        ChatMessage message;  // Append jobs
+        quint64 requestId = 0; // Read jobs, 0 for appends
+        qint64 before = -1;
+        qint64 after = -1;
+        int limit = 0;
+    };
+
+    void enqueue(const Job &job);
+    void run();
+    void processBatch(const QList<Job> &batch);
+    void commit(const QString &conversationId, const QList<ChatMessage> &messages);
+    void read(const Job &job);
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_notEmpty;
+    QWaitCondition m_notFull;
+    QList<Job> m_queue;
+    bool m_stopping;
+
+    QThread *m_thread;
+    QAtomicInt m_durability;
+    QAtomicInt m_commitInterval;
+    QScopedPointer<HistoryStore> m_store;
+    bool m_storeOpen; // Writer thread only while running
+    ServerStats *m_stats;
+};
+
+#endif // HISTORYWRITER_H
@@ -0,0 +1,72 @@
+#include "loghistorystore.h"
+#include <QDebug>
+#include <QDir>
+#include "messagelog.h"
+
+LogHistoryStore::LogHistoryStore(const QString &directory)
+    : m_directory(directory)
+{}
+
+bool LogHistoryStore::open()
+{
+    m_recovered.clear();
+    if (!QDir().mkpath(m_directory)) {
+        qWarning() << "Failed to create history directory:" << m_directory;
+        return false;
+    }
+    return true;
+}
+
+void LogHistoryStore::close()
+{
+    m_recovered.clear();
+}
+
+bool LogHistoryStore::append(const QString &conversationId,
+                             const QList<ChatMessage> &messages,
+                             bool sync)
+{
+    const QString path = filePath(conversationId);
+    return ensureRecovered(path) && MessageLog::append(path, messages, sync);
+}
+
+QList<ChatMessage> LogHistoryStore::range(const QString &conversationId, qint64 first, qint64 count)
+{
+    const QString path = filePath(conversationId);
+    if (!ensureRecovered(path)) {
+        return QList<ChatMessage>();
+    }
+    return MessageLog::read(path, first, count);
+}
+
+qint64 LogHistoryStore::count(const QString &conversationId)
+{
+    const QString path = filePath(conversationId);
+    return ensureRecovered(path) ? MessageLog::count(path) : 0;
+}
+
+QString LogHistoryStore::directory() const
+{
+    return m_directory;
+}
+
+QString LogHistoryStore::filePath(const QString &conversationId) const
+{
+    return QString("%1/%2.chatlog").arg(m_directory).arg(conversationId);
+}
+
+bool LogHistoryStore::ensureRecovered(const QString &filePath)
+{
+    if (m_recovered.contains(filePath)) {
+        return true;
+    }
+
+    // First touch of this log since open(): drop any record torn by a crash
+    if (MessageLog::recover(filePath) < 0) {
+        qWarning() << "History log is unreadable:" << filePath;
+        return false;
+    }
+
+    m_recovered.insert(filePath);
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef LOGHISTORYSTORE_H
+#define LOGHISTORYSTORE_H
+
+#include <QSet>
+#include "historystore.h"
+
+// The original storage layout: one MessageLog (<conversationId>.chatlog plus
+// its index) per conversation in a directory. Each log is recovered from a
+// torn tail the first time it is touched after open().
+class LogHistoryStore : public HistoryStore
+{
+public:
+    explicit LogHistoryStore(const QString &directory);
+
+    bool open() override;
+    void close() override;
+    bool append(const QString &conversationId,
+                const QList<ChatMessage> &messages,
+                bool sync) override;
+    QList<ChatMessage> range(const QString &conversationId, qint64 first, qint64 count) override;
+    qint64 count(const QString &conversationId) override;
+
+    QString directory() const;
+    QString filePath(const QString &conversationId) const;
+
+private:
+    Q_DISABLE_COPY(LogHistoryStore)
+
+    bool ensureRecovered(const QString &filePath);
+
+    QString m_directory;
+    QSet<QString> m_recovered; // Logs checked for a torn tail since open()
+};
+
+#endif // LOGHISTORYSTORE_H
@@ -0,0 +1,77 @@
+#include "messagesequence.h"
+#include <QDebug>
+#include <QFile>
+#include <QSaveFile>
+#include <QtEndian>
+
+namespace {
+
+const quint64 kReserveBlock = 4096; // Ids per write of the sequence file
+
+} // namespace
+
+MessageSequence::MessageSequence()
+    : m_last(0)
+    , m_reserved(0)
+{}
+
+bool MessageSequence::open(const QString &filePath)
+{
+    close();
+    m_filePath = filePath;
+
+    QFile file(filePath);
+    if (file.exists()) {
+        char data[sizeof(quint64)];
+        if (!file.open(QIODevice::ReadOnly) || file.read(data, sizeof(data)) != sizeof(data)) {
+            qWarning() << "Failed to read message sequence:" << filePath;
+            m_filePath.clear(); // Don't overwrite what may still be recovered
+            return false;
+        }
+        m_last = qFromBigEndian<quint64>(data);
+        m_reserved = m_last;
+    }
+    return true;
+}
+
+void MessageSequence::close()
+{
+    m_filePath.clear();
+    m_last = 0;
+    m_reserved = 0;
+}
+
+quint64 MessageSequence::next()
+{
+    if (m_last == m_reserved) {
+        // Without the file the ids are only unique for this run
+        reserve(m_reserved + kReserveBlock);
+        m_reserved += kReserveBlock;
+    }
+    return ++m_last;
+}
+
+quint64 MessageSequence::last() const
+{
+    return m_last;
+}
+
+// Records that ids up to upTo may be in use. QSaveFile replaces the file
+// only once the new contents are on disk, so a crash leaves either block.
+bool MessageSequence::reserve(quint64 upTo)
+{
+    if (m_filePath.isEmpty()) {
+        return false;
+    }
+
+    char data[sizeof(quint64)];
+    qToBigEndian<quint64>(upTo, data);
+
+    QSaveFile file(m_filePath);
+    if (!file.open(QIODevice::WriteOnly) || file.write(data, sizeof(data)) != sizeof(data)
+        || !file.commit()) {
+        qWarning() << "Failed to reserve message ids in" << m_filePath;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef MESSAGESEQUENCE_H
+#define MESSAGESEQUENCE_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Hands out the server-wide message ids: 64 bit, starting at 1 and strictly
+// increasing for the lifetime of the data directory.
+//
+// Ids are reserved in blocks whose upper bound is recorded in a small file,
+// so the file is written once per block rather than once per message. After
+// a restart the sequence continues past the last reserved block; the unused
+// ids of that block are skipped, never handed out twice.
+class MessageSequence
+{
+public:
+    MessageSequence();
+
+    // Continues the sequence recorded in filePath, creating it if needed.
+    // Fails if the file exists but can't be read; the server must not start
+    // then, as its ids would repeat ones already handed out.
+    bool open(const QString &filePath);
+    void close();
+
+    quint64 next();
+    quint64 last() const; // The most recent id handed out, 0 before any
+
+private:
+    Q_DISABLE_COPY(MessageSequence)
+
+    bool reserve(quint64 upTo);
+
+    QString m_filePath;
+    quint64 m_last;
+    quint64 m_reserved; // Ids up to this one may be handed out without a write
+};
+
+#endif // MESSAGESEQUENCE_H
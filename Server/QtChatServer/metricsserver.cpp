@@ -0,0 +1,307 @@
+#include "metricsserver.h"
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <type_traits>
+#include "chatserver.h"
+#include "serverstats.h"
+
+namespace {
+
+// Requests are a line and a few headers; anything larger is not a scraper
+const qint64 kMaxRequestSize = 8 * 1024;
+
+void writeHeader(QByteArray &out, const char *name, const char *type, const char *help)
+{
+    out.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    out.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+}
+
+template<typename T>
+void writeSample(QByteArray &out, const char *name, T value, const QByteArray &labels = {})
+{
+    out.append(name);
+    if (!labels.isEmpty()) {
+        out.append('{').append(labels).append('}');
+    }
+    if constexpr (std::is_floating_point_v<T>) {
+        out.append(' ').append(QByteArray::number(value, 'g', 15)).append('\n');
+    } else {
+        out.append(' ').append(QByteArray::number(value)).append('\n');
+    }
+}
+
+template<typename T>
+void writeMetric(QByteArray &out, const char *name, const char *type, const char *help, T value)
+{
+    writeHeader(out, name, type, help);
+    writeSample(out, name, value);
+}
+
+// One sample per frame type, labelled type="..."
+void writePerType(QByteArray &out,
+                  const char *name,
+                  const char *help,
+                  const QAtomicInteger<quint64> (&values)[ServerStats::FrameTypeCount])
+{
+    writeHeader(out, name, "counter", help);
+    for (int i = 0; i < ServerStats::FrameTypeCount; ++i) {
+        const char *type = ServerStats::frameTypeName(ServerStats::FrameType(i));
+        const QByteArray labels = QByteArray("type=\"").append(type).append('"');
+        writeSample(out, name, values[i].loadRelaxed(), labels);
+    }
+}
+
+void writeHistogram(QByteArray &out,
+                    const char *name,
+                    const char *help,
+                    const LatencyHistogram &histogram)
+{
+    writeHeader(out, name, "histogram", help);
+
+    const QByteArray bucketName = QByteArray(name).append("_bucket");
+    quint64 cumulative = 0;
+    for (int i = 0; i < LatencyHistogram::BucketCount; ++i) {
+        cumulative += histogram.bucket(i);
+        const QByteArray le = i < int(LatencyHistogram::BucketBounds.size())
+                                  ? QByteArray::number(LatencyHistogram::BucketBounds[i] / 1e6)
+                                  : QByteArray("+Inf");
+        writeSample(out, bucketName.constData(), cumulative, "le=\"" + le + '"');
+    }
+
+    // Buckets are read one by one while others may record, so the count is
+    // taken from them to keep the series consistent
+    writeSample(out,
+                QByteArray(name).append("_sum").constData(),
+                histogram.sumNsecs() / 1e9);
+    writeSample(out, QByteArray(name).append("_count").constData(), cumulative);
+}
+
+} // namespace
+
+MetricsServer::MetricsServer(ChatServer *server, QObject *parent)
+    : QObject(parent)
+    , m_server(server)
+    , m_listener(new QTcpServer(this))
+{
+    connect(m_listener, &QTcpServer::newConnection, this, &MetricsServer::onNewConnection);
+}
+
+MetricsServer::~MetricsServer() = default;
+
+bool MetricsServer::listen(const QHostAddress &address, quint16 port)
+{
+    if (!m_listener->listen(address, port)) {
+        return false;
+    }
+
+    emit logMessage(QString("Metrics available at http://%1:%2/metrics")
+                        .arg(address.toString())
+                        .arg(m_listener->serverPort()));
+    return true;
+}
+
+void MetricsServer::close()
+{
+    m_listener->close();
+}
+
+bool MetricsServer::isListening() const
+{
+    return m_listener->isListening();
+}
+
+quint16 MetricsServer::serverPort() const
+{
+    return m_listener->serverPort();
+}
+
+QString MetricsServer::errorString() const
+{
+    return m_listener->errorString();
+}
+
+void MetricsServer::onNewConnection()
+{
+    while (QTcpSocket *socket = m_listener->nextPendingConnection()) {
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket] { handleRequest(socket); });
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    }
+}
+
+void MetricsServer::handleRequest(QTcpSocket *socket)
+{
+    // Answer once the headers are complete; the body of a GET is empty
+    const QByteArray request = socket->peek(kMaxRequestSize);
+    const qsizetype headerEnd = request.indexOf("\r\n\r\n");
+    if (headerEnd < 0) {
+        if (request.size() >= kMaxRequestSize) {
+            socket->abort();
+        }
+        return;
+    }
+    socket->read(headerEnd + 4);
+    disconnect(socket, &QTcpSocket::readyRead, this, nullptr);
+
+    const QList<QByteArray> requestLine = request.left(request.indexOf("\r\n")).split(' ');
+    const QByteArray method = requestLine.value(0);
+    const QByteArray path = requestLine.value(1);
+
+    if (method != "GET" && method != "HEAD") {
+        sendResponse(socket, "405 Method Not Allowed", "text/plain", "Method not allowed\n");
+    } else if (path != "/metrics" && !path.startsWith("/metrics?")) {
+        sendResponse(socket, "404 Not Found", "text/plain", "Not found\n");
+    } else {
+        const QByteArray body = method == "HEAD" ? QByteArray() : render();
+        sendResponse(socket, "200 OK", "text/plain; version=0.0.4; charset=utf-8", body);
+    }
+}
+
+void MetricsServer::sendResponse(QTcpSocket *socket,
+                                 const QByteArray &status,
+                                 const QByteArray &contentType,
+                                 const QByteArray &body)
+{
+    QByteArray response = "HTTP/1.1 " + status + "\r\n";
+    response.append("Content-Type: " + contentType + "\r\n");
+    response.append("Content-Length: " + QByteArray::number(body.size()) + "\r\n");
+    response.append("Connection: close\r\n\r\n");
+    response.append(body);
+
+    socket->write(response);
+    socket->disconnectFromHost(); // Closes once the response is written
+}
+
+QByteArray MetricsServer::render() const
+{
+    const ServerStats &stats = m_server->liveStats();
+    const HistoryCache::Stats cache = m_server->historyCacheStats();
+
+    QByteArray out;
+    out.reserve(16 * 1024);
+
+    writeMetric(out,
+                "qtchat_connections_accepted_total",
+                "counter",
+                "TCP connections accepted.",
+                stats.connectionsAccepted.loadRelaxed());
+    writeMetric(out,
+                "qtchat_connections_open",
+                "gauge",
+                "TCP connections currently open, registered or not.",
+                stats.connectionsOpen.loadRelaxed());
+    writeMetric(out,
+                "qtchat_clients_registered",
+                "gauge",
+                "Clients currently registered under a username.",
+                qint64(m_server->clientList().size()));
+    writeMetric(out,
+                "qtchat_registrations_total",
+                "counter",
+                "Successful registrations.",
+                stats.registrations.loadRelaxed());
+    writeMetric(out,
+                "qtchat_registrations_rejected_total",
+                "counter",
+                "Registrations refused because the name was taken or the server was full.",
+                stats.registrationsRejected.loadRelaxed());
+
+    writePerType(out,
+                 "qtchat_frames_received_total",
+                 "Frames received from clients.",
+                 stats.framesIn);
+    writePerType(out,
+                 "qtchat_received_bytes_total",
+                 "Bytes of frames received from clients, length prefix included.",
+                 stats.bytesIn);
+    writePerType(out,
+                 "qtchat_frames_sent_total",
+                 "Frames queued for clients.",
+                 stats.framesOut);
+    writePerType(out,
+                 "qtchat_sent_bytes_total",
+                 "Bytes of frames queued for clients, length prefix included.",
+                 stats.bytesOut);
+
+    writeMetric(out,
+                "qtchat_write_batches_total",
+                "counter",
+                "Socket writes carrying one or more frames.",
+                stats.writeBatches.loadRelaxed());
+    writeMetric(out,
+                "qtchat_written_bytes_total",
+                "counter",
+                "Bytes handed to client sockets.",
+                stats.bytesWritten.loadRelaxed());
+    writeMetric(out,
+                "qtchat_output_queue_bytes",
+                "gauge",
+                "Output waiting to be written to clients.",
+                stats.queuedBytes.loadRelaxed());
+    writeMetric(out,
+                "qtchat_dropped_frames_total",
+                "counter",
+                "Ephemeral frames dropped for slow clients.",
+                stats.droppedFrames.loadRelaxed());
+    writeMetric(out,
+                "qtchat_slow_consumer_disconnects_total",
+                "counter",
+                "Clients disconnected for not reading their output.",
+                stats.slowConsumerDisconnects.loadRelaxed());
+    writeMetric(out,
+                "qtchat_paused_senders",
+                "gauge",
+                "Clients whose input is paused for a slow recipient.",
+                stats.pausedSenders.loadRelaxed());
+
+    writeHistogram(out,
+                   "qtchat_routing_latency_seconds",
+                   "Time from reading a chat frame to handing it to the recipient.",
+                   stats.routingLatency);
+    writeHistogram(out,
+                   "qtchat_history_write_latency_seconds",
+                   "Time of one history store append, sync included.",
+                   stats.historyWriteLatency);
+    writeHistogram(out,
+                   "qtchat_history_read_latency_seconds",
+                   "Time to read one history page from the store.",
+                   stats.historyReadLatency);
+
+    writeMetric(out,
+                "qtchat_history_queue_depth",
+                "gauge",
+                "History jobs waiting for the writer thread.",
+                qint64(m_server->historyQueueDepth()));
+    writeMetric(out,
+                "qtchat_history_cache_hits_total",
+                "counter",
+                "History pages served from the cache.",
+                cache.hits);
+    writeMetric(out,
+                "qtchat_history_cache_misses_total",
+                "counter",
+                "History pages read from the store.",
+                cache.misses);
+    writeMetric(out,
+                "qtchat_history_cache_evictions_total",
+                "counter",
+                "Conversations evicted from the history cache.",
+                cache.evictions);
+    writeMetric(out,
+                "qtchat_history_cache_entries",
+                "gauge",
+                "Conversations held in the history cache.",
+                qint64(cache.entries));
+    writeMetric(out,
+                "qtchat_history_cache_bytes",
+                "gauge",
+                "Estimated memory held by the history cache.",
+                cache.bytes);
+
+    writeMetric(out,
+                "qtchat_log_dropped_records_total",
+                "counter",
+                "Log records lost because the log thread fell behind.",
+                m_server->serverLog()->droppedRecords());
+
+    return out;
+}
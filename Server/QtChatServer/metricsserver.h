@@ -0,0 +1,52 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QByteArray>
+#include <QHostAddress>
+#include <QObject>
+
+class QTcpServer;
+class QTcpSocket;
+class ChatServer;
+
+// Serves the server's counters and histograms in the Prometheus text format
+// at GET /metrics. It is a minimal HTTP/1.1 responder meant for a local
+// scraper: one request per connection, no keep-alive, no TLS. Lives on the
+// ChatServer's thread.
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetricsServer(ChatServer *server, QObject *parent = nullptr);
+    ~MetricsServer() override;
+
+    // Callers report failures, see errorString()
+    bool listen(const QHostAddress &address, quint16 port);
+    void close();
+    bool isListening() const;
+    quint16 serverPort() const;
+    QString errorString() const;
+
+    // The exposition text for the current state of the server
+    QByteArray render() const;
+
+signals:
+    void logMessage(const QString &msg);
+
+private slots:
+    void onNewConnection();
+
+private:
+    Q_DISABLE_COPY(MetricsServer)
+
+    void handleRequest(QTcpSocket *socket);
+    static void sendResponse(QTcpSocket *socket,
+                             const QByteArray &status,
+                             const QByteArray &contentType,
+                             const QByteArray &body);
+
+    ChatServer *m_server;
+    QTcpServer *m_listener;
+};
+
+#endif // METRICSSERVER_H
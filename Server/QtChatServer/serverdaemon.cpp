@@ -0,0 +1,602 @@
+#include "serverdaemon.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QSettings>
+#include <QSocketNotifier>
+#include "chatserver.h"
+#include "metricsserver.h"
+
+#ifdef Q_OS_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+#endif
+
+int ServerDaemon::s_signalFd[2] = {-1, -1};
+
+#ifdef Q_OS_UNIX
+namespace {
+
+int syslogPriority(ServerLog::Level level)
+{
+    switch (level) {
+    case ServerLog::Debug:
+        return LOG_DEBUG;
+    case ServerLog::Warning:
+        return LOG_WARNING;
+    case ServerLog::Error:
+        return LOG_ERR;
+    case ServerLog::Info:
+        break;
+    }
+    return LOG_INFO;
+}
+
+} // namespace
+#endif
+
+ServerDaemon::ServerDaemon(QObject *parent)
+    : QObject(parent)
+    , m_server(new ChatServer(this))
+    , m_metrics(nullptr)
+    , m_signalNotifier(nullptr)
+{
+    // Until start() knows whether to use syslog, records go to stdout
+    m_server->serverLog()->setStdout(true);
+}
+
+ServerDaemon::~ServerDaemon()
+{
+#ifdef Q_OS_UNIX
+    if (m_options.useSyslog) {
+        closelog();
+    }
+#endif
+}
+
+bool ServerDaemon::parseArguments(const QStringList &arguments)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless Qt chat server");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption portOption({"p", "port"}, "Port to listen on (default 12345).", "port");
+    QCommandLineOption dataDirOption({"d", "data-dir"}, "Directory for server history.", "dir");
+    QCommandLineOption configOption({"c", "config"},
+                                    "INI config file, reloaded on SIGHUP.",
+                                    "file");
+    QCommandLineOption maxClientsOption("max-clients",
+                                        "Maximum registered clients (0 = unlimited).",
+                                        "count");
+    QCommandLineOption maxMessageOption("max-message-length",
+                                        "Maximum chat message length (0 = unlimited).",
+                                        "chars");
+    QCommandLineOption ioThreadsOption("io-threads",
+                                       "Connection I/O threads (0 = one per core).",
+                                       "count");
+    QCommandLineOption flushLatencyOption("flush-latency",
+                                          "Max time output is held for batching (ms).",
+                                          "ms");
+    QCommandLineOption highWatermarkOption("high-watermark",
+                                           "Queued output that marks a client as slow (bytes).",
+                                           "bytes");
+    QCommandLineOption lowWatermarkOption("low-watermark",
+                                          "Queued output at which a slow client recovers (bytes).",
+                                          "bytes");
+    QCommandLineOption policyOption("slow-consumer-policy",
+                                    "What to do with slow clients: drop, pause or disconnect.",
+                                    "policy");
+    QCommandLineOption backendOption("history-backend",
+                                     "History storage: log (file per conversation) or sqlite.",
+                                     "backend");
+    QCommandLineOption historyCacheOption("history-cache",
+                                          "Memory for cached conversation tails (MiB, 0 = off).",
+                                          "MiB");
+    QCommandLineOption durabilityOption("history-durability",
+                                        "When history is fsync'ed: none, batched or every.",
+                                        "mode");
+    QCommandLineOption commitIntervalOption("history-commit-interval",
+                                            "Window for grouping history writes (ms).",
+                                            "ms");
+    QCommandLineOption metricsPortOption("metrics-port",
+                                         "Serve Prometheus metrics on localhost (0 = off).",
+                                         "port");
+    QCommandLineOption syslogOption("syslog", "Send log output to syslog instead of stdout.");
+    QCommandLineOption logLevelOption("log-level",
+                                      "Least severe records logged: debug, info, warning or error.",
+                                      "level");
+    QCommandLineOption logFileOption("log-file", "Also append log records to this file.", "file");
+    QCommandLineOption logFormatOption("log-format",
+                                       "Log record format: text or json (one object per line).",
+                                       "format");
+    QCommandLineOption logRateLimitOption("log-rate-limit",
+                                          "Records per event per second (0 = unlimited).",
+                                          "count");
+
+    parser.addOptions({portOption,
+                       dataDirOption,
+                       configOption,
+                       maxClientsOption,
+                       maxMessageOption,
+                       ioThreadsOption,
+                       flushLatencyOption,
+                       highWatermarkOption,
+                       lowWatermarkOption,
+                       policyOption,
+                       backendOption,
+                       historyCacheOption,
+                       durabilityOption,
+                       commitIntervalOption,
+                       metricsPortOption,
+                       syslogOption,
+                       logLevelOption,
+                       logFileOption,
+                       logFormatOption,
+                       logRateLimitOption});
+    parser.process(arguments);
+
+    if (parser.isSet(portOption)) {
+        bool ok;
+        m_options.port = parser.value(portOption).toUShort(&ok);
+        if (!ok || m_options.port == 0) {
+            onLogError(QString("Invalid port: %1").arg(parser.value(portOption)));
+            return false;
+        }
+        m_explicitOptions << "port";
+    }
+    if (parser.isSet(dataDirOption)) {
+        m_options.dataDirectory = parser.value(dataDirOption);
+        m_explicitOptions << "data_dir";
+    }
+    if (parser.isSet(maxClientsOption)) {
+        m_options.maxClients = parser.value(maxClientsOption).toInt();
+        m_explicitOptions << "max_clients";
+    }
+    if (parser.isSet(maxMessageOption)) {
+        m_options.maxMessageLength = parser.value(maxMessageOption).toInt();
+        m_explicitOptions << "max_message_length";
+    }
+    if (parser.isSet(ioThreadsOption)) {
+        m_options.ioThreads = parser.value(ioThreadsOption).toInt();
+        m_explicitOptions << "io_threads";
+    }
+    if (parser.isSet(flushLatencyOption)) {
+        m_options.flushLatency = parser.value(flushLatencyOption).toInt();
+        m_explicitOptions << "flush_latency";
+    }
+    if (parser.isSet(highWatermarkOption)) {
+        m_options.flowControl.highWatermark = parser.value(highWatermarkOption).toLongLong();
+        m_explicitOptions << "high_watermark";
+    }
+    if (parser.isSet(lowWatermarkOption)) {
+        m_options.flowControl.lowWatermark = parser.value(lowWatermarkOption).toLongLong();
+        m_explicitOptions << "low_watermark";
+    }
+    if (parser.isSet(policyOption)) {
+        if (!parsePolicy(parser.value(policyOption), &m_options.flowControl.policy)) {
+            onLogError(
+                QString("Invalid slow consumer policy: %1").arg(parser.value(policyOption)));
+            return false;
+        }
+        m_explicitOptions << "slow_consumer_policy";
+    }
+    if (parser.isSet(backendOption)) {
+        if (!parseBackend(parser.value(backendOption), &m_options.historyBackend)) {
+            onLogError(QString("Invalid history backend: %1").arg(parser.value(backendOption)));
+            return false;
+        }
+        m_explicitOptions << "history_backend";
+    }
+    if (parser.isSet(historyCacheOption)) {
+        m_options.historyCacheMb = parser.value(historyCacheOption).toInt();
+        m_explicitOptions << "history_cache_mb";
+    }
+    if (parser.isSet(durabilityOption)) {
+        if (!parseDurability(parser.value(durabilityOption), &m_options.historyDurability)) {
+            onLogError(
+                QString("Invalid history durability: %1").arg(parser.value(durabilityOption)));
+            return false;
+        }
+        m_explicitOptions << "history_durability";
+    }
+    if (parser.isSet(commitIntervalOption)) {
+        m_options.historyCommitInterval = parser.value(commitIntervalOption).toInt();
+        m_explicitOptions << "history_commit_interval";
+    }
+    if (parser.isSet(metricsPortOption)) {
+        bool ok;
+        m_options.metricsPort = parser.value(metricsPortOption).toUShort(&ok);
+        if (!ok) {
+            onLogError(QString("Invalid metrics port: %1").arg(parser.value(metricsPortOption)));
+            return false;
+        }
+        m_explicitOptions << "metrics_port";
+    }
+    if (parser.isSet(syslogOption)) {
+        m_options.useSyslog = true;
+        m_explicitOptions << "syslog";
+    }
+    if (parser.isSet(logLevelOption)) {
+        if (!ServerLog::parseLevel(parser.value(logLevelOption), &m_options.logLevel)) {
+            onLogError(QString("Invalid log level: %1").arg(parser.value(logLevelOption)));
+            return false;
+        }
+        m_explicitOptions << "log_level";
+    }
+    if (parser.isSet(logFileOption)) {
+        m_options.logFile = parser.value(logFileOption);
+        m_explicitOptions << "log_file";
+    }
+    if (parser.isSet(logFormatOption)) {
+        if (!parseLogFormat(parser.value(logFormatOption), &m_options.logFormat)) {
+            onLogError(QString("Invalid log format: %1").arg(parser.value(logFormatOption)));
+            return false;
+        }
+        m_explicitOptions << "log_format";
+    }
+    if (parser.isSet(logRateLimitOption)) {
+        m_options.logRateLimit = parser.value(logRateLimitOption).toInt();
+        m_explicitOptions << "log_rate_limit";
+    }
+
+    m_configFile = parser.value(configOption);
+    if (!m_configFile.isEmpty() && !loadConfigFile(m_options)) {
+        return false;
+    }
+
+    return checkFlowControl(m_options);
+}
+
+bool ServerDaemon::start()
+{
+#ifdef Q_OS_UNIX
+    if (m_options.useSyslog) {
+        openlog("QtChatServerd", LOG_PID, LOG_DAEMON);
+        m_server->serverLog()->setStdout(false);
+
+        // syslog() is thread-safe, so take the records straight on the log thread
+        connect(
+            m_server->serverLog(),
+            &ServerLog::entriesLogged,
+            this,
+            [](const QList<ServerLog::Entry> &entries) {
+                for (const ServerLog::Entry &entry : entries) {
+                    QString line = entry.message;
+                    if (entry.suppressed > 0) {
+                        line += QString(" (%1 similar suppressed)").arg(entry.suppressed);
+                    }
+                    syslog(syslogPriority(entry.level), "%s", line.toUtf8().constData());
+                }
+            },
+            Qt::DirectConnection);
+    }
+#endif
+
+    if (!applyLogging(m_options)) {
+        return false;
+    }
+
+    if (!installSignalHandlers()) {
+        onLogError("Failed to install signal handlers");
+        return false;
+    }
+
+    m_server->setDataDirectory(m_options.dataDirectory);
+    m_server->setIoThreadCount(m_options.ioThreads);
+    m_server->setHistoryBackend(m_options.historyBackend);
+    applyLimits(m_options);
+
+    if (!m_server->startServer(m_options.port)) {
+        return false;
+    }
+
+    if (m_options.metricsPort != 0) {
+        m_metrics = new MetricsServer(m_server.data(), this);
+        connect(m_metrics, &MetricsServer::logMessage, this, &ServerDaemon::onLogMessage);
+        if (!m_metrics->listen(QHostAddress::LocalHost, m_options.metricsPort)) {
+            onLogError(QString("Failed to start metrics listener on port %1: %2")
+                           .arg(m_options.metricsPort)
+                           .arg(m_metrics->errorString()));
+            m_server->stopServer();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ServerDaemon::loadConfigFile(Options &options)
+{
+    if (!QFile::exists(m_configFile)) {
+        onLogError(QString("Config file not found: %1").arg(m_configFile));
+        return false;
+    }
+
+    QSettings settings(m_configFile, QSettings::IniFormat);
+    auto configured = [&](const QString &key) {
+        return !m_explicitOptions.contains(key) && settings.contains(key);
+    };
+
+    if (configured("port")) {
+        options.port = static_cast<quint16>(settings.value("port").toUInt());
+    }
+    if (configured("data_dir")) {
+        options.dataDirectory = settings.value("data_dir").toString();
+    }
+    if (configured("max_clients")) {
+        options.maxClients = settings.value("max_clients").toInt();
+    }
+    if (configured("max_message_length")) {
+        options.maxMessageLength = settings.value("max_message_length").toInt();
+    }
+    if (configured("io_threads")) {
+        options.ioThreads = settings.value("io_threads").toInt();
+    }
+    if (configured("flush_latency")) {
+        options.flushLatency = settings.value("flush_latency").toInt();
+    }
+    if (configured("high_watermark")) {
+        options.flowControl.highWatermark = settings.value("high_watermark").toLongLong();
+    }
+    if (configured("low_watermark")) {
+        options.flowControl.lowWatermark = settings.value("low_watermark").toLongLong();
+    }
+    if (configured("slow_consumer_policy")
+        && !parsePolicy(settings.value("slow_consumer_policy").toString(),
+                        &options.flowControl.policy)) {
+        onLogError("Invalid slow_consumer_policy in config file");
+        return false;
+    }
+    if (configured("history_backend")
+        && !parseBackend(settings.value("history_backend").toString(), &options.historyBackend)) {
+        onLogError("Invalid history_backend in config file");
+        return false;
+    }
+    if (configured("history_cache_mb")) {
+        options.historyCacheMb = settings.value("history_cache_mb").toInt();
+    }
+    if (configured("history_durability")
+        && !parseDurability(settings.value("history_durability").toString(),
+                            &options.historyDurability)) {
+        onLogError("Invalid history_durability in config file");
+        return false;
+    }
+    if (configured("history_commit_interval")) {
+        options.historyCommitInterval = settings.value("history_commit_interval").toInt();
+    }
+    if (configured("metrics_port")) {
+        options.metricsPort = static_cast<quint16>(settings.value("metrics_port").toUInt());
+    }
+    if (configured("syslog")) {
+        options.useSyslog = settings.value("syslog").toBool();
+    }
+    if (configured("log_level")
+        && !ServerLog::parseLevel(settings.value("log_level").toString(), &options.logLevel)) {
+        onLogError("Invalid log_level in config file");
+        return false;
+    }
+    if (configured("log_file")) {
+        options.logFile = settings.value("log_file").toString();
+    }
+    if (configured("log_format")
+        && !parseLogFormat(settings.value("log_format").toString(), &options.logFormat)) {
+        onLogError("Invalid log_format in config file");
+        return false;
+    }
+    if (configured("log_rate_limit")) {
+        options.logRateLimit = settings.value("log_rate_limit").toInt();
+    }
+
+    return settings.status() == QSettings::NoError;
+}
+
+// The watermarks can come from both the command line and the config file, so
+// they are checked once both are merged
+bool ServerDaemon::checkFlowControl(const Options &options)
+{
+    const ClientConnection::FlowControl &flow = options.flowControl;
+    if (flow.lowWatermark < 0 || flow.lowWatermark >= flow.highWatermark
+        || flow.highWatermark >= flow.hardLimit) {
+        onLogError(QString("Invalid watermarks: need 0 <= low (%1) < high (%2) < %3 bytes")
+                       .arg(flow.lowWatermark)
+                       .arg(flow.highWatermark)
+                       .arg(flow.hardLimit));
+        return false;
+    }
+    return true;
+}
+
+void ServerDaemon::applyLimits(const Options &options)
+{
+    m_server->setMaxClients(options.maxClients);
+    m_server->setMaxMessageLength(options.maxMessageLength);
+    m_server->setFlushLatency(options.flushLatency);
+    m_server->setFlowControl(options.flowControl);
+    m_server->setHistoryCacheSize(qint64(options.historyCacheMb) * 1024 * 1024);
+    m_server->setHistoryDurability(options.historyDurability);
+    m_server->setHistoryCommitInterval(options.historyCommitInterval);
+}
+
+bool ServerDaemon::applyLogging(const Options &options)
+{
+    ServerLog *log = m_server->serverLog();
+    log->setLevel(options.logLevel);
+    log->setFormat(options.logFormat);
+    log->setRateLimit(options.logRateLimit);
+    if (!log->setFile(options.logFile)) {
+        onLogError(QString("Failed to open log file: %1").arg(options.logFile));
+        return false;
+    }
+    return true;
+}
+
+bool ServerDaemon::parsePolicy(const QString &name, ClientConnection::SlowConsumerPolicy *policy)
+{
+    if (name == "drop") {
+        *policy = ClientConnection::DropEphemeral;
+    } else if (name == "pause") {
+        *policy = ClientConnection::PauseSenders;
+    } else if (name == "disconnect") {
+        *policy = ClientConnection::DisconnectConsumer;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ServerDaemon::parseDurability(const QString &name, HistoryWriter::Durability *durability)
+{
+    if (name == "none") {
+        *durability = HistoryWriter::NoSync;
+    } else if (name == "batched") {
+        *durability = HistoryWriter::SyncBatch;
+    } else if (name == "every") {
+        *durability = HistoryWriter::SyncEveryMessage;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ServerDaemon::parseLogFormat(const QString &name, ServerLog::Format *format)
+{
+    if (name == "text") {
+        *format = ServerLog::Text;
+    } else if (name == "json") {
+        *format = ServerLog::JsonLines;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ServerDaemon::parseBackend(const QString &name, HistoryStore::Backend *backend)
+{
+    if (name == "log") {
+        *backend = HistoryStore::LogFiles;
+    } else if (name == "sqlite") {
+        *backend = HistoryStore::Sqlite;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void ServerDaemon::reloadConfig()
+{
+    if (m_configFile.isEmpty()) {
+        onLogMessage("SIGHUP received, no config file to reload");
+        return;
+    }
+
+    Options options = m_options;
+    if (!loadConfigFile(options) || !checkFlowControl(options)) {
+        onLogError("Config reload failed, keeping current settings");
+        return;
+    }
+
+    // Limits and logging apply immediately (the log file is reopened, which
+    // also suits log rotation); the listening socket and storage stay as they are
+    if (options.port != m_options.port || options.dataDirectory != m_options.dataDirectory
+        || options.ioThreads != m_options.ioThreads || options.useSyslog != m_options.useSyslog
+        || options.historyBackend != m_options.historyBackend
+        || options.metricsPort != m_options.metricsPort) {
+        onLogMessage("Port, data directory, I/O thread, history backend, metrics port and log "
+                     "target changes require a restart");
+        options.port = m_options.port;
+        options.dataDirectory = m_options.dataDirectory;
+        options.ioThreads = m_options.ioThreads;
+        options.useSyslog = m_options.useSyslog;
+        options.historyBackend = m_options.historyBackend;
+        options.metricsPort = m_options.metricsPort;
+    }
+
+    applyLimits(options);
+    if (!applyLogging(options)) {
+        options.logFile.clear(); // The previous file was closed before the attempt
+    }
+    m_options = options;
+    onLogMessage(QString("Config reloaded: max clients %1, max message length %2")
+                     .arg(m_options.maxClients)
+                     .arg(m_options.maxMessageLength));
+}
+
+void ServerDaemon::shutdown()
+{
+    onLogMessage("Shutting down");
+    if (m_metrics) {
+        m_metrics->close();
+    }
+    m_server->stopServer();
+    QCoreApplication::quit();
+}
+
+void ServerDaemon::onLogMessage(const QString &msg)
+{
+    // The daemon's own messages go through the server log so they share its
+    // sinks and ordering
+    m_server->serverLog()->info(msg);
+}
+
+void ServerDaemon::onLogError(const QString &msg)
+{
+    m_server->serverLog()->error(msg);
+}
+
+// Signals are forwarded through a socket pair so that all the real work
+// happens in the event loop rather than inside the async signal handler.
+bool ServerDaemon::installSignalHandlers()
+{
+#ifdef Q_OS_UNIX
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, s_signalFd) != 0) {
+        return false;
+    }
+
+    m_signalNotifier = new QSocketNotifier(s_signalFd[1], QSocketNotifier::Read, this);
+    connect(m_signalNotifier, &QSocketNotifier::activated, this, &ServerDaemon::onSignalReceived);
+
+    struct sigaction action = {};
+    action.sa_handler = ServerDaemon::signalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+
+    for (int sig : {SIGTERM, SIGINT, SIGHUP}) {
+        if (sigaction(sig, &action, nullptr) != 0) {
+            return false;
+        }
+    }
+    ::signal(SIGPIPE, SIG_IGN);
+#endif
+    return true;
+}
+
+void ServerDaemon::signalHandler(int signal)
+{
+#ifdef Q_OS_UNIX
+    const char sig = static_cast<char>(signal);
+    ssize_t written = ::write(s_signalFd[0], &sig, sizeof(sig));
+    Q_UNUSED(written)
+#else
+    Q_UNUSED(signal)
+#endif
+}
+
+void ServerDaemon::onSignalReceived()
+{
+#ifdef Q_OS_UNIX
+    m_signalNotifier->setEnabled(false);
+
+    char sig = 0;
+    if (::read(s_signalFd[1], &sig, sizeof(sig)) == sizeof(sig)) {
+        if (sig == SIGHUP) {
+            reloadConfig();
+        } else {
+            shutdown();
+        }
+    }
+
+    m_signalNotifier->setEnabled(true);
+#endif
+}
@@ -0,0 +1,81 @@
+#ifndef SERVERDAEMON_H
+#define SERVERDAEMON_H
+
+#include <QObject>
+#include <QScopedPointer>
+#include <QString>
+#include "clientconnection.h"
+#include "historywriter.h"
+#include "serverlog.h"
+
+class QSocketNotifier;
+class ChatServer;
+class MetricsServer;
+
+// Runs ChatServer without any GUI. Options come from the command line and an
+// optional INI config file; SIGTERM/SIGINT stop the server and SIGHUP reloads
+// the config file.
+class ServerDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    struct Options
+    {
+        quint16 port = 12345;
+        QString dataDirectory;
+        int maxClients = 0;
+        int maxMessageLength = 0;
+        int ioThreads = 0; // 0 means one per core
+        int flushLatency = 0;
+        ClientConnection::FlowControl flowControl;
+        HistoryStore::Backend historyBackend = HistoryStore::LogFiles;
+        int historyCacheMb = 16;
+        HistoryWriter::Durability historyDurability = HistoryWriter::SyncBatch;
+        int historyCommitInterval = HistoryWriter::DefaultCommitInterval;
+        quint16 metricsPort = 0; // Local Prometheus endpoint, 0 means off
+        bool useSyslog = false;
+        ServerLog::Level logLevel = ServerLog::Info;
+        QString logFile; // Written in addition to stdout or syslog
+        ServerLog::Format logFormat = ServerLog::Text;
+        int logRateLimit = ServerLog::DefaultRateLimit;
+    };
+
+    explicit ServerDaemon(QObject *parent = nullptr);
+    ~ServerDaemon() override;
+
+    // Parses the application's arguments; returns false if it should exit
+    bool parseArguments(const QStringList &arguments);
+    bool start();
+
+private slots:
+    void onLogMessage(const QString &msg);
+    void onLogError(const QString &msg);
+    void onSignalReceived();
+
+private:
+    Q_DISABLE_COPY(ServerDaemon)
+
+    bool loadConfigFile(Options &options);
+    bool checkFlowControl(const Options &options);
+    void applyLimits(const Options &options);
+    bool applyLogging(const Options &options);
+    static bool parseLogFormat(const QString &name, ServerLog::Format *format);
+    static bool parsePolicy(const QString &name, ClientConnection::SlowConsumerPolicy *policy);
+    static bool parseDurability(const QString &name, HistoryWriter::Durability *durability);
+    static bool parseBackend(const QString &name, HistoryStore::Backend *backend);
+    void reloadConfig();
+    void shutdown();
+    bool installSignalHandlers();
+    static void signalHandler(int signal);
+
+    QScopedPointer<ChatServer> m_server;
+    MetricsServer *m_metrics;
+    Options m_options;
+    QString m_configFile;
+    QStringList m_explicitOptions; // Set on the command line, win over the config file
+
+    QSocketNotifier *m_signalNotifier;
+    static int s_signalFd[2];
+};
+
+#endif // SERVERDAEMON_H
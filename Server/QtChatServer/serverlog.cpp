@@ -0,0 +1,388 @@
+#include "serverlog.h"
+#include <QDeadlineTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QThread>
+#include <cstdio>
+
+namespace {
+
+// Must be a power of two
+const quint64 kRingCapacity = 8192;
+
+// How long the log thread sleeps when the ring is empty; also the longest a
+// record waits before it reaches the sinks
+const int kIdleInterval = 50; // ms
+
+const int kMaxBatchSize = 1024;
+
+} // namespace
+
+ServerLog::ServerLog(QObject *parent)
+    : QObject(parent)
+    , m_ring(new Slot[kRingCapacity])
+    , m_head(0)
+    , m_tail(0)
+    , m_dropped(0)
+    , m_level(Info)
+    , m_rateLimit(DefaultRateLimit)
+    , m_thread(nullptr)
+    , m_stopping(0)
+    , m_stdout(false)
+    , m_format(Text)
+{
+    // Slot i is free for the producer claiming position i
+    for (quint64 i = 0; i < kRingCapacity; ++i) {
+        m_ring[i].sequence.storeRelaxed(i);
+    }
+}
+
+ServerLog::~ServerLog()
+{
+    stop();
+}
+
+void ServerLog::start()
+{
+    if (m_thread) {
+        return;
+    }
+
+    m_stopping.storeRelease(0);
+    m_thread = QThread::create([this] { run(); });
+    m_thread->setObjectName("ChatServerLog");
+    m_thread->start();
+}
+
+void ServerLog::stop()
+{
+    if (!m_thread) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_wakeMutex);
+        m_stopping.storeRelease(1);
+        m_wake.wakeAll();
+    }
+
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+
+    QMutexLocker locker(&m_sinkMutex);
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+}
+
+bool ServerLog::isRunning() const
+{
+    return m_thread != nullptr;
+}
+
+void ServerLog::setLevel(Level level)
+{
+    m_level.storeRelaxed(level);
+}
+
+ServerLog::Level ServerLog::level() const
+{
+    return static_cast<Level>(m_level.loadRelaxed());
+}
+
+void ServerLog::setRateLimit(int perSecond)
+{
+    m_rateLimit.storeRelaxed(qMax(0, perSecond));
+}
+
+int ServerLog::rateLimit() const
+{
+    return m_rateLimit.loadRelaxed();
+}
+
+quint64 ServerLog::droppedRecords() const
+{
+    return m_dropped.loadRelaxed();
+}
+
+bool ServerLog::setFile(const QString &path)
+{
+    QMutexLocker locker(&m_sinkMutex);
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+    if (path.isEmpty()) {
+        return true;
+    }
+
+    m_file.setFileName(path);
+    return m_file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text);
+}
+
+void ServerLog::setStdout(bool enabled)
+{
+    QMutexLocker locker(&m_sinkMutex);
+    m_stdout = enabled;
+}
+
+void ServerLog::setFormat(Format format)
+{
+    QMutexLocker locker(&m_sinkMutex);
+    m_format = format;
+}
+
+const char *ServerLog::levelName(Level level)
+{
+    switch (level) {
+    case Debug:
+        return "debug";
+    case Warning:
+        return "warning";
+    case Error:
+        return "error";
+    case Info:
+        break;
+    }
+    return "info";
+}
+
+bool ServerLog::parseLevel(const QString &name, Level *level)
+{
+    for (Level candidate : {Debug, Info, Warning, Error}) {
+        if (name == QLatin1String(levelName(candidate))) {
+            *level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+QString ServerLog::formatEntry(const Entry &entry, Format format)
+{
+    const QString time = QDateTime::fromMSecsSinceEpoch(entry.time).toString(Qt::ISODateWithMs);
+
+    if (format == JsonLines) {
+        QJsonObject obj;
+        obj["time"] = time;
+        obj["level"] = levelName(entry.level);
+        obj["event"] = entry.event;
+        if (!entry.user.isEmpty()) {
+            obj["user"] = entry.user;
+        }
+        obj["message"] = entry.message;
+        if (entry.suppressed > 0) {
+            obj["suppressed"] = entry.suppressed;
+        }
+        return QString::fromUtf8(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+    }
+
+    QString line = QString("[%1] %2 %3").arg(time, QString(levelName(entry.level)).toUpper(),
+                                             entry.event);
+    if (!entry.user.isEmpty()) {
+        line += ' ' + entry.user;
+    }
+    line += ": " + entry.message;
+    if (entry.suppressed > 0) {
+        line += QString(" (%1 similar suppressed)").arg(entry.suppressed);
+    }
+    return line;
+}
+
+void ServerLog::info(const QString &message)
+{
+    logText(Info, "message", message);
+}
+
+void ServerLog::warning(const QString &message)
+{
+    logText(Warning, "warning", message);
+}
+
+void ServerLog::error(const QString &message)
+{
+    logText(Error, "error", message);
+}
+
+// Free text shares one event name per level, so it bypasses the limiter
+void ServerLog::logText(Level level, const char *event, const QString &message)
+{
+    if (isEnabled(level)) {
+        write(level, event, QString(), "%1", QDateTime::currentMSecsSinceEpoch(), 0, message);
+    }
+}
+
+bool ServerLog::admit(const char *event, qint64 now, int *suppressed)
+{
+    const int limit = m_rateLimit.loadRelaxed();
+    if (limit <= 0) {
+        return true;
+    }
+
+    // Open addressing on the event name's address; with the table full an
+    // event is simply not limited
+    const size_t mask = m_rates.size() - 1;
+    const size_t start = (reinterpret_cast<quintptr>(event) >> 3) & mask;
+    RateSlot *rate = nullptr;
+    for (size_t probe = 0; probe < m_rates.size(); ++probe) {
+        RateSlot &candidate = m_rates[(start + probe) & mask];
+        const char *owner = candidate.event.loadAcquire();
+        if (!owner && candidate.event.testAndSetOrdered(nullptr, event)) {
+            owner = event;
+        } else if (!owner) {
+            owner = candidate.event.loadAcquire();
+        }
+        if (owner == event) {
+            rate = &candidate;
+            break;
+        }
+    }
+    if (!rate) {
+        return true;
+    }
+
+    // Racing producers may let a record or two more through at the turn of
+    // a second; the limit is approximate by design
+    const qint64 second = now / 1000;
+    qint64 current = rate->second.loadRelaxed();
+    if (current != second && rate->second.testAndSetRelaxed(current, second, current)) {
+        rate->count.storeRelaxed(0);
+        *suppressed = rate->suppressed.fetchAndStoreRelaxed(0);
+    }
+
+    if (rate->count.fetchAndAddRelaxed(1) >= limit) {
+        rate->suppressed.fetchAndAddRelaxed(1);
+        return false;
+    }
+    return true;
+}
+
+// Bounded multi-producer queue: each slot's sequence says whose turn it is.
+// A producer owns position pos once it moves m_head past it, and hands the
+// slot to the log thread by setting its sequence to pos + 1.
+ServerLog::Slot *ServerLog::claim(quint64 *pos)
+{
+    quint64 head = m_head.loadRelaxed();
+    for (;;) {
+        Slot *slot = &m_ring[head & (kRingCapacity - 1)];
+        const quint64 sequence = slot->sequence.loadAcquire();
+        const qint64 diff = qint64(sequence - head);
+        if (diff == 0) {
+            if (m_head.testAndSetRelaxed(head, head + 1, head)) {
+                *pos = head;
+                return slot;
+            }
+        } else if (diff < 0) {
+            return nullptr; // Full: the log thread hasn't freed this slot yet
+        } else {
+            head = m_head.loadRelaxed();
+        }
+    }
+}
+
+void ServerLog::publish(Slot *slot, quint64 pos)
+{
+    slot->sequence.storeRelease(pos + 1);
+}
+
+QList<ServerLog::Entry> ServerLog::drain()
+{
+    QList<Entry> entries;
+    while (entries.size() < kMaxBatchSize) {
+        Slot *slot = &m_ring[m_tail & (kRingCapacity - 1)];
+        if (slot->sequence.loadAcquire() != m_tail + 1) {
+            break; // Empty, or the producer hasn't finished writing it
+        }
+
+        Record &record = slot->record;
+        std::array<QString, MaxArguments> args;
+        for (int i = 0; i < record.argumentCount; ++i) {
+            args[i] = record.arguments[i].toString();
+            record.arguments[i] = QVariant(); // Don't keep the values alive
+        }
+
+        QString message = QString::fromUtf8(record.format);
+        switch (record.argumentCount) {
+        case 1:
+            message = message.arg(args[0]);
+            break;
+        case 2:
+            message = message.arg(args[0], args[1]);
+            break;
+        case 3:
+            message = message.arg(args[0], args[1], args[2]);
+            break;
+        case 4:
+            message = message.arg(args[0], args[1], args[2], args[3]);
+            break;
+        case 5:
+            message = message.arg(args[0], args[1], args[2], args[3], args[4]);
+            break;
+        case 6:
+            message = message.arg(args[0], args[1], args[2], args[3], args[4], args[5]);
+            break;
+        default:
+            break;
+        }
+
+        Entry entry;
+        entry.time = record.time;
+        entry.level = record.level;
+        entry.event = QString::fromLatin1(record.event);
+        entry.user = std::move(record.user);
+        entry.message = std::move(message);
+        entry.suppressed = record.suppressed;
+        entries.append(entry);
+
+        record.user = QString();
+        slot->sequence.storeRelease(m_tail + kRingCapacity);
+        ++m_tail;
+    }
+    return entries;
+}
+
+void ServerLog::run()
+{
+    for (;;) {
+        // Read the flag first so the final drain sees everything before it
+        const bool stopping = m_stopping.loadAcquire();
+
+        const QList<Entry> entries = drain();
+        if (!entries.isEmpty()) {
+            writeSinks(entries);
+            emit entriesLogged(entries);
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+
+        QMutexLocker locker(&m_wakeMutex);
+        if (!m_stopping.loadAcquire()) {
+            m_wake.wait(&m_wakeMutex, QDeadlineTimer(kIdleInterval));
+        }
+    }
+}
+
+void ServerLog::writeSinks(const QList<Entry> &entries)
+{
+    QMutexLocker locker(&m_sinkMutex);
+    if (!m_stdout && !m_file.isOpen()) {
+        return;
+    }
+
+    QByteArray text;
+    for (const Entry &entry : entries) {
+        text.append(formatEntry(entry, m_format).toUtf8()).append('\n');
+    }
+
+    if (m_stdout) {
+        std::fwrite(text.constData(), 1, text.size(), stdout);
+        std::fflush(stdout);
+    }
+    if (m_file.isOpen()) {
+        m_file.write(text);
+        m_file.flush();
+    }
+}
@@ -0,0 +1,204 @@
+#ifndef SERVERLOG_H
+#define SERVERLOG_H
+
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QDateTime>
+#include <QFile>
+#include <QList>
+#include <QMetaType>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QVariant>
+#include <QWaitCondition>
+#include <array>
+#include <memory>
+
+class QThread;
+
+// Leveled, structured server log with the formatting off the hot path.
+//
+// A record is an event name, the user it concerns (if any), a format string
+// and its arguments kept as QVariants. Producers on any thread claim a slot
+// in a bounded lock-free ring and store the raw values; the log thread turns
+// them into text and hands batches to the sinks (stdout, a file, and the
+// entriesLogged signal for a UI). A record below the current level costs one
+// atomic load. When the ring is full records are dropped and counted rather
+// than blocking the caller.
+//
+// Each event is limited to a number of records per second. The first record
+// let through in the next second carries how many were suppressed. Events
+// are told apart by the address of their name, so pass string literals.
+// Free text from info(), warning() and error() comes from many unrelated
+// places and is not limited, so one noisy source can't hide the others.
+class ServerLog : public QObject
+{
+    Q_OBJECT
+public:
+    enum Level { Debug, Info, Warning, Error };
+    enum Format {
+        Text,     // [time] LEVEL event user: message
+        JsonLines // One JSON object per line
+    };
+
+    struct Entry
+    {
+        qint64 time = 0; // ms since the epoch
+        Level level = Info;
+        QString event;
+        QString user; // Who the record is about; may be empty
+        QString message;
+        int suppressed = 0; // Records of this event rate limited just before
+    };
+
+    static constexpr int DefaultRateLimit = 50; // Records per event per second
+    static constexpr int MaxArguments = 6;
+
+    explicit ServerLog(QObject *parent = nullptr);
+    ~ServerLog() override;
+
+    void start();
+    void stop(); // Writes out everything logged so far, then joins the thread
+    bool isRunning() const;
+
+    void setLevel(Level level);
+    Level level() const;
+    bool isEnabled(Level level) const { return level >= m_level.loadRelaxed(); }
+    void setRateLimit(int perSecond); // 0 means unlimited
+    int rateLimit() const;
+    quint64 droppedRecords() const; // Lost to a full ring
+
+    // Sinks; may be changed while running
+    bool setFile(const QString &path); // Appends; an empty path closes the file
+    void setStdout(bool enabled);
+    void setFormat(Format format);
+
+    static const char *levelName(Level level);
+    static bool parseLevel(const QString &name, Level *level);
+    static QString formatEntry(const Entry &entry, Format format);
+
+    // Arguments replace %1, %2... of format when the record is written;
+    // pass values QVariant can hold (strings, numbers), not char arrays.
+    template<typename... Args>
+    void log(Level level,
+             const char *event,
+             const QString &user,
+             const char *format,
+             const Args &...args)
+    {
+        static_assert(sizeof...(Args) <= MaxArguments, "Too many log arguments");
+        if (!isEnabled(level)) {
+            return;
+        }
+
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        int suppressed = 0;
+        if (!admit(event, now, &suppressed)) {
+            return;
+        }
+        write(level, event, user, format, now, suppressed, args...);
+    }
+
+public slots:
+    // Already formatted text, e.g. from the logMessage signals; thread-safe,
+    // so connect with Qt::DirectConnection
+    void info(const QString &message);
+    void warning(const QString &message);
+    void error(const QString &message);
+
+signals:
+    // Emitted from the log thread, one batch per pass
+    void entriesLogged(const QList<ServerLog::Entry> &entries);
+
+private:
+    Q_DISABLE_COPY(ServerLog)
+
+    template<typename... Args>
+    void write(Level level,
+               const char *event,
+               const QString &user,
+               const char *format,
+               qint64 now,
+               int suppressed,
+               const Args &...args)
+    {
+        quint64 pos;
+        Slot *slot = claim(&pos);
+        if (!slot) {
+            m_dropped.fetchAndAddRelaxed(1);
+            return;
+        }
+
+        Record &record = slot->record;
+        record.time = now;
+        record.level = level;
+        record.event = event;
+        record.user = user;
+        record.format = format;
+        record.suppressed = suppressed;
+        record.argumentCount = sizeof...(Args);
+        int i = 0;
+        ((record.arguments[i++] = QVariant::fromValue(args)), ...);
+        Q_UNUSED(i)
+        publish(slot, pos);
+    }
+
+    void logText(Level level, const char *event, const QString &message);
+
+    struct Record
+    {
+        qint64 time = 0;
+        Level level = Info;
+        const char *event = nullptr;
+        QString user;
+        const char *format = nullptr;
+        int suppressed = 0;
+        int argumentCount = 0;
+        std::array<QVariant, MaxArguments> arguments;
+    };
+
+    struct Slot
+    {
+        QAtomicInteger<quint64> sequence;
+        Record record;
+    };
+
+    struct RateSlot
+    {
+        QAtomicPointer<const char> event;
+        QAtomicInteger<qint64> second;
+        QAtomicInt count;
+        QAtomicInt suppressed;
+    };
+
+    bool admit(const char *event, qint64 now, int *suppressed);
+    Slot *claim(quint64 *pos);
+    void publish(Slot *slot, quint64 pos);
+    void run();
+    QList<Entry> drain();
+    void writeSinks(const QList<Entry> &entries);
+
+    std::unique_ptr<Slot[]> m_ring;
+    QAtomicInteger<quint64> m_head; // Next position producers claim
+    quint64 m_tail;                 // Next position the log thread reads
+    QAtomicInteger<quint64> m_dropped;
+
+    QAtomicInt m_level;
+    QAtomicInt m_rateLimit;
+    std::array<RateSlot, 64> m_rates;
+
+    QThread *m_thread;
+    QAtomicInt m_stopping;
+    QMutex m_wakeMutex;
+    QWaitCondition m_wake;
+
+    QMutex m_sinkMutex; // Guards the sink settings below
+    QFile m_file;
+    bool m_stdout;
+    Format m_format;
+};
+
+Q_DECLARE_METATYPE(ServerLog::Entry)
+
+#endif // SERVERLOG_H
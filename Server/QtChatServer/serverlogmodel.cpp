@@ -0,0 +1,185 @@
+#include "serverlogmodel.h"
+#include <QColor>
+
+ServerLogModel::ServerLogModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , m_first(0)
+    , m_count(0)
+    , m_maxLines(DefaultMaxLines)
+{}
+
+int ServerLogModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_count;
+}
+
+QVariant ServerLogModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_count) {
+        return QVariant();
+    }
+
+    const ServerLog::Entry &entry = entryAt(index.row());
+    switch (role) {
+    case Qt::DisplayRole:
+        return formatLine(entry);
+    case Qt::ForegroundRole:
+        if (entry.level == ServerLog::Error) {
+            return QColor(Qt::red);
+        } else if (entry.level == ServerLog::Warning) {
+            return QColor(Qt::darkYellow);
+        } else if (entry.level == ServerLog::Debug) {
+            return QColor(Qt::gray);
+        }
+        break;
+    case LevelRole:
+        return entry.level;
+    case UserNameRole:
+        return entry.user;
+    case EventRole:
+        return entry.event;
+    default:
+        break;
+    }
+    return QVariant();
+}
+
+void ServerLogModel::append(const QList<ServerLog::Entry> &entries)
+{
+    if (entries.isEmpty()) {
+        return;
+    }
+
+    // A batch larger than the whole log only contributes its tail
+    const int skip = qMax(0, int(entries.size()) - m_maxLines);
+    const int added = int(entries.size()) - skip;
+    const int overflow = m_count + added - m_maxLines;
+    if (overflow > 0) {
+        dropFront(overflow);
+    }
+
+    beginInsertRows(QModelIndex(), m_count, m_count + added - 1);
+    for (int i = skip; i < entries.size(); ++i) {
+        const int pos = (m_first + m_count) % m_maxLines;
+        if (pos == m_ring.size()) {
+            m_ring.append(entries.at(i)); // Still growing towards m_maxLines
+        } else {
+            m_ring[pos] = entries.at(i);
+        }
+        ++m_count;
+    }
+    endInsertRows();
+}
+
+void ServerLogModel::clear()
+{
+    beginResetModel();
+    m_ring.clear();
+    m_first = 0;
+    m_count = 0;
+    endResetModel();
+}
+
+void ServerLogModel::setMaxLines(int maxLines)
+{
+    maxLines = qMax(1, maxLines);
+    if (maxLines == m_maxLines) {
+        return;
+    }
+
+    // Unwrap the ring, keeping the newest lines
+    beginResetModel();
+    QList<ServerLog::Entry> entries;
+    const int kept = qMin(m_count, maxLines);
+    entries.reserve(kept);
+    for (int row = m_count - kept; row < m_count; ++row) {
+        entries.append(entryAt(row));
+    }
+    m_ring = entries;
+    m_first = 0;
+    m_count = kept;
+    m_maxLines = maxLines;
+    endResetModel();
+}
+
+int ServerLogModel::maxLines() const
+{
+    return m_maxLines;
+}
+
+QString ServerLogModel::formatLine(const ServerLog::Entry &entry)
+{
+    QString line = QString("[%1] ").arg(
+        QDateTime::fromMSecsSinceEpoch(entry.time).toString("hh:mm:ss"));
+    if (entry.level >= ServerLog::Warning) {
+        line += QString(ServerLog::levelName(entry.level)).toUpper() + ": ";
+    }
+    line += entry.message;
+    if (entry.suppressed > 0) {
+        line += QString(" (%1 similar suppressed)").arg(entry.suppressed);
+    }
+    return line;
+}
+
+const ServerLog::Entry &ServerLogModel::entryAt(int row) const
+{
+    return m_ring.at((m_first + row) % m_maxLines);
+}
+
+void ServerLogModel::dropFront(int count)
+{
+    beginRemoveRows(QModelIndex(), 0, count - 1);
+    for (int row = 0; row < count; ++row) {
+        m_ring[(m_first + row) % m_maxLines] = ServerLog::Entry(); // Free the strings now
+    }
+    m_first = (m_first + count) % m_maxLines;
+    m_count -= count;
+    endRemoveRows();
+}
+
+ServerLogFilterModel::ServerLogFilterModel(QObject *parent)
+    : QSortFilterProxyModel(parent)
+    , m_minimumLevel(ServerLog::Debug)
+{}
+
+void ServerLogFilterModel::setMinimumLevel(ServerLog::Level level)
+{
+    if (level == m_minimumLevel) {
+        return;
+    }
+    m_minimumLevel = level;
+    invalidateFilter();
+}
+
+ServerLog::Level ServerLogFilterModel::minimumLevel() const
+{
+    return m_minimumLevel;
+}
+
+void ServerLogFilterModel::setUserFilter(const QString &text)
+{
+    if (text == m_userFilter) {
+        return;
+    }
+    m_userFilter = text;
+    invalidateFilter();
+}
+
+QString ServerLogFilterModel::userFilter() const
+{
+    return m_userFilter;
+}
+
+bool ServerLogFilterModel::filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const
+{
+    const QModelIndex index = sourceModel()->index(sourceRow, 0, sourceParent);
+    if (index.data(ServerLogModel::LevelRole).toInt() < m_minimumLevel) {
+        return false;
+    }
+    if (m_userFilter.isEmpty()) {
+        return true;
+    }
+    return index.data(ServerLogModel::UserNameRole)
+        .toString()
+        .contains(m_userFilter, Qt::CaseInsensitive);
+}
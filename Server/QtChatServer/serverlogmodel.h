@@ -0,0 +1,74 @@
+#ifndef SERVERLOGMODEL_H
+#define SERVERLOGMODEL_H
+
+#include <QAbstractListModel>
+#include <QList>
+#include <QSortFilterProxyModel>
+#include "serverlog.h"
+
+// The last maxLines log records, kept in a ring so that old lines fall off
+// the front as new ones arrive. Rows are only formatted when a view asks
+// for them, so a view shows a large backlog without laying it all out.
+class ServerLogModel : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    enum Roles {
+        LevelRole = Qt::UserRole + 1, // ServerLog::Level
+        UserNameRole,                 // Who the record is about; may be empty
+        EventRole
+    };
+
+    static constexpr int DefaultMaxLines = 10000;
+
+    explicit ServerLogModel(QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+    // One insert per batch; whatever no longer fits is removed from the front
+    void append(const QList<ServerLog::Entry> &entries);
+    void clear();
+
+    void setMaxLines(int maxLines);
+    int maxLines() const;
+
+    static QString formatLine(const ServerLog::Entry &entry);
+
+private:
+    Q_DISABLE_COPY(ServerLogModel)
+
+    const ServerLog::Entry &entryAt(int row) const;
+    void dropFront(int count);
+
+    // Grows to m_maxLines, then wraps; row 0 is at m_first
+    QList<ServerLog::Entry> m_ring;
+    int m_first;
+    int m_count;
+    int m_maxLines;
+};
+
+// Shows records at or above a severity, optionally only those about users
+// whose name contains a search string.
+class ServerLogFilterModel : public QSortFilterProxyModel
+{
+    Q_OBJECT
+public:
+    explicit ServerLogFilterModel(QObject *parent = nullptr);
+
+    void setMinimumLevel(ServerLog::Level level);
+    ServerLog::Level minimumLevel() const;
+    void setUserFilter(const QString &text);
+    QString userFilter() const;
+
+protected:
+    bool filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const override;
+
+private:
+    Q_DISABLE_COPY(ServerLogFilterModel)
+
+    ServerLog::Level m_minimumLevel;
+    QString m_userFilter;
+};
+
+#endif // SERVERLOGMODEL_H
@@ -0,0 +1,69 @@
+#include "serverstats.h"
+
+namespace {
+
+struct FrameTypeName
+{
+    const char *type;
+    ServerStats::FrameType frameType;
+};
+
+// Wire types of the protocol; anything else counts as OtherFrame
+const FrameTypeName kFrameTypes[] = {
+    {"chat", ServerStats::ChatFrame},
+    {"register", ServerStats::RegisterFrame},
+    {"request_history", ServerStats::HistoryRequestFrame},
+    {"history_chunk", ServerStats::HistoryFrame},
+    {"history_end", ServerStats::HistoryFrame},
+    {"chat_history", ServerStats::HistoryFrame},
+    {"user_list", ServerStats::UserListFrame},
+    {"presence_join", ServerStats::PresenceFrame},
+    {"presence_leave", ServerStats::PresenceFrame},
+    {"protocol", ServerStats::ProtocolFrame},
+    {"kick", ServerStats::KickFrame},
+    {"error", ServerStats::ErrorFrame},
+    {"ack", ServerStats::AckFrame},
+    {"sent", ServerStats::AckFrame},
+};
+
+} // namespace
+
+ServerStats::FrameType ServerStats::frameType(const QString &type)
+{
+    for (const auto &entry : kFrameTypes) {
+        if (type == QLatin1String(entry.type)) {
+            return entry.frameType;
+        }
+    }
+    return OtherFrame;
+}
+
+const char *ServerStats::frameTypeName(FrameType type)
+{
+    switch (type) {
+    case RegisterFrame:
+        return "register";
+    case ChatFrame:
+        return "chat";
+    case HistoryRequestFrame:
+        return "history_request";
+    case HistoryFrame:
+        return "history";
+    case UserListFrame:
+        return "user_list";
+    case PresenceFrame:
+        return "presence";
+    case ProtocolFrame:
+        return "protocol";
+    case KickFrame:
+        return "kick";
+    case ErrorFrame:
+        return "error";
+    case AckFrame:
+        return "ack";
+    case OtherFrame:
+    case FrameTypeCount:
+        break;
+    }
+    return "other";
+}
@@ -0,0 +1,153 @@
+#ifndef SERVERSTATS_H
+#define SERVERSTATS_H
+
+#include <QAtomicInteger>
+#include <QString>
+#include <array>
+#include <chrono>
+
+// Distribution of durations in fixed buckets. Recording is a handful of
+// relaxed atomic adds, so it can be called on every message.
+class LatencyHistogram
+{
+public:
+    // Upper bounds of the buckets in microseconds; one more bucket takes the rest
+    static constexpr std::array<quint64, 16> BucketBounds = {
+        10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+        1000000};
+    static constexpr int BucketCount = int(BucketBounds.size()) + 1;
+
+    void observe(qint64 nsecs)
+    {
+        const quint64 usecs = nsecs > 0 ? quint64(nsecs) / 1000 : 0;
+        int i = 0;
+        while (i < int(BucketBounds.size()) && usecs > BucketBounds[i]) {
+            ++i;
+        }
+        m_buckets[i].fetchAndAddRelaxed(1);
+        m_count.fetchAndAddRelaxed(1);
+        m_sumNsecs.fetchAndAddRelaxed(nsecs > 0 ? quint64(nsecs) : 0);
+    }
+
+    quint64 bucket(int i) const { return m_buckets[i].loadRelaxed(); } // Not cumulative
+    quint64 count() const { return m_count.loadRelaxed(); }
+    quint64 sumNsecs() const { return m_sumNsecs.loadRelaxed(); }
+
+private:
+    QAtomicInteger<quint64> m_buckets[BucketCount];
+    QAtomicInteger<quint64> m_count;
+    QAtomicInteger<quint64> m_sumNsecs;
+};
+
+// Server-wide counters, updated lock-free from the connection threads
+struct ServerStats
+{
+    // Protocol frames are counted per kind; related types share one kind
+    enum FrameType {
+        RegisterFrame,
+        ChatFrame,
+        HistoryRequestFrame,
+        HistoryFrame, // history_chunk, history_end and chat_history
+        UserListFrame,
+        PresenceFrame, // presence_join and presence_leave
+        ProtocolFrame,
+        KickFrame,
+        ErrorFrame,
+        AckFrame, // ack from clients and sent from the server
+        OtherFrame, // Unknown types and undecodable payloads
+        FrameTypeCount
+    };
+
+    static FrameType frameType(const QString &type);
+    static const char *frameTypeName(FrameType type);
+
+    // Monotonic clock shared by all threads, for latencies
+    static qint64 nsecsNow()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Plain copy of the counters at one point in time
+    struct Snapshot
+    {
+        quint64 framesWritten = 0;
+        quint64 writeBatches = 0;
+        quint64 bytesWritten = 0;
+        quint64 maxBatchFrames = 0;
+        qint64 queuedBytes = 0; // Output waiting in all connections right now
+        quint64 droppedFrames = 0;
+        quint64 slowConsumerDisconnects = 0;
+        quint64 pausedSenders = 0;
+
+        double averageBatchFrames() const
+        {
+            return writeBatches ? double(framesWritten) / double(writeBatches) : 0.0;
+        }
+    };
+
+    QAtomicInteger<quint64> framesWritten;
+    QAtomicInteger<quint64> writeBatches;
+    QAtomicInteger<quint64> bytesWritten;
+    QAtomicInteger<quint64> maxBatchFrames;
+    QAtomicInteger<qint64> queuedBytes;
+    QAtomicInteger<quint64> droppedFrames;
+    QAtomicInteger<quint64> slowConsumerDisconnects;
+    QAtomicInteger<quint64> pausedSenders;
+
+    QAtomicInteger<quint64> connectionsAccepted;
+    QAtomicInteger<qint64> connectionsOpen;
+    QAtomicInteger<quint64> registrations;
+    QAtomicInteger<quint64> registrationsRejected;
+
+    // Frames and their bytes on the wire, length prefix included. Outgoing
+    // frames are counted when queued, so frames dropped later are in here too.
+    QAtomicInteger<quint64> framesIn[FrameTypeCount];
+    QAtomicInteger<quint64> bytesIn[FrameTypeCount];
+    QAtomicInteger<quint64> framesOut[FrameTypeCount];
+    QAtomicInteger<quint64> bytesOut[FrameTypeCount];
+
+    LatencyHistogram routingLatency;      // Chat frame decoded to handed to the recipient
+    LatencyHistogram historyWriteLatency; // One store append, sync included
+    LatencyHistogram historyReadLatency;  // One page read from the store
+
+    void recordFrameIn(FrameType type, quint64 bytes)
+    {
+        framesIn[type].fetchAndAddRelaxed(1);
+        bytesIn[type].fetchAndAddRelaxed(bytes);
+    }
+
+    void recordFrameOut(FrameType type, quint64 bytes)
+    {
+        framesOut[type].fetchAndAddRelaxed(1);
+        bytesOut[type].fetchAndAddRelaxed(bytes);
+    }
+
+    void recordBatch(quint64 frames, quint64 bytes)
+    {
+        framesWritten.fetchAndAddRelaxed(frames);
+        writeBatches.fetchAndAddRelaxed(1);
+        bytesWritten.fetchAndAddRelaxed(bytes);
+
+        quint64 max = maxBatchFrames.loadRelaxed();
+        while (frames > max && !maxBatchFrames.testAndSetRelaxed(max, frames, max)) {
+        }
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        s.framesWritten = framesWritten.loadRelaxed();
+        s.writeBatches = writeBatches.loadRelaxed();
+        s.bytesWritten = bytesWritten.loadRelaxed();
+        s.maxBatchFrames = maxBatchFrames.loadRelaxed();
+        s.queuedBytes = queuedBytes.loadRelaxed();
+        s.droppedFrames = droppedFrames.loadRelaxed();
+        s.slowConsumerDisconnects = slowConsumerDisconnects.loadRelaxed();
+        s.pausedSenders = pausedSenders.loadRelaxed();
+        return s;
+    }
+};
+
+#endif // SERVERSTATS_H
@@ -1,22 +1,58 @@
 #include "serverwindow.h"
 #include <QCloseEvent>
+#include <QComboBox>
 #include <QGroupBox>
+#include <QHeaderView>
 #include <QHBoxLayout>
 #include <QLabel>
 #include <QLineEdit>
-#include <QListWidget>
+#include <QListView>
 #include <QMessageBox>
 #include <QPushButton>
+#include <QScrollBar>
+#include <QSortFilterProxyModel>
 #include <QSpinBox>
-#include <QTextEdit>
+#include <QTableView>
+#include <QTimer>
 #include <QVBoxLayout>
 #include "chatserver.h"
 #include "clientconnection.h"
+#include "clientlistmodel.h"
+#include "serverlogmodel.h"
+
+namespace {
+
+// The log view is refreshed at most this often, however fast records arrive
+const int kLogRefreshInterval = 200; // ms
+
+// How often the client list's traffic columns and count are brought up to date
+const int kClientRefreshInterval = 1000; // ms
+
+} // namespace
 
 ServerWindow::ServerWindow(QWidget *parent)
     : QMainWindow(parent)
     , m_server(new ChatServer(this))
+    , m_clientModel(new ClientListModel(m_server.data(), this))
+    , m_clientFilter(new QSortFilterProxyModel(this))
+    , m_clientRefreshTimer(new QTimer(this))
+    , m_logModel(new ServerLogModel(this))
+    , m_logFilter(new ServerLogFilterModel(this))
+    , m_logRefreshTimer(new QTimer(this))
 {
+    m_logFilter->setSourceModel(m_logModel);
+    m_logRefreshTimer->setSingleShot(true);
+    m_logRefreshTimer->setInterval(kLogRefreshInterval);
+    connect(m_logRefreshTimer, &QTimer::timeout, this, &ServerWindow::flushLog);
+
+    m_clientFilter->setSourceModel(m_clientModel);
+    m_clientFilter->setSortRole(ClientListModel::SortRole);
+    m_clientFilter->setFilterRole(ClientListModel::SearchRole);
+    m_clientFilter->setFilterKeyColumn(ClientListModel::UserColumn);
+    m_clientFilter->setFilterCaseSensitivity(Qt::CaseInsensitive);
+    m_clientRefreshTimer->setInterval(kClientRefreshInterval);
+    connect(m_clientRefreshTimer, &QTimer::timeout, this, &ServerWindow::refreshClientList);
+
     setupUi();
 
     connect(m_server.data(), &ChatServer::started, this, [this](quint16 port) {
@@ -34,8 +70,8 @@ ServerWindow::ServerWindow(QWidget *parent)
             &ChatServer::clientDisconnected,
             this,
             &ServerWindow::onClientDisconnected);
-    connect(m_server.data(), &ChatServer::messageReceived, this, &ServerWindow::onMessageReceived);
-    connect(m_server.data(), &ChatServer::logMessage, this, &ServerWindow::onLogMessage);
+    // Records arrive in batches from the log thread
+    connect(m_server->serverLog(), &ServerLog::entriesLogged, this, &ServerWindow::onLogEntries);
 
     updateServerState(false);
 }
@@ -80,8 +116,22 @@ void ServerWindow::setupUi()
     QGroupBox *clientGroup = new QGroupBox("Connected Clients", this);
     QVBoxLayout *clientLayout = new QVBoxLayout(clientGroup);
 
-    m_clientList = new QListWidget(this);
-    clientLayout->addWidget(m_clientList);
+    m_clientSearchEdit = new QLineEdit(this);
+    m_clientSearchEdit->setPlaceholderText("Search by user or address...");
+    m_clientSearchEdit->setClearButtonEnabled(true);
+    clientLayout->addWidget(m_clientSearchEdit);
+
+    m_clientView = new QTableView(this);
+    m_clientView->setModel(m_clientFilter);
+    m_clientView->setSortingEnabled(true);
+    m_clientView->sortByColumn(ClientListModel::UserColumn, Qt::AscendingOrder);
+    m_clientView->setSelectionBehavior(QAbstractItemView::SelectRows);
+    m_clientView->setSelectionMode(QAbstractItemView::SingleSelection);
+    m_clientView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_clientView->verticalHeader()->hide();
+    m_clientView->verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+    m_clientView->horizontalHeader()->setStretchLastSection(true);
+    clientLayout->addWidget(m_clientView);
 
     m_kickButton = new QPushButton("Kick Selected Client", this);
     clientLayout->addWidget(m_kickButton);
@@ -105,9 +155,44 @@ void ServerWindow::setupUi()
     QGroupBox *logGroup = new QGroupBox("Server Log", this);
     QVBoxLayout *logLayout = new QVBoxLayout(logGroup);
 
-    m_logEdit = new QTextEdit(this);
-    m_logEdit->setReadOnly(true);
-    logLayout->addWidget(m_logEdit);
+    QHBoxLayout *logOptionsLayout = new QHBoxLayout();
+    logOptionsLayout->addWidget(new QLabel("Record:", this));
+    m_logLevelCombo = new QComboBox(this);
+    m_logLevelCombo->addItem("Debug (every message)", ServerLog::Debug);
+    m_logLevelCombo->addItem("Info", ServerLog::Info);
+    m_logLevelCombo->addItem("Warning", ServerLog::Warning);
+    m_logLevelCombo->addItem("Error", ServerLog::Error);
+    m_logLevelCombo->setCurrentIndex(m_logLevelCombo->findData(m_server->serverLog()->level()));
+    logOptionsLayout->addWidget(m_logLevelCombo);
+
+    logOptionsLayout->addWidget(new QLabel("Show:", this));
+    m_logShowCombo = new QComboBox(this);
+    m_logShowCombo->addItem("All", ServerLog::Debug);
+    m_logShowCombo->addItem("Info and above", ServerLog::Info);
+    m_logShowCombo->addItem("Warnings and errors", ServerLog::Warning);
+    m_logShowCombo->addItem("Errors", ServerLog::Error);
+    logOptionsLayout->addWidget(m_logShowCombo);
+
+    m_logUserEdit = new QLineEdit(this);
+    m_logUserEdit->setPlaceholderText("Filter by user...");
+    m_logUserEdit->setClearButtonEnabled(true);
+    logOptionsLayout->addWidget(m_logUserEdit);
+
+    logOptionsLayout->addWidget(new QLabel("Keep lines:", this));
+    m_logMaxLinesSpin = new QSpinBox(this);
+    m_logMaxLinesSpin->setRange(100, 1000000);
+    m_logMaxLinesSpin->setSingleStep(1000);
+    m_logMaxLinesSpin->setValue(m_logModel->maxLines());
+    logOptionsLayout->addWidget(m_logMaxLinesSpin);
+    logLayout->addLayout(logOptionsLayout);
+
+    // Only the visible rows are formatted and laid out
+    m_logView = new QListView(this);
+    m_logView->setModel(m_logFilter);
+    m_logView->setUniformItemSizes(true);
+    m_logView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_logView->setSelectionMode(QAbstractItemView::ExtendedSelection);
+    logLayout->addWidget(m_logView);
 
     mainLayout->addWidget(logGroup);
 
@@ -116,11 +201,24 @@ void ServerWindow::setupUi()
     connect(m_stopButton, &QPushButton::clicked, this, &ServerWindow::onStopClicked);
     connect(m_broadcastButton, &QPushButton::clicked, this, &ServerWindow::onBroadcastClicked);
     connect(m_kickButton, &QPushButton::clicked, this, &ServerWindow::onKickClicked);
-    connect(m_clientList,
-            &QListWidget::itemDoubleClicked,
-            this,
-            &ServerWindow::onClientItemDoubleClicked);
+    connect(m_clientView, &QTableView::doubleClicked, this, &ServerWindow::onClientDoubleClicked);
+    connect(m_clientSearchEdit,
+            &QLineEdit::textChanged,
+            m_clientFilter,
+            &QSortFilterProxyModel::setFilterFixedString);
     connect(m_broadcastEdit, &QLineEdit::returnPressed, this, &ServerWindow::onBroadcastClicked);
+    connect(m_logLevelCombo,
+            &QComboBox::currentIndexChanged,
+            this,
+            &ServerWindow::onLogLevelChanged);
+    connect(m_logShowCombo,
+            &QComboBox::currentIndexChanged,
+            this,
+            &ServerWindow::onLogFilterChanged);
+    connect(m_logUserEdit, &QLineEdit::textChanged, this, &ServerWindow::onLogFilterChanged);
+    connect(m_logMaxLinesSpin, &QSpinBox::valueChanged, this, [this](int maxLines) {
+        m_logModel->setMaxLines(maxLines);
+    });
 }
 
 void ServerWindow::closeEvent(QCloseEvent *event)
@@ -153,7 +251,6 @@ void ServerWindow::onStartClicked()
 void ServerWindow::onStopClicked()
 {
     m_server->stopServer();
-    m_clientList->clear();
 }
 
 void ServerWindow::onBroadcastClicked()
@@ -170,14 +267,15 @@ void ServerWindow::onBroadcastClicked()
 
 void ServerWindow::onKickClicked()
 {
-    QListWidgetItem *item = m_clientList->currentItem();
-    if (!item) {
+    const QModelIndex current = m_clientView->currentIndex();
+    if (!current.isValid()) {
         QMessageBox::information(this, "No Selection", "Please select a client to kick");
         return;
     }
 
-    QString username = item->data(Qt::UserRole).toString(); // Get stored username
-    QString displayText = item->text();                     // Get display text with IP:Port
+    QString username = current.data(ClientListModel::UserNameRole).toString();
+    QString address = current.siblingAtColumn(ClientListModel::AddressColumn).data().toString();
+    QString displayText = QString("%1 (%2)").arg(username, address);
 
     auto reply
         = QMessageBox::question(this,
@@ -191,9 +289,9 @@ void ServerWindow::onKickClicked()
     }
 }
 
-void ServerWindow::onClientItemDoubleClicked(QListWidgetItem *item)
+void ServerWindow::onClientDoubleClicked(const QModelIndex &index)
 {
-    QString username = item->data(Qt::UserRole).toString();
+    QString username = index.data(ClientListModel::UserNameRole).toString();
     ClientConnection *conn = m_server->getClientConnection(username);
 
     if (conn) {
@@ -215,51 +313,71 @@ void ServerWindow::onClientItemDoubleClicked(QListWidgetItem *item)
 
 void ServerWindow::onClientConnected(const QString &username)
 {
-    updateClientList();
+    m_clientModel->addClient(username);
     appendLog(QString("Client connected: %1").arg(username));
 }
 
 void ServerWindow::onClientDisconnected(const QString &username)
 {
-    updateClientList();
+    m_clientModel->removeClient(username);
     appendLog(QString("Client disconnected: %1").arg(username));
 }
 
-void ServerWindow::onMessageReceived(const QString &from, const QString &to, const QString &text)
+void ServerWindow::onLogEntries(const QList<ServerLog::Entry> &entries)
 {
-    // Show message content with length
-    QString preview = text.length() > 50 ? text.left(47) + "..." : text;
-    appendLog(
-        QString("Message [%1 → %2]: %3 (%4 chars)").arg(from).arg(to).arg(preview).arg(text.length()));
-}
+    m_pendingLog.append(entries);
 
-void ServerWindow::onLogMessage(const QString &msg)
-{
-    appendLog(msg);
+    // Lines the model would drop anyway are not worth keeping until the refresh
+    const qsizetype excess = m_pendingLog.size() - m_logModel->maxLines();
+    if (excess > 0) {
+        m_pendingLog.remove(0, excess);
+    }
+
+    if (!m_logRefreshTimer->isActive()) {
+        m_logRefreshTimer->start();
+    }
 }
 
-void ServerWindow::updateClientList()
+void ServerWindow::flushLog()
 {
-    m_clientList->clear();
-    QMap<QString, QString> clients = m_server->clientListWithInfo();
+    if (m_pendingLog.isEmpty()) {
+        return;
+    }
 
-    for (auto it = clients.constBegin(); it != clients.constEnd(); ++it) {
-        QString username = it.key();
-        QString peerInfo = it.value();
-        QString displayText = QString("%1 (%2)").arg(username).arg(peerInfo);
+    // Follow new lines only if the user hasn't scrolled up to read
+    QScrollBar *scrollBar = m_logView->verticalScrollBar();
+    const bool atBottom = scrollBar->value() == scrollBar->maximum();
 
-        QListWidgetItem *item = new QListWidgetItem(displayText);
-        item->setData(Qt::UserRole, username); // Store username for kick functionality
-        m_clientList->addItem(item);
+    m_logModel->append(m_pendingLog);
+    m_pendingLog.clear();
+
+    if (atBottom) {
+        m_logView->scrollToBottom();
     }
+}
+
+void ServerWindow::onLogLevelChanged(int index)
+{
+    m_server->serverLog()->setLevel(ServerLog::Level(m_logLevelCombo->itemData(index).toInt()));
+}
+
+void ServerWindow::onLogFilterChanged()
+{
+    m_logFilter->setMinimumLevel(ServerLog::Level(m_logShowCombo->currentData().toInt()));
+    m_logFilter->setUserFilter(m_logUserEdit->text().trimmed());
+}
 
-    m_statusLabel->setText(QString("Status: Running - %1 client(s) connected").arg(clients.size()));
+void ServerWindow::refreshClientList()
+{
+    m_clientModel->refreshTraffic();
+    m_statusLabel->setText(
+        QString("Status: Running - %1 client(s) connected").arg(m_clientModel->rowCount()));
 }
 
 void ServerWindow::appendLog(const QString &msg)
 {
-    QString time = QDateTime::currentDateTime().toString("hh:mm:ss");
-    m_logEdit->append(QString("[%1] %2").arg(time).arg(msg));
+    // Through the server log so window events are ordered with the rest
+    m_server->serverLog()->info(msg);
 }
 
 void ServerWindow::updateServerState(bool running)
@@ -274,9 +392,11 @@ void ServerWindow::updateServerState(bool running)
     if (running) {
         m_statusLabel->setText("Status: Running - 0 client(s) connected");
         m_statusLabel->setStyleSheet("font-weight: bold; color: green;");
+        m_clientRefreshTimer->start();
     } else {
         m_statusLabel->setText("Status: Stopped");
         m_statusLabel->setStyleSheet("font-weight: bold; color: red;");
-        m_clientList->clear();
+        m_clientRefreshTimer->stop();
+        m_clientModel->clear(); // The server dropped its clients without a disconnect each
     }
 }
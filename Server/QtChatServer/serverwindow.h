@@ -3,16 +3,23 @@
 
 #include <QMainWindow>
 #include <QScopedPointer>
+#include "serverlog.h"
 
 // Forward declarations
-class QTextEdit;
-class QListWidget;
+class QComboBox;
+class QListView;
+class QModelIndex;
+class QSortFilterProxyModel;
+class QTableView;
 class QPushButton;
 class QLineEdit;
 class QSpinBox;
 class QLabel;
-class QListWidgetItem;
+class QTimer;
 class ChatServer;
+class ClientListModel;
+class ServerLogFilterModel;
+class ServerLogModel;
 
 class ServerWindow : public QMainWindow
 {
@@ -29,16 +36,18 @@ private slots:
     void onStopClicked();
     void onBroadcastClicked();
     void onKickClicked();
-    void onClientItemDoubleClicked(QListWidgetItem *item);
+    void onClientDoubleClicked(const QModelIndex &index);
     void onClientConnected(const QString &username);
     void onClientDisconnected(const QString &username);
-    void onMessageReceived(const QString &from, const QString &to, const QString &text);
-    void onLogMessage(const QString &msg);
+    void onLogEntries(const QList<ServerLog::Entry> &entries);
+    void onLogLevelChanged(int index);
+    void onLogFilterChanged();
+    void flushLog();
 
 private:
     void setupUi();
     void appendLog(const QString &msg);
-    void updateClientList();
+    void refreshClientList();
     void updateServerState(bool running);
 
     QScopedPointer<ChatServer> m_server;
@@ -49,13 +58,27 @@ private:
     QPushButton *m_stopButton;
     QLabel *m_statusLabel;
 
-    QListWidget *m_clientList;
+    QLineEdit *m_clientSearchEdit;
+    QTableView *m_clientView;
+    ClientListModel *m_clientModel;
+    QSortFilterProxyModel *m_clientFilter;
+    QTimer *m_clientRefreshTimer; // Traffic columns and the client count
     QPushButton *m_kickButton;
 
     QLineEdit *m_broadcastEdit;
     QPushButton *m_broadcastButton;
 
-    QTextEdit *m_logEdit;
+    QComboBox *m_logLevelCombo;
+    QComboBox *m_logShowCombo;
+    QLineEdit *m_logUserEdit;
+    QSpinBox *m_logMaxLinesSpin;
+    QListView *m_logView;
+
+    // Records wait here for the refresh timer and reach the model in one batch
+    ServerLogModel *m_logModel;
+    ServerLogFilterModel *m_logFilter;
+    QList<ServerLog::Entry> m_pendingLog;
+    QTimer *m_logRefreshTimer;
 };
 
 #endif // SERVERWINDOW_H
@@ -0,0 +1,256 @@
+#include "sqlitehistorystore.h"
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSqlError>
+#include <QVariant>
+
+SqliteHistoryStore::SqliteHistoryStore(const QString &databasePath)
+    : m_databasePath(databasePath)
+    , m_connectionName(QString("ChatHistory-%1").arg(quintptr(this), 0, 16))
+    , m_synchronousFull(false)
+{}
+
+SqliteHistoryStore::~SqliteHistoryStore()
+{
+    close();
+}
+
+bool SqliteHistoryStore::open()
+{
+    if (m_db.isOpen()) {
+        return true;
+    }
+
+    QDir().mkpath(QFileInfo(m_databasePath).absolutePath());
+
+    m_db = QSqlDatabase::addDatabase("QSQLITE", m_connectionName);
+    m_db.setDatabaseName(m_databasePath);
+    if (!m_db.open()) {
+        qWarning() << "Failed to open history database:" << m_databasePath
+                   << m_db.lastError().text();
+        close();
+        return false;
+    }
+
+    // WAL lets page reads proceed while a batch is being committed.
+    // synchronous=NORMAL skips the fsync per commit; setSynchronous()
+    // switches to FULL for writes that must be durable.
+    const bool ok = exec("PRAGMA journal_mode=WAL") && exec("PRAGMA synchronous=NORMAL")
+                    && exec("CREATE TABLE IF NOT EXISTS conversations ("
+                            " id INTEGER PRIMARY KEY,"
+                            " name TEXT NOT NULL UNIQUE,"
+                            " message_count INTEGER NOT NULL DEFAULT 0)")
+                    && exec("CREATE TABLE IF NOT EXISTS messages ("
+                            " conversation INTEGER NOT NULL,"
+                            " seq INTEGER NOT NULL,"
+                            " sender TEXT NOT NULL,"
+                            " recipient TEXT NOT NULL,"
+                            " body TEXT NOT NULL,"
+                            " type INTEGER NOT NULL,"
+                            " timestamp INTEGER NOT NULL,"
+                            " message_id INTEGER NOT NULL DEFAULT 0,"
+                            " PRIMARY KEY (conversation, seq)) WITHOUT ROWID")
+                    && addColumn("messages", "message_id", "INTEGER NOT NULL DEFAULT 0")
+                    && exec("CREATE INDEX IF NOT EXISTS messages_by_time"
+                            " ON messages (conversation, timestamp)");
+    m_synchronousFull = false;
+
+    const bool prepared
+        = ok
+          && prepare(m_findConversation,
+                     "SELECT id, message_count FROM conversations WHERE name = ?")
+          && prepare(m_insertConversation, "INSERT INTO conversations (name) VALUES (?)")
+          && prepare(m_updateCount, "UPDATE conversations SET message_count = ? WHERE id = ?")
+          && prepare(m_insertMessage,
+                     "INSERT INTO messages (conversation, seq, sender, recipient, body, type,"
+                     " timestamp, message_id) VALUES (?, ?, ?, ?, ?, ?, ?, ?)")
+          && prepare(m_selectRange,
+                     "SELECT sender, recipient, body, type, timestamp, message_id FROM messages"
+                     " WHERE conversation = ? AND seq >= ? AND seq < ? ORDER BY seq");
+    if (!prepared) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SqliteHistoryStore::close()
+{
+    // Queries must be gone before the connection can be removed
+    m_findConversation = QSqlQuery();
+    m_insertConversation = QSqlQuery();
+    m_updateCount = QSqlQuery();
+    m_insertMessage = QSqlQuery();
+    m_selectRange = QSqlQuery();
+    m_conversations.clear();
+
+    if (m_db.isValid()) {
+        m_db.close();
+        m_db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(m_connectionName);
+    }
+}
+
+bool SqliteHistoryStore::append(const QString &conversationId,
+                                const QList<ChatMessage> &messages,
+                                bool sync)
+{
+    if (!m_db.isOpen() || !setSynchronous(sync) || !m_db.transaction()) {
+        return false;
+    }
+
+    Conversation conv = conversation(conversationId, true);
+    bool ok = conv.id >= 0;
+
+    for (qsizetype i = 0; ok && i < messages.size(); ++i) {
+        const ChatMessage &msg = messages.at(i);
+        m_insertMessage.bindValue(0, conv.id);
+        m_insertMessage.bindValue(1, conv.messageCount + i);
+        m_insertMessage.bindValue(2, msg.from());
+        m_insertMessage.bindValue(3, msg.to());
+        m_insertMessage.bindValue(4, msg.text());
+        m_insertMessage.bindValue(5, static_cast<int>(msg.type()));
+        m_insertMessage.bindValue(6, msg.timestamp().toMSecsSinceEpoch());
+        m_insertMessage.bindValue(7, static_cast<qint64>(msg.id()));
+        ok = m_insertMessage.exec();
+    }
+
+    if (ok) {
+        m_updateCount.bindValue(0, conv.messageCount + messages.size());
+        m_updateCount.bindValue(1, conv.id);
+        ok = m_updateCount.exec();
+    }
+
+    if (!ok || !m_db.commit()) {
+        qWarning() << "Failed to append to history database:"
+                   << m_insertMessage.lastError().text() << m_db.lastError().text();
+        m_db.rollback();
+        m_conversations.remove(conversationId); // Re-read the count next time
+        return false;
+    }
+
+    m_conversations[conversationId].messageCount += messages.size();
+    return true;
+}
+
+QList<ChatMessage> SqliteHistoryStore::range(const QString &conversationId,
+                                             qint64 first,
+                                             qint64 count)
+{
+    QList<ChatMessage> messages;
+    const Conversation conv = conversation(conversationId, false);
+    if (conv.id < 0 || count <= 0) {
+        return messages;
+    }
+
+    m_selectRange.bindValue(0, conv.id);
+    m_selectRange.bindValue(1, first);
+    m_selectRange.bindValue(2, first + count);
+    if (!m_selectRange.exec()) {
+        qWarning() << "Failed to read history database:" << m_selectRange.lastError().text();
+        return messages;
+    }
+
+    messages.reserve(qMin(count, conv.messageCount));
+    while (m_selectRange.next()) {
+        ChatMessage msg(m_selectRange.value(0).toString(),
+                        m_selectRange.value(1).toString(),
+                        m_selectRange.value(2).toString(),
+                        static_cast<ChatMessage::MessageType>(m_selectRange.value(3).toInt()),
+                        QDateTime::fromMSecsSinceEpoch(m_selectRange.value(4).toLongLong()));
+        msg.setId(static_cast<quint64>(m_selectRange.value(5).toLongLong()));
+        messages.append(msg);
+    }
+    m_selectRange.finish();
+    return messages;
+}
+
+qint64 SqliteHistoryStore::count(const QString &conversationId)
+{
+    return conversation(conversationId, false).messageCount;
+}
+
+SqliteHistoryStore::Conversation SqliteHistoryStore::conversation(const QString &conversationId,
+                                                                  bool create)
+{
+    auto it = m_conversations.constFind(conversationId);
+    if (it != m_conversations.constEnd()) {
+        return it.value();
+    }
+
+    Conversation conv;
+    if (!m_db.isOpen()) {
+        return conv;
+    }
+
+    m_findConversation.bindValue(0, conversationId);
+    if (m_findConversation.exec() && m_findConversation.next()) {
+        conv.id = m_findConversation.value(0).toLongLong();
+        conv.messageCount = m_findConversation.value(1).toLongLong();
+    }
+    m_findConversation.finish();
+
+    if (conv.id < 0 && create) {
+        m_insertConversation.bindValue(0, conversationId);
+        if (m_insertConversation.exec()) {
+            conv.id = m_insertConversation.lastInsertId().toLongLong();
+        }
+    }
+
+    if (conv.id >= 0) {
+        m_conversations.insert(conversationId, conv);
+    }
+    return conv;
+}
+
+bool SqliteHistoryStore::exec(const QString &statement)
+{
+    QSqlQuery query(m_db);
+    if (!query.exec(statement)) {
+        qWarning() << "History database statement failed:" << statement
+                   << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+// Adds a column to a table created by an older version
+bool SqliteHistoryStore::addColumn(const QString &table,
+                                   const QString &column,
+                                   const QString &definition)
+{
+    QSqlQuery query(m_db);
+    if (!query.exec(QString("PRAGMA table_info(%1)").arg(table))) {
+        return false;
+    }
+    while (query.next()) {
+        if (query.value(1).toString() == column) {
+            return true;
+        }
+    }
+    return exec(QString("ALTER TABLE %1 ADD COLUMN %2 %3").arg(table, column, definition));
+}
+
+bool SqliteHistoryStore::prepare(QSqlQuery &query, const QString &statement)
+{
+    query = QSqlQuery(m_db);
+    if (!query.prepare(statement)) {
+        qWarning() << "Failed to prepare history statement:" << statement
+                   << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool SqliteHistoryStore::setSynchronous(bool full)
+{
+    if (full == m_synchronousFull) {
+        return true;
+    }
+    if (!exec(full ? "PRAGMA synchronous=FULL" : "PRAGMA synchronous=NORMAL")) {
+        return false;
+    }
+    m_synchronousFull = full;
+    return true;
+}
@@ -0,0 +1,62 @@
+#ifndef SQLITEHISTORYSTORE_H
+#define SQLITEHISTORYSTORE_H
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include "historystore.h"
+
+// All conversations in one SQLite database, which scales to millions of
+// messages without a file per pair of users.
+//
+// Messages are clustered by (conversation, seq), where seq is the message's
+// position in its conversation, so a page is one index range scan. A second
+// index on (conversation, timestamp) serves time-based lookups. Each row also
+// keeps the server-wide message id (0 for messages stored before ids). The
+// database runs in WAL mode; every statement is prepared once in open().
+class SqliteHistoryStore : public HistoryStore
+{
+public:
+    explicit SqliteHistoryStore(const QString &databasePath);
+    ~SqliteHistoryStore() override;
+
+    bool open() override;
+    void close() override;
+    bool append(const QString &conversationId,
+                const QList<ChatMessage> &messages,
+                bool sync) override;
+    QList<ChatMessage> range(const QString &conversationId, qint64 first, qint64 count) override;
+    qint64 count(const QString &conversationId) override;
+
+private:
+    Q_DISABLE_COPY(SqliteHistoryStore)
+
+    struct Conversation
+    {
+        qint64 id = -1;
+        qint64 messageCount = 0;
+    };
+
+    // Looks the conversation up, creating its row if create is set.
+    // Returns an id of -1 if it doesn't exist or on error.
+    Conversation conversation(const QString &conversationId, bool create);
+    bool exec(const QString &statement);
+    bool addColumn(const QString &table, const QString &column, const QString &definition);
+    bool prepare(QSqlQuery &query, const QString &statement);
+    bool setSynchronous(bool full);
+
+    QString m_databasePath;
+    QString m_connectionName;
+    QSqlDatabase m_db;
+    bool m_synchronousFull;
+
+    QSqlQuery m_findConversation;
+    QSqlQuery m_insertConversation;
+    QSqlQuery m_updateCount;
+    QSqlQuery m_insertMessage;
+    QSqlQuery m_selectRange;
+
+    QHash<QString, Conversation> m_conversations; // Known rows and their counts
+};
+
+#endif // SQLITEHISTORYSTORE_H
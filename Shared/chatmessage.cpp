@@ -1,11 +1,14 @@
 #include "chatmessage.h"
+#include <QCborStreamReader>
+#include <QCborStreamWriter>
 #include <QDebug>
 #include <QFile>
 #include <QJsonArray>
 #include <QJsonDocument>
 
 ChatMessage::ChatMessage()
-    : m_type(Private)
+    : m_id(0)
+    , m_type(Private)
 {}
 
 ChatMessage::ChatMessage(const QString &from,
@@ -13,13 +16,19 @@ ChatMessage::ChatMessage(const QString &from,
                          const QString &text,
                          MessageType type,
                          const QDateTime &timestamp)
-    : m_from(from)
+    : m_id(0)
+    , m_from(from)
     , m_to(to)
     , m_text(text)
     , m_timestamp(timestamp)
     , m_type(type)
 {}
 
+quint64 ChatMessage::id() const
+{
+    return m_id;
+}
+
 QString ChatMessage::from() const
 {
     return m_from;
@@ -45,6 +54,11 @@ ChatMessage::MessageType ChatMessage::type() const
     return m_type;
 }
 
+void ChatMessage::setId(quint64 id)
+{
+    m_id = id;
+}
+
 void ChatMessage::setFrom(const QString &from)
 {
     m_from = from;
@@ -78,20 +92,124 @@ QJsonObject ChatMessage::toJson() const
     obj["text"] = m_text;
     obj["timestamp"] = m_timestamp.toString(Qt::ISODate);
     obj["messageType"] = static_cast<int>(m_type); // Changed key to avoid confusion
+    if (m_id != 0) {
+        obj["id"] = static_cast<qint64>(m_id);
+    }
     return obj;
 }
 
 ChatMessage ChatMessage::fromJson(const QJsonObject &obj)
 {
     ChatMessage msg;
+    msg.m_id = static_cast<quint64>(obj["id"].toInteger(0));
     msg.m_from = obj["from"].toString();
     msg.m_to = obj["to"].toString();
     msg.m_text = obj["text"].toString();
-    msg.m_timestamp = QDateTime::fromString(obj["timestamp"].toString(), Qt::ISODate);
+    const QJsonValue timestamp = obj["timestamp"];
+    msg.m_timestamp = timestamp.isDouble()
+                          ? QDateTime::fromMSecsSinceEpoch(timestamp.toInteger())
+                          : QDateTime::fromString(timestamp.toString(), Qt::ISODate);
     msg.m_type = static_cast<MessageType>(obj["messageType"].toInt(Private)); // Match the key
     return msg;
 }
 
+void ChatMessage::writeCbor(QCborStreamWriter &writer) const
+{
+    writer.startArray(6);
+    writer.append(QStringView(m_from));
+    writer.append(QStringView(m_to));
+    writer.append(QStringView(m_text));
+    if (m_timestamp.isValid()) {
+        writer.append(m_timestamp.toMSecsSinceEpoch());
+    } else {
+        writer.appendNull();
+    }
+    writer.append(static_cast<qint64>(m_type));
+    writer.append(m_id);
+    writer.endArray();
+}
+
+namespace {
+
+// Message fields are scalars; a container found in one is skipped only up
+// to this depth, so a hostile frame can't drive the skip into deep recursion
+const int kMaxSkipDepth = 16;
+
+// Reads a text string that may come in chunks; anything else is skipped
+QString readCborText(QCborStreamReader &reader)
+{
+    if (!reader.isString()) {
+        reader.next(kMaxSkipDepth);
+        return QString();
+    }
+
+    QString text;
+    auto chunk = reader.readString();
+    while (chunk.status == QCborStreamReader::Ok) {
+        text += chunk.data;
+        chunk = reader.readString();
+    }
+    return text;
+}
+
+qint64 readCborInteger(QCborStreamReader &reader, qint64 fallback)
+{
+    const qint64 value = reader.isInteger() ? reader.toInteger() : fallback;
+    reader.next(kMaxSkipDepth);
+    return value;
+}
+
+} // namespace
+
+ChatMessage ChatMessage::readCbor(QCborStreamReader &reader, bool *ok)
+{
+    ChatMessage msg;
+    if (!reader.isArray() || !reader.enterContainer()) {
+        reader.next(kMaxSkipDepth);
+        if (ok) {
+            *ok = false;
+        }
+        return msg;
+    }
+
+    // Fields a newer peer appends are skipped
+    for (int field = 0; reader.hasNext() && reader.lastError() == QCborError::NoError; ++field) {
+        switch (field) {
+        case 0:
+            msg.m_from = readCborText(reader);
+            break;
+        case 1:
+            msg.m_to = readCborText(reader);
+            break;
+        case 2:
+            msg.m_text = readCborText(reader);
+            break;
+        case 3:
+            if (reader.isInteger()) {
+                msg.m_timestamp = QDateTime::fromMSecsSinceEpoch(readCborInteger(reader, 0));
+            } else {
+                reader.next(kMaxSkipDepth); // null: no timestamp
+            }
+            break;
+        case 4:
+            msg.m_type = static_cast<MessageType>(readCborInteger(reader, Private));
+            break;
+        case 5:
+            msg.m_id = static_cast<quint64>(readCborInteger(reader, 0));
+            break;
+        default:
+            reader.next(kMaxSkipDepth);
+            break;
+        }
+    }
+    reader.leaveContainer();
+
+    if (ok) {
+        *ok = reader.lastError() == QCborError::NoError;
+    }
+    return msg;
+}
+
 bool ChatMessage::saveMessages(const QList<ChatMessage> &messages, const QString &filePath)
 {
     QJsonArray arr;
@@ -152,6 +270,9 @@ QDataStream &operator>>(QDataStream &in, ChatMessage &m)
 
 bool ChatMessage::operator==(const ChatMessage &other) const
 {
+    if (m_id != 0 && other.m_id != 0) {
+        return m_id == other.m_id;
+    }
     return m_from == other.m_from && m_to == other.m_to && m_text == other.m_text
            && m_timestamp == other.m_timestamp && m_type == other.m_type;
 }
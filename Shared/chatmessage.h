@@ -7,6 +7,9 @@
 #include <QList>
 #include <QString>
 
+class QCborStreamReader;
+class QCborStreamWriter;
+
 class ChatMessage
 {
 public:
@@ -24,6 +27,7 @@ public:
                 const QDateTime &timestamp = QDateTime::currentDateTime());
 
     // Accessors
+    quint64 id() const; // Assigned by the server when it routes the message, 0 before
     QString from() const;
     QString to() const;
     QString text() const;
@@ -31,16 +35,23 @@ public:
     MessageType type() const;
 
     // Mutators
+    void setId(quint64 id);
     void setFrom(const QString &from);
     void setTo(const QString &to);
     void setText(const QString &text);
     void setTimestamp(const QDateTime &timestamp);
     void setType(MessageType type);
 
-    // JSON serialization
+    // JSON serialization. fromJson() also takes the timestamp as
+    // milliseconds since the epoch, as CBOR frames carry it.
     QJsonObject toJson() const;
     static ChatMessage fromJson(const QJsonObject &obj);
 
+    // CBOR frames: a positional array [from, to, text, timestamp in ms since
+    // the epoch, type, id], written and read without an intermediate object
+    void writeCbor(QCborStreamWriter &writer) const;
+    static ChatMessage readCbor(QCborStreamReader &reader, bool *ok = nullptr);
+
     // Local chat history persistence
     static bool saveMessages(const QList<ChatMessage> &messages, const QString &filePath);
     static QList<ChatMessage> loadMessages(const QString &filePath);
@@ -49,12 +60,15 @@ public:
     friend QDataStream &operator<<(QDataStream &out, const ChatMessage &m);
     friend QDataStream &operator>>(QDataStream &in, ChatMessage &m);
 
+    // Two messages with ids are equal when their ids are; others compare
+    // field by field
     bool operator==(const ChatMessage &other) const;
 
     // Helper: get conversation ID for history grouping
     static QString conversationId(const QString &user1, const QString &user2);
 
 private:
+    quint64 m_id;
     QString m_from;
     QString m_to;
     QString m_text;
@@ -0,0 +1,589 @@
+#include "framecodec.h"
+#include <QCborStreamReader>
+#include <QCborStreamWriter>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QtEndian>
+#include <cmath>
+
+namespace {
+
+const qsizetype kHeaderSize = sizeof(quint32);
+
+// Below this many consumed bytes compaction is never worth the memmove
+const qsizetype kCompactThreshold = 64 * 1024;
+
+// CBOR key of a chat frame's message
+const quint64 kChatMessageKey = 0;
+
+// Frames nested deeper than this are rejected rather than decoded
+// recursively; the protocol itself needs four levels
+const int kMaxCborDepth = 64;
+
+// Protocol keys written as integers in CBOR frames: the key is the index
+// plus one. Only ever append to this list, peers rely on the numbers.
+const char *const kCborKeys[] = {
+    "type",     "from",      "to",       "text",     "timestamp", "messageType", "id",
+    "messages", "with",      "start",    "end",      "has_more",  "before",      "after",
+    "limit",    "chunks",    "users",    "cid",      "message",   "reason",      "encoding",
+    "username", "encodings", "features", "delivered", "read",
+};
+const quint64 kCborKeyCount = sizeof(kCborKeys) / sizeof(kCborKeys[0]);
+
+quint64 cborKey(const QString &name)
+{
+    static const QHash<QString, quint64> keys = [] {
+        QHash<QString, quint64> keys;
+        for (quint64 i = 0; i < kCborKeyCount; ++i) {
+            keys.insert(QString::fromLatin1(kCborKeys[i]), i + 1);
+        }
+        return keys;
+    }();
+    return keys.value(name, 0);
+}
+
+void writeCborKey(QCborStreamWriter &writer, const QString &name)
+{
+    const quint64 key = cborKey(name);
+    if (key != 0) {
+        writer.append(key);
+    } else {
+        writer.append(QStringView(name));
+    }
+}
+
+void writeCborValue(QCborStreamWriter &writer, const QJsonValue &value);
+
+void writeCborObject(QCborStreamWriter &writer, const QJsonObject &obj)
+{
+    writer.startMap(quint64(obj.size()));
+    for (auto it = obj.constBegin(); it != obj.constEnd(); ++it) {
+        writeCborKey(writer, it.key());
+        writeCborValue(writer, it.value());
+    }
+    writer.endMap();
+}
+
+void writeCborValue(QCborStreamWriter &writer, const QJsonValue &value)
+{
+    switch (value.type()) {
+    case QJsonValue::Bool:
+        writer.append(value.toBool());
+        break;
+    case QJsonValue::Double: {
+        // JSON numbers are doubles; whole ones go out as integers
+        const double number = value.toDouble();
+        if (std::trunc(number) == number && std::abs(number) < 9007199254740992.0) {
+            writer.append(static_cast<qint64>(number));
+        } else {
+            writer.append(number);
+        }
+        break;
+    }
+    case QJsonValue::String:
+        writer.append(QStringView(value.toString()));
+        break;
+    case QJsonValue::Array: {
+        const QJsonArray array = value.toArray();
+        writer.startArray(quint64(array.size()));
+        for (const auto &element : array) {
+            writeCborValue(writer, element);
+        }
+        writer.endArray();
+        break;
+    }
+    case QJsonValue::Object:
+        writeCborObject(writer, value.toObject());
+        break;
+    case QJsonValue::Undefined:
+    case QJsonValue::Null:
+        writer.appendNull();
+        break;
+    }
+}
+
+QByteArray encodeCborMessages(const QJsonObject &fields, const QList<ChatMessage> &messages)
+{
+    QByteArray payload;
+    QCborStreamWriter writer(&payload);
+    writer.startMap(quint64(fields.size() + (fields.contains("messages") ? 0 : 1)));
+    for (auto it = fields.constBegin(); it != fields.constEnd(); ++it) {
+        if (it.key() != QLatin1String("messages")) {
+            writeCborKey(writer, it.key());
+            writeCborValue(writer, it.value());
+        }
+    }
+    writeCborKey(writer, "messages");
+    writer.startArray(quint64(messages.size()));
+    for (const auto &msg : messages) {
+        msg.writeCbor(writer);
+    }
+    writer.endArray();
+    writer.endMap();
+    return payload;
+}
+
+// The fields ChatMessage::toJson() writes, except for the timestamp
+void insertMessageFields(QJsonObject &obj, const ChatMessage &msg)
+{
+    obj["from"] = msg.from();
+    obj["to"] = msg.to();
+    obj["text"] = msg.text();
+    if (msg.timestamp().isValid()) {
+        obj["timestamp"] = msg.timestamp().toMSecsSinceEpoch();
+    }
+    obj["messageType"] = static_cast<int>(msg.type());
+    if (msg.id() != 0) {
+        obj["id"] = static_cast<qint64>(msg.id());
+    }
+}
+
+QString readCborText(QCborStreamReader &reader)
+{
+    QString text;
+    auto chunk = reader.readString();
+    while (chunk.status == QCborStreamReader::Ok) {
+        text += chunk.data;
+        chunk = reader.readString();
+    }
+    return text;
+}
+
+// Nesting of the frame being decoded; once it would pass kMaxCborDepth the
+// decode stops and fails
+struct CborDecodeState
+{
+    int depth = 0;
+    bool tooDeep = false;
+
+    bool enter()
+    {
+        if (depth >= kMaxCborDepth) {
+            tooDeep = true;
+            return false;
+        }
+        ++depth;
+        return true;
+    }
+    void leave() { --depth; }
+    bool canRead(const QCborStreamReader &reader) const
+    {
+        return !tooDeep && reader.hasNext() && reader.lastError() == QCborError::NoError;
+    }
+};
+
+QJsonValue readCborValue(QCborStreamReader &reader, CborDecodeState &state);
+
+// Reads a map key: a protocol key number or text. Empty for anything else.
+QString readCborKey(QCborStreamReader &reader, quint64 *number)
+{
+    *number = kCborKeyCount + 1;
+    if (reader.isUnsignedInteger()) {
+        *number = reader.toUnsignedInteger();
+        reader.next();
+        return *number >= 1 && *number <= kCborKeyCount
+                   ? QString::fromLatin1(kCborKeys[*number - 1])
+                   : QString();
+    }
+    if (reader.isString()) {
+        return readCborText(reader);
+    }
+    reader.next(kMaxCborDepth);
+    return QString();
+}
+
+QJsonObject readCborObject(QCborStreamReader &reader, CborDecodeState &state)
+{
+    QJsonObject obj;
+    if (!state.enter()) {
+        return obj;
+    }
+    reader.enterContainer();
+    while (state.canRead(reader)) {
+        quint64 number;
+        const QString key = readCborKey(reader, &number);
+        const QJsonValue value = readCborValue(reader, state);
+        if (!key.isEmpty()) {
+            obj.insert(key, value);
+        }
+    }
+    if (!state.tooDeep) {
+        reader.leaveContainer();
+    }
+    state.leave();
+    return obj;
+}
+
+QJsonValue readCborValue(QCborStreamReader &reader, CborDecodeState &state)
+{
+    QJsonValue value;
+    switch (reader.type()) {
+    case QCborStreamReader::UnsignedInteger:
+    case QCborStreamReader::NegativeInteger:
+        value = reader.toInteger();
+        reader.next();
+        break;
+    case QCborStreamReader::String:
+        value = readCborText(reader);
+        break;
+    case QCborStreamReader::Array: {
+        if (!state.enter()) {
+            break;
+        }
+        QJsonArray array;
+        reader.enterContainer();
+        while (state.canRead(reader)) {
+            array.append(readCborValue(reader, state));
+        }
+        if (!state.tooDeep) {
+            reader.leaveContainer();
+        }
+        state.leave();
+        value = array;
+        break;
+    }
+    case QCborStreamReader::Map:
+        value = readCborObject(reader, state);
+        break;
+    case QCborStreamReader::SimpleType:
+        if (reader.isBool()) {
+            value = reader.toBool();
+        }
+        reader.next();
+        break;
+    case QCborStreamReader::Float16:
+        value = double(reader.toFloat16());
+        reader.next();
+        break;
+    case QCborStreamReader::Float:
+        value = double(reader.toFloat());
+        reader.next();
+        break;
+    case QCborStreamReader::Double:
+        value = reader.toDouble();
+        reader.next();
+        break;
+    case QCborStreamReader::Tag:
+        // Tags aren't part of the protocol; read what they tag. Each one
+        // counts as a level, so a run of tags can't recurse without bound.
+        if (state.enter()) {
+            reader.next();
+            value = readCborValue(reader, state);
+            state.leave();
+        }
+        break;
+    default:
+        reader.next(kMaxCborDepth);
+        break;
+    }
+    return value;
+}
+
+// A history frame's "messages": arrays are ChatMessage::writeCbor(), maps
+// plain message objects
+void readCborMessages(QCborStreamReader &reader,
+                      CborDecodeState &state,
+                      QJsonObject &obj,
+                      QList<ChatMessage> *messages)
+{
+    if (!reader.isArray()) {
+        obj["messages"] = readCborValue(reader, state);
+        return;
+    }
+    if (!state.enter()) {
+        return;
+    }
+
+    QJsonArray array;
+    reader.enterContainer();
+    while (state.canRead(reader)) {
+        if (reader.isArray()) {
+            const ChatMessage msg = ChatMessage::readCbor(reader);
+            if (messages) {
+                messages->append(msg);
+            } else {
+                QJsonObject msgObj;
+                insertMessageFields(msgObj, msg);
+                array.append(msgObj);
+            }
+        } else if (reader.isMap()) {
+            const QJsonObject msgObj = readCborObject(reader, state);
+            if (messages) {
+                messages->append(ChatMessage::fromJson(msgObj));
+            } else {
+                array.append(msgObj);
+            }
+        } else {
+            reader.next(kMaxCborDepth);
+        }
+    }
+    if (!state.tooDeep) {
+        reader.leaveContainer();
+    }
+    state.leave();
+
+    if (!messages) {
+        obj["messages"] = array;
+    }
+}
+
+QJsonObject decodeCborFrame(QByteArrayView payload, bool *ok, QList<ChatMessage> *messages)
+{
+    QCborStreamReader reader(payload.data(), payload.size());
+    QJsonObject obj;
+    if (!reader.isMap()) {
+        if (ok) {
+            *ok = false;
+        }
+        return obj;
+    }
+
+    CborDecodeState state;
+    state.enter();
+    bool hasChatMessage = false;
+    reader.enterContainer();
+    while (state.canRead(reader)) {
+        quint64 number;
+        const QString key = readCborKey(reader, &number);
+        if (number == kChatMessageKey) {
+            hasChatMessage = true;
+            const ChatMessage msg = ChatMessage::readCbor(reader);
+            if (messages) {
+                messages->append(msg);
+            } else {
+                insertMessageFields(obj, msg);
+            }
+        } else if (key == QLatin1String("messages")) {
+            readCborMessages(reader, state, obj, messages);
+        } else {
+            const QJsonValue value = readCborValue(reader, state);
+            if (!key.isEmpty()) {
+                obj.insert(key, value);
+            }
+        }
+    }
+    if (state.tooDeep) {
+        if (ok) {
+            *ok = false;
+        }
+        return QJsonObject();
+    }
+    reader.leaveContainer();
+
+    // A chat frame encoded as a plain object has the message fields inline
+    if (messages && !hasChatMessage && obj["type"].toString() == QLatin1String("chat")) {
+        messages->append(ChatMessage::fromJson(obj));
+    }
+
+    if (ok) {
+        *ok = reader.lastError() == QCborError::NoError;
+    }
+    return obj;
+}
+
+// The messages a JSON frame carries, for callers that take them as
+// ChatMessage
+void collectJsonMessages(const QJsonObject &obj, QList<ChatMessage> *messages)
+{
+    if (obj["type"].toString() == QLatin1String("chat")) {
+        messages->append(ChatMessage::fromJson(obj));
+        return;
+    }
+
+    const QJsonArray array = obj["messages"].toArray();
+    messages->reserve(messages->size() + array.size());
+    for (const auto &val : array) {
+        if (val.isObject()) {
+            messages->append(ChatMessage::fromJson(val.toObject()));
+        }
+    }
+}
+
+} // namespace
+
+FrameCodec::FrameCodec(quint32 maxFrameSize)
+    : m_readPos(0)
+    , m_maxFrameSize(maxFrameSize)
+    , m_frameTooLarge(false)
+{}
+
+QByteArray FrameCodec::encode(QByteArrayView payload)
+{
+    QByteArray packet;
+    packet.reserve(kHeaderSize + payload.size());
+    packet.resize(kHeaderSize);
+    qToBigEndian<quint32>(static_cast<quint32>(payload.size()), packet.data());
+    packet.append(payload.data(), payload.size());
+    return packet;
+}
+
+QByteArray FrameCodec::encode(const QJsonObject &obj, Encoding encoding)
+{
+    if (encoding == Cbor) {
+        QByteArray payload;
+        QCborStreamWriter writer(&payload);
+        writeCborObject(writer, obj);
+        return encode(payload);
+    }
+    return encodeJson(obj);
+}
+
+QByteArray FrameCodec::encodeChat(const ChatMessage &message,
+                                  Encoding encoding,
+                                  const QJsonObject &fields)
+{
+    if (encoding != Cbor) {
+        QJsonObject obj = fields;
+        const QJsonObject messageObj = message.toJson();
+        for (auto it = messageObj.constBegin(); it != messageObj.constEnd(); ++it) {
+            obj.insert(it.key(), it.value());
+        }
+        obj["type"] = "chat";
+        return encodeJson(obj);
+    }
+
+    QByteArray payload;
+    QCborStreamWriter writer(&payload);
+    writer.startMap(quint64(fields.size() + (fields.contains("type") ? 1 : 2)));
+    writeCborKey(writer, "type");
+    writer.append(QLatin1String("chat"));
+    writer.append(kChatMessageKey);
+    message.writeCbor(writer);
+    for (auto it = fields.constBegin(); it != fields.constEnd(); ++it) {
+        if (it.key() != QLatin1String("type")) {
+            writeCborKey(writer, it.key());
+            writeCborValue(writer, it.value());
+        }
+    }
+    writer.endMap();
+    return encode(payload);
+}
+
+QByteArray FrameCodec::encodeMessages(const QJsonObject &fields,
+                                      const QList<ChatMessage> &messages,
+                                      Encoding encoding)
+{
+    if (encoding == Cbor) {
+        return encode(encodeCborMessages(fields, messages));
+    }
+
+    QJsonArray array;
+    for (const auto &msg : messages) {
+        array.append(msg.toJson());
+    }
+    QJsonObject obj = fields;
+    obj["messages"] = array;
+    return encodeJson(obj);
+}
+
+QByteArray FrameCodec::encodeJson(const QJsonObject &obj)
+{
+    return encode(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+}
+
+void FrameCodec::append(const QByteArray &data)
+{
+    if (m_frameTooLarge) {
+        return; // The stream is out of sync; nothing after this can be parsed
+    }
+
+    compact();
+    m_buffer.append(data);
+}
+
+bool FrameCodec::nextFrame(QByteArrayView *payload)
+{
+    if (m_frameTooLarge || m_buffer.size() - m_readPos < kHeaderSize) {
+        return false;
+    }
+
+    const quint32 size = qFromBigEndian<quint32>(m_buffer.constData() + m_readPos);
+    if (size > m_maxFrameSize) {
+        m_frameTooLarge = true;
+        return false;
+    }
+
+    if (m_buffer.size() - m_readPos - kHeaderSize < size) {
+        return false;
+    }
+
+    *payload = QByteArrayView(m_buffer.constData() + m_readPos + kHeaderSize, size);
+    m_readPos += kHeaderSize + size;
+    return true;
+}
+
+QJsonObject FrameCodec::decodeObject(QByteArrayView payload,
+                                     bool *ok,
+                                     QList<ChatMessage> *messages)
+{
+    if (!payload.isEmpty() && payload.at(0) != '{') {
+        return decodeCborFrame(payload, ok, messages);
+    }
+
+    // fromRawData wraps the view without copying it
+    QJsonDocument doc = QJsonDocument::fromJson(
+        QByteArray::fromRawData(payload.data(), payload.size()));
+    if (ok) {
+        *ok = doc.isObject();
+    }
+    const QJsonObject obj = doc.object();
+    if (messages && doc.isObject()) {
+        collectJsonMessages(obj, messages);
+    }
+    return obj;
+}
+
+QString FrameCodec::encodingName(Encoding encoding)
+{
+    return encoding == Cbor ? "cbor" : "json";
+}
+
+FrameCodec::Encoding FrameCodec::encodingFromName(const QString &name, Encoding fallback)
+{
+    if (name == "cbor") {
+        return Cbor;
+    }
+    if (name == "json") {
+        return Json;
+    }
+    return fallback;
+}
+
+bool FrameCodec::frameTooLarge() const
+{
+    return m_frameTooLarge;
+}
+
+quint32 FrameCodec::maxFrameSize() const
+{
+    return m_maxFrameSize;
+}
+
+qsizetype FrameCodec::bufferedBytes() const
+{
+    return m_buffer.size() - m_readPos;
+}
+
+void FrameCodec::clear()
+{
+    m_buffer.clear();
+    m_readPos = 0;
+    m_frameTooLarge = false;
+}
+
+void FrameCodec::compact()
+{
+    if (m_readPos == 0) {
+        return;
+    }
+
+    if (m_readPos == m_buffer.size()) {
+        // Everything consumed: reuse the allocation without moving anything
+        m_buffer.truncate(0);
+        m_readPos = 0;
+    } else if (m_readPos >= kCompactThreshold && m_readPos * 2 >= m_buffer.size()) {
+        m_buffer.remove(0, m_readPos);
+        m_readPos = 0;
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QJsonObject>
+#include <QList>
+#include "chatmessage.h"
+
+// Length-prefixed framing used on the wire: [quint32 big-endian size][payload].
+//
+// Payloads are protocol objects encoded either as compact JSON or as CBOR.
+// The encoding a peer sends is negotiated at registration, but decoding
+// tells the two apart per frame (a JSON object starts with '{', which is
+// never the first byte of a CBOR map), so frames in flight during the
+// switch are still understood.
+//
+// A CBOR frame is a map streamed straight from and into the object, with
+// the protocol's own keys written as small integers. Chat messages are
+// written by ChatMessage::writeCbor(): a "chat" frame carries its message
+// under key 0, history frames theirs under "messages". Decoding hands them
+// out as ChatMessage when asked to, and otherwise as the objects toJson()
+// would give, with the timestamp in milliseconds since the epoch.
+//
+// Incoming data is appended to one buffer and frames are consumed by moving
+// a read cursor, so a burst of small frames costs linear time. The consumed
+// prefix is only dropped once it makes up most of the buffer.
+class FrameCodec
+{
+public:
+    static constexpr quint32 DefaultMaxFrameSize = 16 * 1024 * 1024;
+
+    enum Encoding {
+        Json, // Compact JSON text, understood by every client
+        Cbor  // Binary CBOR, cheaper to produce and parse
+    };
+
+    explicit FrameCodec(quint32 maxFrameSize = DefaultMaxFrameSize);
+
+    // Encoding
+    static QByteArray encode(QByteArrayView payload);
+    static QByteArray encode(const QJsonObject &obj, Encoding encoding);
+    static QByteArray encodeJson(const QJsonObject &obj);
+    // A "chat" frame for message, with fields sent along (e.g. "cid")
+    static QByteArray encodeChat(const ChatMessage &message,
+                                 Encoding encoding,
+                                 const QJsonObject &fields = QJsonObject());
+    // A frame of fields with messages under "messages"
+    static QByteArray encodeMessages(const QJsonObject &fields,
+                                     const QList<ChatMessage> &messages,
+                                     Encoding encoding);
+
+    // Decoding
+    void append(const QByteArray &data);
+
+    // Hands out the next complete payload as a view into the internal buffer.
+    // The view stays valid until the next append() or clear(). Returns false
+    // when no complete frame is buffered or a frame exceeded the size limit.
+    bool nextFrame(QByteArrayView *payload);
+
+    // Decodes a JSON or CBOR payload into the protocol object. With
+    // messages given, the messages a frame carries (a chat frame's own, a
+    // history frame's "messages") are appended to it as well; CBOR frames
+    // then leave them out of the object.
+    static QJsonObject decodeObject(QByteArrayView payload,
+                                    bool *ok = nullptr,
+                                    QList<ChatMessage> *messages = nullptr);
+
+    // Names used for negotiation in the register handshake
+    static QString encodingName(Encoding encoding);
+    static Encoding encodingFromName(const QString &name, Encoding fallback = Json);
+
+    bool frameTooLarge() const; // Set once a peer announces an oversized frame
+    quint32 maxFrameSize() const;
+    qsizetype bufferedBytes() const;
+    void clear();
+
+private:
+    void compact();
+
+    QByteArray m_buffer;
+    qsizetype m_readPos;
+    quint32 m_maxFrameSize;
+    bool m_frameTooLarge;
+};
+
+#endif // FRAMECODEC_H
@@ -0,0 +1,376 @@
+#include "messagelog.h"
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QtEndian>
+
+#if defined(Q_OS_UNIX)
+#include <unistd.h>
+#elif defined(Q_OS_WIN)
+#include <io.h>
+#endif
+
+namespace {
+
+const char kLogMagic[4] = {'Q', 'C', 'H', 'L'};
+const quint32 kLogVersion = 1;
+const qint64 kHeaderSize = sizeof(kLogMagic) + sizeof(quint32);
+const qint64 kRecordHeaderSize = sizeof(quint32) + sizeof(quint16);
+const qint64 kIndexEntrySize = sizeof(quint64);
+
+QByteArray logHeader()
+{
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream.writeRawData(kLogMagic, sizeof(kLogMagic));
+    stream << kLogVersion;
+    return header;
+}
+
+// Flushes Qt's and the OS's buffers for file down to the disk
+bool syncFile(QFile &file)
+{
+    if (!file.flush()) {
+        return false;
+    }
+#if defined(Q_OS_UNIX)
+    return ::fsync(file.handle()) == 0;
+#elif defined(Q_OS_WIN)
+    return ::_commit(file.handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+bool isValidHeader(const QByteArray &data)
+{
+    return data.size() >= kHeaderSize && data.startsWith(logHeader());
+}
+
+QByteArray encodeOffsets(const QList<qint64> &offsets)
+{
+    QByteArray data(offsets.size() * kIndexEntrySize, Qt::Uninitialized);
+    char *out = data.data();
+    for (qint64 offset : offsets) {
+        qToBigEndian<quint64>(static_cast<quint64>(offset), out);
+        out += kIndexEntrySize;
+    }
+    return data;
+}
+
+// Reads index entry i, or returns -1 if the index doesn't have it
+qint64 readIndexEntry(QFile &index, qint64 i)
+{
+    char entry[kIndexEntrySize];
+    if (!index.seek(i * kIndexEntrySize) || index.read(entry, kIndexEntrySize) != kIndexEntrySize) {
+        return -1;
+    }
+    return static_cast<qint64>(qFromBigEndian<quint64>(entry));
+}
+
+// Walks the records from pos on and returns the offset just past the last
+// intact one. Decoded messages and the offset of each record in data are
+// appended to messages and offsets if given.
+qint64 scanRecords(const QByteArray &data,
+                   qint64 pos,
+                   QList<ChatMessage> *messages,
+                   QList<qint64> *offsets)
+{
+    while (data.size() - pos >= kRecordHeaderSize) {
+        const quint32 size = qFromBigEndian<quint32>(data.constData() + pos);
+        const quint16 crc = qFromBigEndian<quint16>(data.constData() + pos + sizeof(quint32));
+
+        if (data.size() - pos - kRecordHeaderSize < size) {
+            break; // Torn write at the tail
+        }
+
+        const QByteArray payload = QByteArray::fromRawData(data.constData() + pos
+                                                               + kRecordHeaderSize,
+                                                           size);
+        if (qChecksum(payload) != crc) {
+            break;
+        }
+
+        if (messages) {
+            QDataStream stream(payload);
+            stream.setVersion(QDataStream::Qt_6_0);
+            ChatMessage msg;
+            stream >> msg;
+            if (!stream.atEnd()) {
+                quint64 id;
+                stream >> id;
+                msg.setId(id);
+            }
+            messages->append(msg);
+        }
+        if (offsets) {
+            offsets->append(pos);
+        }
+
+        pos += kRecordHeaderSize + size;
+    }
+
+    return pos;
+}
+
+} // namespace
+
+QByteArray MessageLog::encodeRecord(const ChatMessage &message)
+{
+    QByteArray payload;
+    QDataStream payloadStream(&payload, QIODevice::WriteOnly);
+    payloadStream.setVersion(QDataStream::Qt_6_0);
+    payloadStream << message << message.id();
+
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << static_cast<quint32>(payload.size()) << qChecksum(payload);
+    record.append(payload);
+    return record;
+}
+
+bool MessageLog::append(const QString &filePath, const ChatMessage &message, bool sync)
+{
+    return append(filePath, QList<ChatMessage>{message}, sync);
+}
+
+bool MessageLog::append(const QString &filePath, const QList<ChatMessage> &messages, bool sync)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Failed to open history log for appending:" << filePath;
+        return false;
+    }
+
+    // Build everything first so the records reach the file in a single write
+    const qint64 base = file.size();
+    QByteArray data;
+    if (base == 0) {
+        data.append(logHeader());
+    }
+
+    QList<qint64> offsets;
+    offsets.reserve(messages.size());
+    for (const auto &msg : messages) {
+        offsets.append(base + data.size());
+        data.append(encodeRecord(msg));
+    }
+
+    const bool ok = file.write(data) == data.size() && (!sync || syncFile(file));
+    file.close();
+
+    if (!ok) {
+        qWarning() << "Failed to append to history log:" << filePath;
+        return false;
+    }
+
+    // The index is written after the records it points at, so a crash in
+    // between leaves an index that is short, never one that is ahead. It is
+    // never synced: recover() rebuilds it from the log when it is behind.
+    QFile index(indexPath(filePath));
+    const QByteArray entries = encodeOffsets(offsets);
+    if (!index.open(QIODevice::WriteOnly | QIODevice::Append)
+        || index.write(entries) != entries.size()) {
+        qWarning() << "Failed to update history index:" << index.fileName();
+    }
+    return true;
+}
+
+QList<ChatMessage> MessageLog::load(const QString &filePath)
+{
+    QList<ChatMessage> messages;
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return messages;
+    }
+
+    const QByteArray data = file.readAll();
+    file.close();
+
+    if (!isValidHeader(data)) {
+        return messages;
+    }
+
+    scanRecords(data, kHeaderSize, &messages, nullptr);
+    return messages;
+}
+
+qint64 MessageLog::count(const QString &filePath)
+{
+    return QFileInfo(indexPath(filePath)).size() / kIndexEntrySize;
+}
+
+QList<ChatMessage> MessageLog::read(const QString &filePath, qint64 first, qint64 count)
+{
+    QList<ChatMessage> messages;
+
+    QFile index(indexPath(filePath));
+    if (first < 0 || count <= 0 || !index.open(QIODevice::ReadOnly)) {
+        return messages;
+    }
+
+    const qint64 total = index.size() / kIndexEntrySize;
+    count = qMin(count, total - first);
+    if (count <= 0) {
+        return messages;
+    }
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return messages;
+    }
+
+    // Only the two index entries bounding the range are needed
+    const qint64 begin = readIndexEntry(index, first);
+    const qint64 end = first + count < total ? readIndexEntry(index, first + count) : file.size();
+    if (begin < kHeaderSize || end < begin || !file.seek(begin)) {
+        return messages;
+    }
+
+    const QByteArray data = file.read(end - begin);
+    messages.reserve(count);
+    scanRecords(data, 0, &messages, nullptr);
+    return messages;
+}
+
+QString MessageLog::indexPath(const QString &filePath)
+{
+    return filePath + ".idx";
+}
+
+qint64 MessageLog::recover(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.exists()) {
+        QFile::remove(indexPath(filePath)); // Don't let a later append build on a stale index
+        return 0;
+    }
+
+    if (!file.open(QIODevice::ReadWrite)) {
+        qWarning() << "Failed to open history log for recovery:" << filePath;
+        return -1;
+    }
+
+    if (file.size() == 0) {
+        QFile::remove(indexPath(filePath));
+        return 0;
+    }
+
+    const qint64 indexed = verifyIndexedTail(file);
+    if (indexed >= 0) {
+        return indexed;
+    }
+
+    // The index doesn't describe the log: scan everything and rebuild it
+    file.seek(0);
+    const QByteArray data = file.readAll();
+
+    if (!isValidHeader(data)) {
+        // A crash while writing the header of a brand new log leaves a short
+        // prefix of it behind; anything else is not ours to touch.
+        if (data.size() < kHeaderSize && logHeader().startsWith(data)) {
+            file.resize(0);
+            QFile::remove(indexPath(filePath));
+            return 0;
+        }
+        qWarning() << "Not a history log:" << filePath;
+        return -1;
+    }
+
+    QList<qint64> offsets;
+    const qint64 end = scanRecords(data, kHeaderSize, nullptr, &offsets);
+    if (end < data.size()) {
+        qWarning() << "Truncating" << data.size() - end << "bytes of damaged history from"
+                   << filePath;
+        if (!file.resize(end)) {
+            qWarning() << "Failed to truncate history log:" << filePath;
+            return -1;
+        }
+    }
+
+    file.close();
+
+    if (!writeIndex(filePath, offsets)) {
+        return -1;
+    }
+    return offsets.size();
+}
+
+qint64 MessageLog::verifyIndexedTail(QFile &file)
+{
+    QFile index(indexPath(file.fileName()));
+    if (!index.open(QIODevice::ReadOnly) || index.size() % kIndexEntrySize != 0) {
+        return -1;
+    }
+
+    if (!file.seek(0) || !isValidHeader(file.read(kHeaderSize))) {
+        return -1;
+    }
+
+    const qint64 count = index.size() / kIndexEntrySize;
+    if (count == 0) {
+        return file.size() == kHeaderSize ? 0 : -1;
+    }
+
+    // The last indexed record must be intact and end exactly at end of file
+    const qint64 last = readIndexEntry(index, count - 1);
+    if (last < kHeaderSize || file.size() - last < kRecordHeaderSize || !file.seek(last)) {
+        return -1;
+    }
+
+    const QByteArray record = file.read(file.size() - last);
+    QList<qint64> offsets;
+    if (scanRecords(record, 0, nullptr, &offsets) != record.size() || offsets.size() != 1) {
+        return -1;
+    }
+    return count;
+}
+
+bool MessageLog::writeIndex(const QString &filePath, const QList<qint64> &offsets)
+{
+    QFile index(indexPath(filePath));
+    const QByteArray entries = encodeOffsets(offsets);
+    if (!index.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || index.write(entries) != entries.size()) {
+        qWarning() << "Failed to write history index:" << index.fileName();
+        return false;
+    }
+    return true;
+}
+
+bool MessageLog::migrateJson(const QString &jsonPath, const QString &logPath)
+{
+    const QList<ChatMessage> messages = ChatMessage::loadMessages(jsonPath);
+
+    // Write next to the target and rename, so a crash never leaves half a log
+    const QString tmpPath = logPath + ".tmp";
+    QFile::remove(tmpPath);
+    QFile::remove(indexPath(tmpPath));
+
+    QFile tmp(tmpPath);
+    if (!tmp.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to create history log:" << tmpPath;
+        return false;
+    }
+    tmp.write(logHeader());
+    tmp.close();
+
+    if (!messages.isEmpty() && !append(tmpPath, messages)) {
+        QFile::remove(tmpPath);
+        QFile::remove(indexPath(tmpPath));
+        return false;
+    }
+
+    QFile::remove(logPath);
+    QFile::remove(indexPath(logPath));
+    if (!QFile::rename(tmpPath, logPath)) {
+        return false;
+    }
+
+    // A missing index is rebuilt by recover(), so this rename is best effort
+    QFile::rename(indexPath(tmpPath), indexPath(logPath));
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef MESSAGELOG_H
+#define MESSAGELOG_H
+
+#include <QList>
+#include <QString>
+#include "chatmessage.h"
+
+class QFile;
+
+// Append-only, length-prefixed chat history log.
+//
+// File layout: an 8 byte header ("QCHL" + quint32 format version) followed by
+// records of the form [quint32 payload size][quint16 CRC][payload], where the
+// payload is a ChatMessage written with QDataStream followed by its quint64 id
+// (missing from records written before messages had ids, which read as 0).
+// Appending a message costs one write at the end of the file regardless of the
+// history length.
+//
+// Every log has a sidecar index (see indexPath()) holding the big-endian
+// quint64 file offset of each record, so counting records or reading a range
+// of them only touches the bytes that are asked for.
+class MessageLog
+{
+public:
+    // Append one or more messages to the log, creating it if needed. With
+    // sync set the records are on stable storage when this returns.
+    static bool append(const QString &filePath, const ChatMessage &message, bool sync = false);
+    static bool append(const QString &filePath,
+                       const QList<ChatMessage> &messages,
+                       bool sync = false);
+
+    // Read every intact record of the log
+    static QList<ChatMessage> load(const QString &filePath);
+
+    // Number of indexed records, and the records [first, first + count)
+    static qint64 count(const QString &filePath);
+    static QList<ChatMessage> read(const QString &filePath, qint64 first, qint64 count);
+
+    static QString indexPath(const QString &filePath);
+
+    // Validate the log and truncate a torn or corrupt tail left by a crash.
+    // When the index matches the log only its last record is checked;
+    // otherwise the whole log is scanned and the index rebuilt.
+    // Returns the number of intact records, or -1 if the file is unusable.
+    static qint64 recover(const QString &filePath);
+
+    // Convert a legacy JSON history file (ChatMessage::saveMessages) into a log
+    static bool migrateJson(const QString &jsonPath, const QString &logPath);
+
+private:
+    static QByteArray encodeRecord(const ChatMessage &message);
+    static qint64 verifyIndexedTail(QFile &file);
+    static bool writeIndex(const QString &filePath, const QList<qint64> &offsets);
+};
+
+#endif // MESSAGELOG_H
@@ -0,0 +1,34 @@
+#include "preparedframe.h"
+
+PreparedFrame::PreparedFrame(const QJsonObject &obj, Delivery delivery)
+    : m_object(obj)
+    , m_isChat(false)
+    , m_delivery(delivery)
+{}
+
+PreparedFrame::PreparedFrame(const ChatMessage &message, Delivery delivery)
+    : m_object(QJsonObject{{"type", "chat"}})
+    , m_message(message)
+    , m_isChat(true)
+    , m_delivery(delivery)
+{}
+
+QJsonObject PreparedFrame::object() const
+{
+    return m_object;
+}
+
+PreparedFrame::Delivery PreparedFrame::delivery() const
+{
+    return m_delivery;
+}
+
+QByteArray PreparedFrame::frame(FrameCodec::Encoding encoding) const
+{
+    QByteArray &cached = (encoding == FrameCodec::Cbor) ? m_cborFrame : m_jsonFrame;
+    if (cached.isEmpty()) {
+        cached = m_isChat ? FrameCodec::encodeChat(m_message, encoding)
+                          : FrameCodec::encode(m_object, encoding);
+    }
+    return cached;
+}
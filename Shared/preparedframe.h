@@ -0,0 +1,40 @@
+#ifndef PREPAREDFRAME_H
+#define PREPAREDFRAME_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include "chatmessage.h"
+#include "framecodec.h"
+
+// A protocol object that is encoded and framed at most once per wire
+// encoding, no matter how many connections it is sent to. The framed
+// QByteArray is implicitly shared between all of them.
+//
+// Not thread-safe: prepare and resolve frames on one thread, then hand the
+// resulting QByteArray to the connections.
+class PreparedFrame
+{
+public:
+    enum Delivery {
+        Reliable, // Must reach the peer
+        Ephemeral // State that a later frame supersedes; may be dropped under load
+    };
+
+    explicit PreparedFrame(const QJsonObject &obj, Delivery delivery = Reliable);
+    // A "chat" frame; CBOR writes the message without building an object
+    explicit PreparedFrame(const ChatMessage &message, Delivery delivery = Reliable);
+
+    QJsonObject object() const; // Only {"type": "chat"} for a chat frame
+    Delivery delivery() const;
+    QByteArray frame(FrameCodec::Encoding encoding) const;
+
+private:
+    QJsonObject m_object;
+    ChatMessage m_message;
+    bool m_isChat;
+    Delivery m_delivery;
+    mutable QByteArray m_jsonFrame;
+    mutable QByteArray m_cborFrame;
+};
+
+#endif // PREPAREDFRAME_H
@@ -0,0 +1,326 @@
+#include <QDataStream>
+#include <QDateTime>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QtTest>
+#include "chatmessage.h"
+#include "framecodec.h"
+#include "messagelog.h"
+
+// Benchmarks for the ChatShared code on the message hot path and for the
+// history file formats. Message texts cover a short chat line, a paragraph
+// and a pasted block; file benchmarks run at 1k, 100k and 1M messages.
+class ChatSharedBench : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    // Per-message conversions
+    void toJson_data();
+    void toJson();
+    void fromJson_data();
+    void fromJson();
+    void dataStreamWrite_data();
+    void dataStreamWrite();
+    void dataStreamRead_data();
+    void dataStreamRead();
+    void isoDateFormat();
+    void isoDateParse();
+
+    // Framing, as done by sendJson and onReadyRead on both sides
+    void frameEncode_data();
+    void frameEncode();
+    void frameDecode_data();
+    void frameDecode();
+
+    // History files
+    void saveMessages_data();
+    void saveMessages();
+    void loadMessages_data();
+    void loadMessages();
+    void messageLogAppend_data();
+    void messageLogAppend();
+    void messageLogLoad_data();
+    void messageLogLoad();
+
+private:
+    static ChatMessage makeMessage(int i, int textSize);
+    static QList<ChatMessage> makeMessages(int count, int textSize);
+    static void addTextSizes();
+    static void addFileSizes();
+    QString filePath(const QString &name) const;
+
+    QTemporaryDir m_dir;
+};
+
+namespace {
+
+const int kShortText = 32;
+const int kBatchSize = 1000;
+
+} // namespace
+
+ChatMessage ChatSharedBench::makeMessage(int i, int textSize)
+{
+    static const QDateTime base = QDateTime::fromSecsSinceEpoch(1704110400);
+    QString text = QString("message %1 ").arg(i);
+    text.append(QString(qMax(0, textSize - int(text.size())), 'x'));
+    return ChatMessage(i % 2 ? "alice" : "bob",
+                       i % 2 ? "bob" : "alice",
+                       text,
+                       ChatMessage::Private,
+                       base.addSecs(i));
+}
+
+QList<ChatMessage> ChatSharedBench::makeMessages(int count, int textSize)
+{
+    QList<ChatMessage> messages;
+    messages.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        messages.append(makeMessage(i, textSize));
+    }
+    return messages;
+}
+
+void ChatSharedBench::addTextSizes()
+{
+    QTest::addColumn<int>("textSize");
+    QTest::newRow("32") << kShortText;
+    QTest::newRow("256") << 256;
+    QTest::newRow("4096") << 4096;
+}
+
+void ChatSharedBench::addFileSizes()
+{
+    QTest::addColumn<int>("count");
+    QTest::newRow("1k") << 1000;
+    QTest::newRow("100k") << 100000;
+    QTest::newRow("1M") << 1000000;
+}
+
+QString ChatSharedBench::filePath(const QString &name) const
+{
+    return m_dir.filePath(name);
+}
+
+void ChatSharedBench::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+}
+
+void ChatSharedBench::toJson_data()
+{
+    addTextSizes();
+}
+
+void ChatSharedBench::toJson()
+{
+    QFETCH(int, textSize);
+    const ChatMessage msg = makeMessage(1, textSize);
+
+    QBENCHMARK {
+        msg.toJson();
+    }
+}
+
+void ChatSharedBench::fromJson_data()
+{
+    addTextSizes();
+}
+
+void ChatSharedBench::fromJson()
+{
+    QFETCH(int, textSize);
+    const QJsonObject obj = makeMessage(1, textSize).toJson();
+
+    QBENCHMARK {
+        ChatMessage::fromJson(obj);
+    }
+}
+
+void ChatSharedBench::dataStreamWrite_data()
+{
+    addTextSizes();
+}
+
+void ChatSharedBench::dataStreamWrite()
+{
+    QFETCH(int, textSize);
+    const QList<ChatMessage> messages = makeMessages(kBatchSize, textSize);
+
+    QBENCHMARK {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_6_0);
+        for (const auto &msg : messages) {
+            stream << msg;
+        }
+    }
+}
+
+void ChatSharedBench::dataStreamRead_data()
+{
+    addTextSizes();
+}
+
+void ChatSharedBench::dataStreamRead()
+{
+    QFETCH(int, textSize);
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_6_0);
+    for (const auto &msg : makeMessages(kBatchSize, textSize)) {
+        out << msg;
+    }
+
+    QBENCHMARK {
+        QDataStream stream(data);
+        stream.setVersion(QDataStream::Qt_6_0);
+        ChatMessage msg;
+        for (int i = 0; i < kBatchSize; ++i) {
+            stream >> msg;
+        }
+    }
+}
+
+void ChatSharedBench::isoDateFormat()
+{
+    const QDateTime timestamp = QDateTime::currentDateTime();
+
+    QBENCHMARK {
+        timestamp.toString(Qt::ISODate);
+    }
+}
+
+void ChatSharedBench::isoDateParse()
+{
+    const QString text = QDateTime::currentDateTime().toString(Qt::ISODate);
+
+    QBENCHMARK {
+        QDateTime::fromString(text, Qt::ISODate);
+    }
+}
+
+void ChatSharedBench::frameEncode_data()
+{
+    QTest::addColumn<int>("encoding");
+    QTest::addColumn<int>("textSize");
+    for (int encoding : {FrameCodec::Json, FrameCodec::Cbor}) {
+        const QString name = FrameCodec::encodingName(FrameCodec::Encoding(encoding));
+        for (int textSize : {kShortText, 256, 4096}) {
+            QTest::addRow("%s/%d", qPrintable(name), textSize) << encoding << textSize;
+        }
+    }
+}
+
+void ChatSharedBench::frameEncode()
+{
+    QFETCH(int, encoding);
+    QFETCH(int, textSize);
+    const ChatMessage msg = makeMessage(1, textSize);
+    qInfo("%lld bytes per frame",
+          qint64(FrameCodec::encodeChat(msg, FrameCodec::Encoding(encoding)).size()));
+
+    QBENCHMARK {
+        FrameCodec::encodeChat(msg, FrameCodec::Encoding(encoding));
+    }
+}
+
+void ChatSharedBench::frameDecode_data()
+{
+    frameEncode_data();
+}
+
+void ChatSharedBench::frameDecode()
+{
+    QFETCH(int, encoding);
+    QFETCH(int, textSize);
+
+    // A burst of frames arriving in one read
+    QByteArray data;
+    for (const auto &msg : makeMessages(kBatchSize, textSize)) {
+        data.append(FrameCodec::encodeChat(msg, FrameCodec::Encoding(encoding)));
+    }
+
+    QBENCHMARK {
+        FrameCodec codec;
+        codec.append(data);
+        QByteArrayView payload;
+        QList<ChatMessage> messages;
+        while (codec.nextFrame(&payload)) {
+            FrameCodec::decodeObject(payload, nullptr, &messages);
+        }
+        QCOMPARE(messages.size(), qsizetype(kBatchSize));
+    }
+}
+
+void ChatSharedBench::saveMessages_data()
+{
+    addFileSizes();
+}
+
+void ChatSharedBench::saveMessages()
+{
+    QFETCH(int, count);
+    const QList<ChatMessage> messages = makeMessages(count, kShortText);
+    const QString path = filePath("save.json");
+
+    QBENCHMARK_ONCE {
+        QVERIFY(ChatMessage::saveMessages(messages, path));
+    }
+}
+
+void ChatSharedBench::loadMessages_data()
+{
+    addFileSizes();
+}
+
+void ChatSharedBench::loadMessages()
+{
+    QFETCH(int, count);
+    const QString path = filePath(QString("load-%1.json").arg(count));
+    QVERIFY(ChatMessage::saveMessages(makeMessages(count, kShortText), path));
+
+    QBENCHMARK_ONCE {
+        QCOMPARE(ChatMessage::loadMessages(path).size(), qsizetype(count));
+    }
+}
+
+void ChatSharedBench::messageLogAppend_data()
+{
+    addFileSizes();
+}
+
+void ChatSharedBench::messageLogAppend()
+{
+    QFETCH(int, count);
+    const QList<ChatMessage> messages = makeMessages(count, kShortText);
+    const QString path = filePath(QString("append-%1.chatlog").arg(count));
+    QFile::remove(path);
+
+    QBENCHMARK_ONCE {
+        QVERIFY(MessageLog::append(path, messages));
+    }
+}
+
+void ChatSharedBench::messageLogLoad_data()
+{
+    addFileSizes();
+}
+
+void ChatSharedBench::messageLogLoad()
+{
+    QFETCH(int, count);
+    const QString path = filePath(QString("load-%1.chatlog").arg(count));
+    QFile::remove(path);
+    QVERIFY(MessageLog::append(path, makeMessages(count, kShortText)));
+
+    QBENCHMARK_ONCE {
+        QCOMPARE(MessageLog::load(path).size(), qsizetype(count));
+    }
+}
+
+QTEST_GUILESS_MAIN(ChatSharedBench)
+#include "chatsharedbench.moc"
@@ -0,0 +1,482 @@
+#include "loadgenerator.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QTimer>
+#include <algorithm>
+#include <cmath>
+#include "chatclient.h"
+
+namespace {
+
+const int kTickInterval = 10; // ms between connect and send rounds
+const int kDrainTime = 1000;  // ms to wait for in-flight messages after sending stops
+const char kPayloadTag[] = "lg "; // Payload: "lg <send time ns> " padded to size
+
+double toMs(double ns)
+{
+    return ns / 1e6;
+}
+
+double percentile(const std::vector<qint64> &sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    const qint64 rank = static_cast<qint64>(std::ceil(p * sorted.size())) - 1;
+    return toMs(sorted[qBound<qint64>(0, rank, sorted.size() - 1)]);
+}
+
+QJsonObject latencyJson(std::vector<qint64> samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0;
+    for (qint64 sample : samples) {
+        sum += sample;
+    }
+
+    QJsonObject obj;
+    obj["samples"] = static_cast<qint64>(samples.size());
+    obj["mean"] = samples.empty() ? 0 : toMs(sum / samples.size());
+    obj["p50"] = percentile(samples, 0.50);
+    obj["p99"] = percentile(samples, 0.99);
+    obj["p999"] = percentile(samples, 0.999);
+    obj["max"] = samples.empty() ? 0 : toMs(samples.back());
+    return obj;
+}
+
+QString latencyLine(const QJsonObject &latency)
+{
+    return QString("p50 %1 ms, p99 %2 ms, p99.9 %3 ms, max %4 ms (%5 samples)")
+        .arg(latency["p50"].toDouble(), 0, 'f', 3)
+        .arg(latency["p99"].toDouble(), 0, 'f', 3)
+        .arg(latency["p999"].toDouble(), 0, 'f', 3)
+        .arg(latency["max"].toDouble(), 0, 'f', 3)
+        .arg(latency["samples"].toInteger());
+}
+
+} // namespace
+
+LoadGenerator::LoadGenerator(const Options &options, QObject *parent)
+    : QObject(parent)
+    , m_options(options)
+    , m_random(options.seed)
+    , m_connectTimer(new QTimer(this))
+    , m_sendTimer(new QTimer(this))
+    , m_nextSender(0)
+    , m_connectCredit(0)
+    , m_sendCredit(0)
+    , m_lastConnectTick(0)
+    , m_lastSendTick(0)
+    , m_sending(false)
+    , m_stopping(false)
+    , m_firstRegistered(-1)
+    , m_allRegistered(-1)
+    , m_sendStopped(-1)
+    , m_peakOnline(0)
+    , m_sent(0)
+    , m_sentBytes(0)
+    , m_delivered(0)
+    , m_historyRequested(0)
+    , m_connectErrors(0)
+    , m_errors(0)
+    , m_disconnects(0)
+{
+    m_users.reserve(m_options.users);
+
+    m_connectTimer->setInterval(kTickInterval);
+    m_sendTimer->setInterval(kTickInterval);
+    connect(m_connectTimer, &QTimer::timeout, this, &LoadGenerator::onConnectTick);
+    connect(m_sendTimer, &QTimer::timeout, this, &LoadGenerator::onSendTick);
+}
+
+LoadGenerator::~LoadGenerator() = default;
+
+bool LoadGenerator::parseFanOut(const QString &name, FanOut *fanOut)
+{
+    if (name == "pairs") {
+        *fanOut = Pairs;
+    } else if (name == "random") {
+        *fanOut = Random;
+    } else if (name == "hotspot") {
+        *fanOut = Hotspot;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+QString LoadGenerator::fanOutName(FanOut fanOut)
+{
+    switch (fanOut) {
+    case Pairs:
+        return "pairs";
+    case Hotspot:
+        return "hotspot";
+    case Random:
+        break;
+    }
+    return "random";
+}
+
+void LoadGenerator::start()
+{
+    QTextStream(textOutput()) << QString("Starting %1 users against %2:%3 for %4 s (%5 fan-out)\n")
+                                     .arg(m_options.users)
+                                     .arg(m_options.host)
+                                     .arg(m_options.port)
+                                     .arg(m_options.duration)
+                                     .arg(fanOutName(m_options.fanOut));
+
+    m_clock.start();
+    m_sending = true;
+    m_connectTimer->start();
+    m_sendTimer->start();
+    QTimer::singleShot(m_options.duration * 1000, this, &LoadGenerator::onDurationElapsed);
+}
+
+void LoadGenerator::onConnectTick()
+{
+    const qint64 now = m_clock.nsecsElapsed();
+    m_connectCredit += m_options.connectRate * (now - m_lastConnectTick) / 1e9;
+    m_lastConnectTick = now;
+
+    while (m_connectCredit >= 1 && static_cast<int>(m_users.size()) < m_options.users) {
+        m_connectCredit -= 1;
+        connectUser(static_cast<int>(m_users.size()));
+    }
+
+    if (static_cast<int>(m_users.size()) >= m_options.users) {
+        m_connectTimer->stop();
+    }
+}
+
+void LoadGenerator::connectUser(int index)
+{
+    User user;
+    user.name = QString("%1%2").arg(m_options.userPrefix).arg(index);
+    user.client = new ChatClient(this);
+    m_users.push_back(user);
+
+    ChatClient *client = user.client;
+    // The server answers a successful registration with the full user list
+    connect(client, &ChatClient::userListUpdated, this, [this, index] {
+        if (!m_users[index].registered) {
+            onUserRegistered(index);
+        }
+    });
+    connect(client, &ChatClient::disconnected, this, [this, index] {
+        onUserDisconnected(index);
+    });
+    connect(client, &ChatClient::errorOccurred, this, [this, index] { onUserError(index); });
+    connect(client, &ChatClient::messageReceived, this, [this, index](const ChatMessage &msg) {
+        onUserMessage(index, msg);
+    });
+    connect(client, &ChatClient::chatHistoryFinished, this, [this, index] {
+        onUserHistoryFinished(index);
+    });
+
+    client->setUsername(user.name);
+    client->connectToServer(m_options.host, m_options.port);
+}
+
+void LoadGenerator::onUserRegistered(int index)
+{
+    const qint64 now = m_clock.nsecsElapsed();
+    m_users[index].registered = true;
+    m_online.append(index);
+    m_peakOnline = qMax(m_peakOnline, static_cast<int>(m_online.size()));
+
+    if (m_firstRegistered < 0) {
+        m_firstRegistered = now;
+    }
+    if (m_allRegistered < 0 && m_online.size() == m_options.users) {
+        m_allRegistered = now;
+    }
+}
+
+void LoadGenerator::onUserDisconnected(int index)
+{
+    if (m_stopping) {
+        return;
+    }
+
+    User &user = m_users[index];
+    if (user.registered) {
+        user.registered = false;
+        user.historyRequests.clear();
+        m_online.removeOne(index);
+        ++m_disconnects;
+    } else if (!user.failed) {
+        user.failed = true;
+        ++m_connectErrors;
+    }
+}
+
+void LoadGenerator::onUserError(int index)
+{
+    if (m_stopping) {
+        return;
+    }
+
+    User &user = m_users[index];
+    if (user.registered) {
+        ++m_errors;
+    } else if (!user.failed) {
+        user.failed = true; // Don't count its disconnect again
+        ++m_connectErrors;
+    }
+}
+
+void LoadGenerator::onUserMessage(int index, const ChatMessage &message)
+{
+    // Only the recipient's copy counts; servers from before "sent" acks also
+    // echo it back to the sender
+    if (message.from() == m_users[index].name) {
+        return;
+    }
+
+    const QString text = message.text();
+    const qsizetype tagSize = sizeof(kPayloadTag) - 1;
+    if (!text.startsWith(QLatin1String(kPayloadTag))) {
+        return;
+    }
+
+    bool ok;
+    const qsizetype end = text.indexOf(' ', tagSize);
+    const qint64 sentAt = QStringView(text).mid(tagSize, end - tagSize).toLongLong(&ok);
+    if (ok) {
+        m_latencies.push_back(m_clock.nsecsElapsed() - sentAt);
+        ++m_delivered;
+    }
+}
+
+void LoadGenerator::onUserHistoryFinished(int index)
+{
+    User &user = m_users[index];
+    if (!user.historyRequests.isEmpty()) {
+        m_historyLatencies.push_back(m_clock.nsecsElapsed() - user.historyRequests.dequeue());
+    }
+}
+
+void LoadGenerator::onSendTick()
+{
+    const qint64 now = m_clock.nsecsElapsed();
+    m_sendCredit += m_online.size() * m_options.messageRate * (now - m_lastSendTick) / 1e9;
+    m_lastSendTick = now;
+
+    if (!m_sending || m_online.isEmpty()) {
+        m_sendCredit = 0;
+        return;
+    }
+
+    // Round robin over online users keeps every user near messageRate
+    while (m_sendCredit >= 1) {
+        m_sendCredit -= 1;
+        m_nextSender %= m_online.size();
+        const int sender = m_online[m_nextSender++];
+        User &user = m_users[sender];
+
+        const int recipient = pickRecipient(sender);
+        if (recipient < 0) {
+            continue;
+        }
+        const QString &recipientName = m_users[recipient].name;
+
+        if (m_options.historyRatio > 0 && m_random.generateDouble() < m_options.historyRatio) {
+            user.historyRequests.enqueue(m_clock.nsecsElapsed());
+            user.client->requestChatHistory(recipientName);
+            ++m_historyRequested;
+        } else {
+            const QString payload = makePayload();
+            user.client->sendMessage(recipientName, payload);
+            ++m_sent;
+            m_sentBytes += payload.size();
+        }
+    }
+}
+
+int LoadGenerator::pickRecipient(int sender)
+{
+    switch (m_options.fanOut) {
+    case Pairs: {
+        const int partner = sender ^ 1;
+        if (partner < static_cast<int>(m_users.size()) && m_users[partner].registered) {
+            return partner;
+        }
+        return -1;
+    }
+    case Hotspot: {
+        const int hot = qMin(m_options.hotUsers, static_cast<int>(m_users.size()));
+        if (hot < 1 || (hot == 1 && sender == 0)) {
+            return -1;
+        }
+        int candidate = m_random.bounded(hot);
+        if (candidate == sender) {
+            candidate = (candidate + 1) % hot;
+        }
+        return m_users[candidate].registered ? candidate : -1;
+    }
+    case Random:
+        break;
+    }
+
+    if (m_online.size() < 2) {
+        return -1;
+    }
+    int candidate;
+    do {
+        candidate = m_online[m_random.bounded(static_cast<int>(m_online.size()))];
+    } while (candidate == sender);
+    return candidate;
+}
+
+QString LoadGenerator::makePayload() const
+{
+    QString payload = QString("%1%2 ").arg(kPayloadTag).arg(m_clock.nsecsElapsed());
+    if (payload.size() < m_options.messageSize) {
+        payload.append(QString(m_options.messageSize - payload.size(), 'x'));
+    }
+    return payload;
+}
+
+void LoadGenerator::onDurationElapsed()
+{
+    m_sending = false;
+    m_sendStopped = m_clock.nsecsElapsed();
+    m_connectTimer->stop();
+    m_sendTimer->stop();
+
+    QTextStream(textOutput()) << "Sending stopped, waiting for messages in flight\n";
+    QTimer::singleShot(kDrainTime, this, &LoadGenerator::onDrained);
+}
+
+void LoadGenerator::onDrained()
+{
+    m_stopping = true;
+
+    const QJsonObject results = report();
+    printReport(results);
+    writeJsonReport(results);
+
+    for (const User &user : m_users) {
+        user.client->disconnectFromServer();
+    }
+    emit finished();
+}
+
+QJsonObject LoadGenerator::report() const
+{
+    // Rates are over the time users could send: first registration to stop
+    const qint64 window = m_firstRegistered < 0 ? 0 : m_sendStopped - m_firstRegistered;
+    const double seconds = window / 1e9;
+
+    QJsonObject options;
+    options["host"] = m_options.host;
+    options["port"] = m_options.port;
+    options["users"] = m_options.users;
+    options["connect_rate"] = m_options.connectRate;
+    options["message_rate"] = m_options.messageRate;
+    options["message_size"] = m_options.messageSize;
+    options["fan_out"] = fanOutName(m_options.fanOut);
+    options["hot_users"] = m_options.hotUsers;
+    options["history_ratio"] = m_options.historyRatio;
+    options["duration"] = m_options.duration;
+    options["seed"] = static_cast<qint64>(m_options.seed);
+
+    QJsonObject connections;
+    connections["attempted"] = static_cast<qint64>(m_users.size());
+    connections["peak_online"] = m_peakOnline;
+    connections["online_at_end"] = static_cast<qint64>(m_online.size());
+    connections["ramp_up"] = m_allRegistered < 0 ? -1 : m_allRegistered / 1e9;
+    connections["connect_errors"] = m_connectErrors;
+    connections["errors"] = m_errors;
+    connections["disconnects"] = m_disconnects;
+
+    QJsonObject messages;
+    messages["sent"] = static_cast<qint64>(m_sent);
+    messages["delivered"] = static_cast<qint64>(m_delivered);
+    messages["bytes_sent"] = static_cast<qint64>(m_sentBytes);
+    messages["window"] = seconds;
+    messages["sent_per_second"] = seconds > 0 ? m_sent / seconds : 0;
+    messages["delivered_per_second"] = seconds > 0 ? m_delivered / seconds : 0;
+    messages["latency_ms"] = latencyJson(m_latencies);
+
+    QJsonObject history;
+    history["requested"] = static_cast<qint64>(m_historyRequested);
+    history["completed"] = static_cast<qint64>(m_historyLatencies.size());
+    history["latency_ms"] = latencyJson(m_historyLatencies);
+
+    QJsonObject results;
+    results["options"] = options;
+    results["connections"] = connections;
+    results["messages"] = messages;
+    results["history"] = history;
+    return results;
+}
+
+// Keeps stdout clean when the JSON report is written there
+FILE *LoadGenerator::textOutput() const
+{
+    return m_options.jsonPath == "-" ? stderr : stdout;
+}
+
+void LoadGenerator::printReport(const QJsonObject &report) const
+{
+    const QJsonObject connections = report["connections"].toObject();
+    const QJsonObject messages = report["messages"].toObject();
+    const QJsonObject history = report["history"].toObject();
+
+    QTextStream out(textOutput());
+    out << "\nConnections\n";
+    out << QString("  attempted %1, peak online %2, online at end %3\n")
+               .arg(connections["attempted"].toInteger())
+               .arg(connections["peak_online"].toInteger())
+               .arg(connections["online_at_end"].toInteger());
+    if (m_allRegistered >= 0) {
+        out << QString("  all users registered after %1 s\n")
+                   .arg(connections["ramp_up"].toDouble(), 0, 'f', 2);
+    }
+    out << QString("  connect errors %1, errors %2, unexpected disconnects %3\n")
+               .arg(connections["connect_errors"].toInteger())
+               .arg(connections["errors"].toInteger())
+               .arg(connections["disconnects"].toInteger());
+
+    out << "Messages\n";
+    out << QString("  sent %1 (%2/s), delivered %3 (%4/s) over %5 s\n")
+               .arg(messages["sent"].toInteger())
+               .arg(messages["sent_per_second"].toDouble(), 0, 'f', 1)
+               .arg(messages["delivered"].toInteger())
+               .arg(messages["delivered_per_second"].toDouble(), 0, 'f', 1)
+               .arg(messages["window"].toDouble(), 0, 'f', 2);
+    out << "  latency " << latencyLine(messages["latency_ms"].toObject()) << "\n";
+
+    if (history["requested"].toInteger() > 0) {
+        out << "History\n";
+        out << QString("  requested %1, completed %2\n")
+                   .arg(history["requested"].toInteger())
+                   .arg(history["completed"].toInteger());
+        out << "  latency " << latencyLine(history["latency_ms"].toObject()) << "\n";
+    }
+}
+
+bool LoadGenerator::writeJsonReport(const QJsonObject &report) const
+{
+    if (m_options.jsonPath.isEmpty()) {
+        return true;
+    }
+
+    const QByteArray json = QJsonDocument(report).toJson(QJsonDocument::Indented);
+    if (m_options.jsonPath == "-") {
+        QTextStream(stdout) << json;
+        return true;
+    }
+
+    QFile file(m_options.jsonPath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+        QTextStream(stderr) << "Failed to write JSON report to " << m_options.jsonPath << "\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,127 @@
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QList>
+#include <QObject>
+#include <QQueue>
+#include <QRandomGenerator>
+#include <QString>
+#include <cstdio>
+#include <vector>
+#include "chatmessage.h"
+
+class QTimer;
+class ChatClient;
+
+// Drives many simulated users, each a real ChatClient, against one server.
+// Every chat message carries the time it was sent, so the recipient can
+// measure end-to-end latency on the same clock; all users live in this
+// process and share its event loop.
+class LoadGenerator : public QObject
+{
+    Q_OBJECT
+public:
+    // Who a user sends to
+    enum FanOut {
+        Pairs,  // Fixed partner: user 2k with 2k+1
+        Random, // Any other connected user
+        Hotspot // One of the first hotUsers users, to load a few hot conversations
+    };
+
+    struct Options
+    {
+        QString host = "127.0.0.1";
+        quint16 port = 12345;
+        int users = 100;
+        double connectRate = 50;  // New connections per second
+        double messageRate = 1.0; // Messages per user per second
+        int messageSize = 64;     // Characters per message
+        FanOut fanOut = Random;
+        int hotUsers = 10;
+        double historyRatio = 0; // Share of actions that are history requests
+        int duration = 30;       // Seconds, counted from the first connection
+        QString userPrefix = "loadgen";
+        quint32 seed = 1;
+        QString jsonPath; // Where to write the JSON report; "-" for stdout, which
+                          // moves progress and the text report to stderr
+    };
+
+    explicit LoadGenerator(const Options &options, QObject *parent = nullptr);
+    ~LoadGenerator() override;
+
+    void start();
+
+    static bool parseFanOut(const QString &name, FanOut *fanOut);
+    static QString fanOutName(FanOut fanOut);
+
+signals:
+    void finished();
+
+private slots:
+    void onConnectTick();
+    void onSendTick();
+    void onDurationElapsed();
+    void onDrained();
+
+private:
+    Q_DISABLE_COPY(LoadGenerator)
+
+    struct User
+    {
+        ChatClient *client = nullptr;
+        QString name;
+        bool registered = false;
+        bool failed = false; // Counted as a connect error already
+        QQueue<qint64> historyRequests; // Send times of unanswered history requests
+    };
+
+    void connectUser(int index);
+    void onUserRegistered(int index);
+    void onUserDisconnected(int index);
+    void onUserError(int index);
+    void onUserMessage(int index, const ChatMessage &message);
+    void onUserHistoryFinished(int index);
+
+    int pickRecipient(int sender);
+    QString makePayload() const;
+
+    QJsonObject report() const;
+    FILE *textOutput() const;
+    void printReport(const QJsonObject &report) const;
+    bool writeJsonReport(const QJsonObject &report) const;
+
+    Options m_options;
+    QRandomGenerator m_random;
+    QElapsedTimer m_clock;
+    QTimer *m_connectTimer;
+    QTimer *m_sendTimer;
+
+    std::vector<User> m_users;
+    QList<int> m_online; // Registered users, the senders and recipients
+    int m_nextSender;
+    double m_connectCredit;
+    double m_sendCredit;
+    qint64 m_lastConnectTick;
+    qint64 m_lastSendTick;
+    bool m_sending;
+    bool m_stopping;
+
+    // Measurements; times are nanoseconds on m_clock
+    qint64 m_firstRegistered;
+    qint64 m_allRegistered;
+    qint64 m_sendStopped;
+    int m_peakOnline;
+    quint64 m_sent;
+    quint64 m_sentBytes;
+    quint64 m_delivered;
+    quint64 m_historyRequested;
+    std::vector<qint64> m_latencies;
+    std::vector<qint64> m_historyLatencies;
+    int m_connectErrors; // Before registration: refused, rejected, timed out
+    int m_errors;        // After registration
+    int m_disconnects;   // Registered users dropped before the run ended
+};
+
+#endif // LOADGENERATOR_H
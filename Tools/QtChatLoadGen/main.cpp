@@ -0,0 +1,155 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QTextStream>
+#include "loadgenerator.h"
+
+namespace {
+
+// Fills options from the command line; returns false if it should exit
+bool parseOptions(const QStringList &arguments, LoadGenerator::Options *options)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Load generator and latency benchmark for the Qt chat server");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption hostOption({"H", "host"}, "Server address (default 127.0.0.1).", "host");
+    QCommandLineOption portOption({"p", "port"}, "Server port (default 12345).", "port");
+    QCommandLineOption usersOption({"u", "users"}, "Simulated users (default 100).", "count");
+    QCommandLineOption connectRateOption("connect-rate",
+                                         "New connections per second (default 50).",
+                                         "rate");
+    QCommandLineOption messageRateOption("message-rate",
+                                         "Messages per user per second (default 1).",
+                                         "rate");
+    QCommandLineOption messageSizeOption("message-size",
+                                         "Characters per message (default 64).",
+                                         "chars");
+    QCommandLineOption fanOutOption("fan-out",
+                                    "Who users talk to: pairs, random or hotspot.",
+                                    "pattern");
+    QCommandLineOption hotUsersOption("hot-users",
+                                      "Users receiving all traffic with hotspot (default 10).",
+                                      "count");
+    QCommandLineOption historyRatioOption("history-ratio",
+                                          "Share of actions that request history (0-1).",
+                                          "ratio");
+    QCommandLineOption durationOption({"t", "duration"}, "Run time (s, default 30).", "seconds");
+    QCommandLineOption prefixOption("user-prefix",
+                                    "Prefix of simulated user names (default loadgen).",
+                                    "prefix");
+    QCommandLineOption seedOption("seed", "Seed for recipient and action choice.", "seed");
+    QCommandLineOption jsonOption("json", "Write a JSON report to file (- for stdout).", "file");
+
+    parser.addOptions({hostOption,
+                       portOption,
+                       usersOption,
+                       connectRateOption,
+                       messageRateOption,
+                       messageSizeOption,
+                       fanOutOption,
+                       hotUsersOption,
+                       historyRatioOption,
+                       durationOption,
+                       prefixOption,
+                       seedOption,
+                       jsonOption});
+    parser.process(arguments);
+
+    QTextStream err(stderr);
+    bool ok = true;
+    auto checked = [&](bool valid, const QCommandLineOption &option) {
+        if (!valid) {
+            err << "Invalid value for --" << option.names().constLast() << "\n";
+            ok = false;
+        }
+    };
+
+    if (parser.isSet(hostOption)) {
+        options->host = parser.value(hostOption);
+    }
+    if (parser.isSet(portOption)) {
+        bool valid;
+        options->port = parser.value(portOption).toUShort(&valid);
+        checked(valid && options->port > 0, portOption);
+    }
+    if (parser.isSet(usersOption)) {
+        bool valid;
+        options->users = parser.value(usersOption).toInt(&valid);
+        checked(valid && options->users > 0, usersOption);
+    }
+    if (parser.isSet(connectRateOption)) {
+        bool valid;
+        options->connectRate = parser.value(connectRateOption).toDouble(&valid);
+        checked(valid && options->connectRate > 0, connectRateOption);
+    }
+    if (parser.isSet(messageRateOption)) {
+        bool valid;
+        options->messageRate = parser.value(messageRateOption).toDouble(&valid);
+        checked(valid && options->messageRate >= 0, messageRateOption);
+    }
+    if (parser.isSet(messageSizeOption)) {
+        bool valid;
+        options->messageSize = parser.value(messageSizeOption).toInt(&valid);
+        checked(valid && options->messageSize >= 0, messageSizeOption);
+    }
+    if (parser.isSet(fanOutOption)) {
+        checked(LoadGenerator::parseFanOut(parser.value(fanOutOption), &options->fanOut),
+                fanOutOption);
+    }
+    if (parser.isSet(hotUsersOption)) {
+        bool valid;
+        options->hotUsers = parser.value(hotUsersOption).toInt(&valid);
+        checked(valid && options->hotUsers > 0, hotUsersOption);
+    }
+    if (parser.isSet(historyRatioOption)) {
+        bool valid;
+        options->historyRatio = parser.value(historyRatioOption).toDouble(&valid);
+        checked(valid && options->historyRatio >= 0 && options->historyRatio <= 1,
+                historyRatioOption);
+    }
+    if (parser.isSet(durationOption)) {
+        bool valid;
+        options->duration = parser.value(durationOption).toInt(&valid);
+        checked(valid && options->duration > 0, durationOption);
+    }
+    if (parser.isSet(prefixOption)) {
+        options->userPrefix = parser.value(prefixOption);
+        checked(!options->userPrefix.isEmpty(), prefixOption);
+    }
+    if (parser.isSet(seedOption)) {
+        bool valid;
+        options->seed = parser.value(seedOption).toUInt(&valid);
+        checked(valid, seedOption);
+    }
+    if (parser.isSet(jsonOption)) {
+        options->jsonPath = parser.value(jsonOption);
+    }
+
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    // Set application metadata
+    QCoreApplication::setApplicationName("QtChatLoadGen");
+    QCoreApplication::setApplicationVersion("1.0");
+    QCoreApplication::setOrganizationName("QtChatApp");
+    QCoreApplication::setOrganizationDomain("qtchatapp.local");
+
+    LoadGenerator::Options options;
+    if (!parseOptions(app.arguments(), &options)) {
+        return 1;
+    }
+
+    LoadGenerator generator(options);
+    QObject::connect(&generator, &LoadGenerator::finished, &app, &QCoreApplication::quit,
+                     Qt::QueuedConnection);
+    generator.start();
+
+    return app.exec();
+}